@@ -162,6 +162,8 @@ auto Activation::activation(Activations value) -> Activations
         // Enable systemd signals
         Activation::subscribeToSystemdSignals();
 
+        // Activating from now on, so a failure of flashWrite() shows.
+        softwareServer::Activation::activation(value);
         flashWrite();
 
 #if defined UBIFS_LAYOUT || defined MMC_LAYOUT
@@ -170,6 +172,13 @@ auto Activation::activation(Activations value) -> Activations
 
 #else // STATIC_LAYOUT
 
+        // flashWrite() fails the activation if a copied image is corrupt.
+        if (softwareServer::Activation::activation() ==
+            softwareServer::Activation::Activations::Failed)
+        {
+            return softwareServer::Activation::Activations::Failed;
+        }
+
         onFlashWriteSuccess();
         return softwareServer::Activation::activation(
             softwareServer::Activation::Activations::Active);
@@ -246,11 +255,15 @@ auto HostActivation::activation(Activations value) -> Activations
             Activation::unsubscribeFromSystemdSignals();
             // Remove version object from image manager
             Activation::deleteImageManagerObject();
-            // Create active association
-            parent.createActiveAssociation(path);
-            // Only BIOS image need to create FunctionaAssociation
-            // because BIOS already updated
-            parent.createFunctionalAssociation(path);
+            {
+                // Create active and functional associations, sent at once
+                // before the activation becomes Active
+                ItemUpdater::AssociationBatch batch(parent);
+                parent.createActiveAssociation(path);
+                // Only BIOS image need to create FunctionaAssociation
+                // because BIOS already updated
+                parent.createFunctionalAssociation(path);
+            }
             return softwareServer::Activation::activation(
                 softwareServer::Activation::Activations::Active);
         }
@@ -287,12 +300,15 @@ void Activation::onFlashWriteSuccess()
     // Remove version object from image manager
     Activation::deleteImageManagerObject();
 
-    // Create active association
-    parent.createActiveAssociation(path);
+    {
+        // Create active and updateable associations, sent at once
+        ItemUpdater::AssociationBatch batch(parent);
+        parent.createActiveAssociation(path);
 
-    // Create updateable association as this
-    // can be re-programmed.
-    parent.createUpdateableAssociation(path);
+        // Create updateable association as this
+        // can be re-programmed.
+        parent.createUpdateableAssociation(path);
+    }
 
     if (Activation::checkApplyTimeImmediate() == true)
     {
@@ -350,11 +366,39 @@ auto Activation::requestedActivation(RequestedActivations value)
     return softwareServer::Activation::requestedActivation(value);
 }
 
+RedundancyPriority::RedundancyPriority(sdbusplus::bus::bus& bus,
+                                       const std::string& path,
+                                       Activation& parent, uint8_t value,
+                                       bool freePriority) :
+    RedundancyPriorityInherit(bus, path.c_str(), action::emit_interface_added),
+    parent(parent)
+{
+    parent.parent.priorities.add(parent.versionId, value);
+
+    // Set Property
+    if (freePriority)
+    {
+        priority(value);
+    }
+    else
+    {
+        sdbusPriority(value);
+    }
+}
+
+RedundancyPriority::~RedundancyPriority()
+{
+    parent.parent.priorities.remove(parent.versionId);
+}
+
 uint8_t RedundancyPriority::priority(uint8_t value)
 {
     // Set the priority value so that the freePriority() function can order
     // the versions by priority.
+    // The versions moved by freePriority() are stored along with this one.
+    StateBatch stateBatch;
     auto newPriority = softwareServer::RedundancyPriority::priority(value);
+    parent.parent.priorities.set(parent.versionId, value);
     parent.parent.savePriority(parent.versionId, value);
     parent.parent.freePriority(value, parent.versionId);
     return newPriority;
@@ -362,6 +406,7 @@ uint8_t RedundancyPriority::priority(uint8_t value)
 
 uint8_t RedundancyPriority::sdbusPriority(uint8_t value)
 {
+    parent.parent.priorities.set(parent.versionId, value);
     parent.parent.savePriority(parent.versionId, value);
     return softwareServer::RedundancyPriority::priority(value);
 }
@@ -392,11 +437,37 @@ void Activation::unitStateChange(sdbusplus::message::message& msg)
 bool Activation::verifySignature(const fs::path& imageDir,
                                  const fs::path& confDir)
 {
-    using Signature = phosphor::software::image::Signature;
+    // Images of a tarball whose signature was checked at ingest, and a
+    // retried activation of unchanged images verified with unchanged keys,
+    // need not be verified again.
+    auto digests = image::restoreDigests(DIGEST_DIR, versionId, imageDir);
+    auto fingerprint = image::fingerprint(imageDir, confDir, digests);
+    if (!fingerprint.empty() &&
+        image::restoreIngestVerified(INGEST_VERIFIED_DIR, versionId) ==
+            fingerprint)
+    {
+        log<level::INFO>("Image tarball signature was verified at ingest",
+                         entry("VERSIONID=%s", versionId.c_str()));
+        return true;
+    }
+
+    std::string verified;
+    if (!fingerprint.empty() && restoreVerified(versionId, verified) &&
+        verified == fingerprint)
+    {
+        log<level::INFO>("Image signatures were verified before",
+                         entry("VERSIONID=%s", versionId.c_str()));
+        return true;
+    }
 
-    Signature signature(imageDir, confDir);
+    image::Signature signature(imageDir, confDir, std::move(digests));
 
-    return signature.verify();
+    auto valid = signature.verify();
+    if (valid && !fingerprint.empty())
+    {
+        storeVerified(versionId, fingerprint);
+    }
+    return valid;
 }
 
 void Activation::onVerifyFailed()
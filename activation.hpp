@@ -72,21 +72,12 @@ class RedundancyPriority : public RedundancyPriorityInherit
      */
     RedundancyPriority(sdbusplus::bus::bus& bus, const std::string& path,
                        Activation& parent, uint8_t value,
-                       bool freePriority = true) :
-        RedundancyPriorityInherit(bus, path.c_str(),
-                                  action::emit_interface_added),
-        parent(parent)
-    {
-        // Set Property
-        if (freePriority)
-        {
-            priority(value);
-        }
-        else
-        {
-            sdbusPriority(value);
-        }
-    }
+                       bool freePriority = true);
+
+    /** @brief Removes the priority from the priority index of the
+     *         ItemUpdater.
+     */
+    ~RedundancyPriority();
 
     /** @brief Overridden Priority property set function, calls freePriority
      *         to bump the duplicated priority values.
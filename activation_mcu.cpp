@@ -94,11 +94,15 @@ auto McuActivation::activation(Activations value) -> Activations
             Activation::unsubscribeFromSystemdSignals();
             // Remove version object from image manager
             Activation::deleteImageManagerObject();
-            // Create active association
-            parent.createActiveAssociation(path);
-            // Only BIOS image need to create FunctionaAssociation
-            // because BIOS already updated
-            parent.createFunctionalAssociation(path);
+            {
+                // Create active and functional associations, sent at once
+                // before the activation becomes Active
+                ItemUpdater::AssociationBatch batch(parent);
+                parent.createActiveAssociation(path);
+                // Only BIOS image need to create FunctionaAssociation
+                // because BIOS already updated
+                parent.createFunctionalAssociation(path);
+            }
             return softwareServer::Activation::activation(
                 softwareServer::Activation::Activations::Active);
         }
@@ -0,0 +1,345 @@
+#include "config.h"
+
+#include "image_manager.hpp"
+#include "tar_extractor.hpp"
+#include "version.hpp"
+
+#include <sys/resource.h>
+#include <systemd/sd-event.h>
+
+#include <sdbusplus/bus.hpp>
+
+#include <algorithm>
+#include <array>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <memory>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+namespace fs = std::filesystem;
+using namespace phosphor::software::manager;
+
+namespace
+{
+
+constexpr uint64_t MiB = 1024 * 1024;
+constexpr auto machine = "benchmark";
+
+/** @brief The image files and purpose of each kind of tarball, selected by
+ *         the first benchmark argument. Members beyond the image files are
+ *         named image-extra-<n>.
+ */
+struct Kind
+{
+    std::vector<std::string> images;
+    std::string purpose;
+};
+
+const std::array<Kind, 3> kinds = {{
+    {{"image-kernel", "image-rofs", "image-rwfs", "image-u-boot"},
+     "xyz.openbmc_project.Software.Version.VersionPurpose.BMC"},
+    {{"image-bios"},
+     "xyz.openbmc_project.Software.Version.VersionPurpose.Host"},
+    {{"image-mcu"},
+     "xyz.openbmc_project.Software.Version.VersionPurpose.MCU"},
+}};
+
+/** @brief Write value as a NUL terminated octal number of len bytes */
+void octal(char* field, size_t len, uint64_t value)
+{
+    field[len - 1] = '\0';
+    for (size_t i = len - 1; i-- > 0;)
+    {
+        field[i] = '0' + (value & 7);
+        value >>= 3;
+    }
+}
+
+/** @brief Append a regular file member to a ustar archive */
+void writeMember(std::ofstream& os, const std::string& name,
+                 const char* data, uint64_t size)
+{
+    std::array<char, 512> header{};
+    std::memcpy(&header[0], name.data(), std::min<size_t>(name.size(), 99));
+    octal(&header[100], 8, 0644);
+    octal(&header[108], 8, 0);
+    octal(&header[116], 8, 0);
+    octal(&header[124], 12, size);
+    octal(&header[136], 12, 0);
+    header[156] = '0';
+    std::memcpy(&header[257], "ustar", 6);
+    std::memcpy(&header[263], "00", 2);
+
+    std::memset(&header[148], ' ', 8);
+    uint64_t sum = 0;
+    for (unsigned char c : header)
+    {
+        sum += c;
+    }
+    octal(&header[148], 7, sum);
+
+    os.write(header.data(), header.size());
+    os.write(data, size);
+
+    std::array<char, 512> padding{};
+    os.write(padding.data(), (512 - size % 512) % 512);
+}
+
+/** @brief Random, so incompressible, image data of the given size */
+const std::string& payload(uint64_t size)
+{
+    static std::string data;
+    if (data.size() < size)
+    {
+        std::mt19937_64 random(size);
+        data.resize(size);
+        for (size_t i = 0; i + 8 <= data.size(); i += 8)
+        {
+            auto value = random();
+            std::memcpy(&data[i], &value, 8);
+        }
+    }
+    return data;
+}
+
+/** @brief Write a synthetic tarball
+ *
+ *  @param[in] path    - The tarball path
+ *  @param[in] kind    - Index into kinds
+ *  @param[in] version - The manifest version
+ *  @param[in] size    - Size of all the images together
+ *  @param[in] members - Number of images the size is split into
+ */
+void makeTarball(const fs::path& path, size_t kind, const std::string& version,
+                 uint64_t size, size_t members)
+{
+    const auto& images = kinds.at(kind).images;
+    auto manifest = "purpose=" + kinds.at(kind).purpose +
+                    "\nversion=" + version +
+                    "\nKeyType=OpenBMC\nHashType=RSA-SHA256\nMachineName=" +
+                    machine + "\n";
+
+    std::ofstream os(path, std::ios::binary | std::ios::trunc);
+    writeMember(os, MANIFEST_FILE_NAME, manifest.data(), manifest.size());
+
+    const auto& data = payload(size);
+    members = std::max<size_t>(members, 1);
+    for (size_t i = 0; i < members; i++)
+    {
+        auto name = i < images.size()
+                        ? images[i]
+                        : "image-extra-" + std::to_string(i - images.size());
+        auto begin = size * i / members;
+        auto end = size * (i + 1) / members;
+        writeMember(os, name, data.data() + begin, end - begin);
+    }
+
+    std::array<char, 1024> trailer{};
+    os.write(trailer.data(), trailer.size());
+    os.close();
+    if (!os)
+    {
+        throw std::runtime_error("Failed to write " + path.string());
+    }
+}
+
+/** @brief The upload dir and os-release file of the benchmarks */
+void prepareDirs()
+{
+    fs::create_directories(IMG_UPLOAD_DIR);
+    std::ofstream os(OS_RELEASE_FILE, std::ios::trunc);
+    os << "VERSION_ID=\"benchmark\"\n"
+       << "OPENBMC_TARGET_MACHINE=\"" << machine << "\"\n";
+}
+
+/** @brief Report the peak RSS of the process so far. Run one benchmark at
+ *         a time, e.g. with --benchmark_filter, to attribute it.
+ */
+void reportPeakRss(benchmark::State& state)
+{
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0)
+    {
+        state.counters["PeakRSS_KiB"] = usage.ru_maxrss;
+    }
+}
+
+/** @struct Service
+ *  @brief A Manager on the default bus, as run by the version manager.
+ */
+struct Service
+{
+    Service() : bus(sdbusplus::bus::new_default())
+    {
+        sd_event_default(&loop);
+        bus.attach_event(loop, SD_EVENT_PRIORITY_NORMAL);
+        manager = std::make_unique<Manager>(bus, loop);
+    }
+
+    ~Service()
+    {
+        manager.reset();
+        bus.detach_event();
+        sd_event_unref(loop);
+    }
+
+    sdbusplus::bus::bus bus;
+    sd_event* loop = nullptr;
+    std::unique_ptr<Manager> manager;
+};
+
+} // namespace
+
+/** @brief Manifest lookup, as done for the version and machine name */
+static void BM_GetValue(benchmark::State& state)
+{
+    prepareDirs();
+    auto manifest = fs::path(IMG_UPLOAD_DIR) / "bench-manifest";
+    {
+        std::ofstream os(manifest);
+        os << "purpose=" << kinds[0].purpose << "\nversion=bench-version\n"
+           << "KeyType=OpenBMC\nHashType=RSA-SHA256\nMachineName=" << machine
+           << "\n";
+    }
+
+    for (auto _ : state)
+    {
+        benchmark::DoNotOptimize(
+            Version::getValue(manifest.string(), "MachineName"));
+    }
+
+    fs::remove(manifest);
+    reportPeakRss(state);
+}
+BENCHMARK(BM_GetValue);
+
+/** @brief Manifest check ahead of extraction: reading the MANIFEST member
+ *         of a tarball of the given kind, MiB and members.
+ */
+static void BM_ReadManifest(benchmark::State& state)
+{
+    prepareDirs();
+    auto tarball = fs::path(IMG_UPLOAD_DIR) / "bench-manifest.tar";
+    makeTarball(tarball, state.range(0), "bench-version",
+                state.range(1) * MiB, state.range(2));
+
+    std::string data;
+    for (auto _ : state)
+    {
+        tar::readMember(tarball, MANIFEST_FILE_NAME, data, 64 * 1024);
+        benchmark::DoNotOptimize(data);
+    }
+
+    fs::remove(tarball);
+    reportPeakRss(state);
+}
+BENCHMARK(BM_ReadManifest)
+    ->ArgNames({"kind", "MiB", "members"})
+    ->ArgsProduct({{0, 1, 2}, {64}, {4}});
+
+/** @brief Extraction, the body of Manager::unTar, of a tarball of the given
+ *         kind, MiB and members into the upload dir.
+ */
+static void BM_UnTar(benchmark::State& state)
+{
+    prepareDirs();
+    auto tarball = fs::path(IMG_UPLOAD_DIR) / "bench-untar.tar";
+    auto dir = fs::path(IMG_UPLOAD_DIR) / "bench-untar";
+    makeTarball(tarball, state.range(0), "bench-version",
+                state.range(1) * MiB, state.range(2));
+
+    for (auto _ : state)
+    {
+        state.PauseTiming();
+        fs::remove_all(dir);
+        fs::create_directories(dir);
+        state.ResumeTiming();
+
+        tar::extract(tarball, dir);
+    }
+
+    state.SetBytesProcessed(state.iterations() * fs::file_size(tarball));
+    fs::remove_all(dir);
+    fs::remove(tarball);
+    reportPeakRss(state);
+}
+BENCHMARK(BM_UnTar)
+    ->ArgNames({"kind", "MiB", "members"})
+    ->ArgsProduct({{0, 1, 2}, {8, 64}, {4, 32}})
+    ->Unit(benchmark::kMillisecond);
+
+/** @brief Complete ingest of a tarball of the given kind, MiB and members:
+ *         from processImage until the Version object is created on the
+ *         event loop. Needs a D-Bus session or system bus.
+ */
+static void BM_ProcessImage(benchmark::State& state)
+{
+    prepareDirs();
+    std::unique_ptr<Service> service;
+    try
+    {
+        service = std::make_unique<Service>();
+    }
+    catch (const std::exception& e)
+    {
+        state.SkipWithError(e.what());
+        return;
+    }
+
+    uint64_t bytes = 0;
+    size_t count = 0;
+    for (auto _ : state)
+    {
+        state.PauseTiming();
+        auto version = "bench-" + std::to_string(count++);
+        auto id = Version::getId(version);
+        auto tarball = fs::path(IMG_UPLOAD_DIR) / (version + ".tar");
+        makeTarball(tarball, state.range(0), version, state.range(1) * MiB,
+                    state.range(2));
+        bytes += fs::file_size(tarball);
+        state.ResumeTiming();
+
+        if (service->manager->processImage(tarball.string()) < 0)
+        {
+            state.SkipWithError("processImage failed");
+            break;
+        }
+
+        // The image dir appears in the same event loop callback that
+        // creates the Version object.
+        auto imageDir = fs::path(IMG_UPLOAD_DIR) / id;
+        auto deadline =
+            std::chrono::steady_clock::now() + std::chrono::seconds(60);
+        while (!fs::exists(imageDir) &&
+               std::chrono::steady_clock::now() < deadline)
+        {
+            sd_event_run(service->loop, 100000);
+        }
+        if (!fs::exists(imageDir))
+        {
+            state.SkipWithError("Image was not processed");
+            break;
+        }
+
+        state.PauseTiming();
+        service->manager->erase(id);
+        state.ResumeTiming();
+    }
+
+    state.SetBytesProcessed(bytes);
+    reportPeakRss(state);
+}
+BENCHMARK(BM_ProcessImage)
+    ->ArgNames({"kind", "MiB", "members"})
+    ->ArgsProduct({{0, 1, 2}, {8, 64}, {4}})
+    ->Unit(benchmark::kMillisecond)
+    ->UseRealTime();
+
+BENCHMARK_MAIN();
@@ -0,0 +1,418 @@
+#include "config.h"
+
+#include "hasher.hpp"
+#include "image_verify.hpp"
+#include "tar_index.hpp"
+
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
+#include <openssl/pem.h>
+#include <openssl/rsa.h>
+#include <sys/resource.h>
+
+#include <array>
+#include <atomic>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <new>
+#include <random>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <benchmark/benchmark.h>
+
+namespace fs = std::filesystem;
+using namespace phosphor::software::image;
+namespace tar = phosphor::software::manager::tar;
+
+namespace
+{
+
+constexpr uint64_t MiB = 1024 * 1024;
+constexpr auto keyType = "OpenBMC";
+
+/** @brief The hash functions, selected by the hash benchmark argument */
+const std::array<const char*, 3> hashTypes = {"RSA-SHA256", "RSA-SHA384",
+                                              "RSA-SHA512"};
+
+/** @brief Allocations through operator new, from any thread */
+std::atomic<uint64_t> allocations{0};
+
+/** @brief Allocations by OpenSSL, from any thread */
+std::atomic<uint64_t> opensslAllocations{0};
+
+void* opensslMalloc(size_t size, const char*, int)
+{
+    opensslAllocations.fetch_add(1, std::memory_order_relaxed);
+    return std::malloc(size);
+}
+
+void* opensslRealloc(void* ptr, size_t size, const char*, int)
+{
+    if (ptr == nullptr)
+    {
+        opensslAllocations.fetch_add(1, std::memory_order_relaxed);
+    }
+    return std::realloc(ptr, size);
+}
+
+void opensslFree(void* ptr, const char*, int)
+{
+    std::free(ptr);
+}
+
+/** @struct AllocationCounter
+ *  @brief Reports the allocations made while it exists, per iteration.
+ */
+struct AllocationCounter
+{
+    explicit AllocationCounter(benchmark::State& state) :
+        state(state), cxx(allocations.load()),
+        openssl(opensslAllocations.load())
+    {}
+
+    ~AllocationCounter()
+    {
+        state.counters["Allocs"] = benchmark::Counter(
+            allocations.load() - cxx, benchmark::Counter::kAvgIterations);
+        state.counters["OpenSSLAllocs"] =
+            benchmark::Counter(opensslAllocations.load() - openssl,
+                               benchmark::Counter::kAvgIterations);
+    }
+
+    benchmark::State& state;
+    uint64_t cxx;
+    uint64_t openssl;
+};
+
+/** @brief Random, so incompressible, image data of the given size */
+const std::string& payload(uint64_t size)
+{
+    static std::string data;
+    if (data.size() < size)
+    {
+        std::mt19937_64 random(size);
+        data.resize(size);
+        for (size_t i = 0; i + 8 <= data.size(); i += 8)
+        {
+            auto value = random();
+            std::memcpy(&data[i], &value, 8);
+        }
+    }
+    return data;
+}
+
+/** @brief A generated RSA key of the given size, kept for the whole run as
+ *         4096 bit keys take a while to generate.
+ */
+EVP_PKEY* privateKey(int bits)
+{
+    static std::map<int, std::unique_ptr<EVP_PKEY, decltype(&::EVP_PKEY_free)>>
+        keys;
+
+    auto it = keys.find(bits);
+    if (it != keys.end())
+    {
+        return it->second.get();
+    }
+
+    std::unique_ptr<EVP_PKEY_CTX, decltype(&::EVP_PKEY_CTX_free)> ctx(
+        EVP_PKEY_CTX_new_id(EVP_PKEY_RSA, nullptr), ::EVP_PKEY_CTX_free);
+    EVP_PKEY* key = nullptr;
+    if (!ctx || EVP_PKEY_keygen_init(ctx.get()) <= 0 ||
+        EVP_PKEY_CTX_set_rsa_keygen_bits(ctx.get(), bits) <= 0 ||
+        EVP_PKEY_keygen(ctx.get(), &key) <= 0)
+    {
+        throw std::runtime_error("Failed to generate a key");
+    }
+
+    return keys.emplace(bits, decltype(keys)::mapped_type(key, ::EVP_PKEY_free))
+        .first->second.get();
+}
+
+/** @brief Write data to a file */
+void writeFile(const fs::path& path, std::string_view data)
+{
+    std::ofstream os(path, std::ios::binary | std::ios::trunc);
+    os.write(data.data(), data.size());
+    os.close();
+    if (!os)
+    {
+        throw std::runtime_error("Failed to write " + path.string());
+    }
+}
+
+/** @brief Write the public part of a key as PEM */
+void writePublicKey(const fs::path& path, EVP_PKEY* key)
+{
+    std::unique_ptr<BIO, decltype(&::BIO_free)> bio(
+        BIO_new_file(path.c_str(), "w"), ::BIO_free);
+    if (!bio || PEM_write_bio_PUBKEY(bio.get(), key) != 1)
+    {
+        throw std::runtime_error("Failed to write " + path.string());
+    }
+}
+
+/** @brief Sign the concatenation of files, as done by the image build */
+void sign(const std::vector<fs::path>& files, const fs::path& signature,
+          EVP_PKEY* key, const std::string& hashType)
+{
+    std::unique_ptr<EVP_MD_CTX, decltype(&::EVP_MD_CTX_free)> ctx(
+        EVP_MD_CTX_new(), ::EVP_MD_CTX_free);
+    if (!ctx || EVP_DigestSignInit(ctx.get(), nullptr,
+                                   EVP_get_digestbyname(hashType.c_str()),
+                                   nullptr, key) != 1)
+    {
+        throw std::runtime_error("Failed to sign " + signature.string());
+    }
+
+    for (const auto& file : files)
+    {
+        std::ifstream is(file, std::ios::binary);
+        std::vector<char> buffer(MiB);
+        while (is.read(buffer.data(), buffer.size()) || is.gcount() > 0)
+        {
+            EVP_DigestSignUpdate(ctx.get(), buffer.data(), is.gcount());
+        }
+    }
+
+    size_t len = 0;
+    EVP_DigestSignFinal(ctx.get(), nullptr, &len);
+    std::string value(len, '\0');
+    if (EVP_DigestSignFinal(ctx.get(),
+                            reinterpret_cast<unsigned char*>(&value[0]),
+                            &len) != 1)
+    {
+        throw std::runtime_error("Failed to sign " + signature.string());
+    }
+    value.resize(len);
+    writeFile(signature, value);
+}
+
+/** @struct Fixture
+ *  @brief A signed configuration dir and an image dir signed by the same
+ *         generated key, laid out as after ingest: MANIFEST, publickey, an
+ *         optional image-rofs and their signatures, and the signature over
+ *         all of them checked by the full image verification.
+ */
+struct Fixture
+{
+    /** @brief Generate the dirs
+     *
+     *  @param[in] bits     - RSA key size
+     *  @param[in] hashType - Hash function, as in the manifest
+     *  @param[in] size     - image-rofs size, no image-rofs if 0
+     */
+    Fixture(int bits, const std::string& hashType, uint64_t size)
+    {
+        // A dir of its own per key and hash function so the key cache does
+        // not have to tell rewritten keys apart.
+        auto base = fs::path(IMG_UPLOAD_DIR) /
+                    ("bench-verify-" + std::to_string(bits) + "-" + hashType);
+        confDir = base / "conf";
+        imageDir = base / "image";
+        fs::remove_all(base);
+        fs::create_directories(confDir / keyType);
+        fs::create_directories(imageDir);
+
+        auto key = privateKey(bits);
+        writePublicKey(confDir / keyType / PUBLICKEY_FILE_NAME, key);
+        writeFile(confDir / keyType / HASH_FILE_NAME,
+                  "HashType=" + hashType + "\n");
+
+        writeFile(imageDir / MANIFEST_FILE_NAME,
+                  "purpose=xyz.openbmc_project.Software.Version."
+                  "VersionPurpose.BMC\nversion=bench-version\nKeyType=" +
+                      std::string(keyType) + "\nHashType=" + hashType +
+                      "\nMachineName=benchmark\n");
+        writePublicKey(imageDir / PUBLICKEY_FILE_NAME, key);
+
+        std::vector<fs::path> signatures;
+        std::vector<std::string> files;
+        if (size > 0)
+        {
+            writeFile(imageDir / "image-rofs",
+                      std::string_view(payload(size)).substr(0, size));
+            files.emplace_back("image-rofs");
+        }
+        files.emplace_back(MANIFEST_FILE_NAME);
+        files.emplace_back(PUBLICKEY_FILE_NAME);
+        for (const auto& file : files)
+        {
+            auto signature = imageDir / (file + SIGNATURE_FILE_EXT);
+            sign({imageDir / file}, signature, key, hashType);
+            signatures.push_back(signature);
+        }
+        sign(signatures, imageDir / ("image-full" SIGNATURE_FILE_EXT), key,
+             hashType);
+    }
+
+    ~Fixture()
+    {
+        fs::remove_all(imageDir.parent_path());
+    }
+
+    fs::path confDir;
+    fs::path imageDir;
+};
+
+/** @brief Report the peak RSS of the process so far. Run one benchmark at
+ *         a time, e.g. with --benchmark_filter, to attribute it.
+ */
+void reportPeakRss(benchmark::State& state)
+{
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) == 0)
+    {
+        state.counters["PeakRSS_KiB"] = usage.ru_maxrss;
+    }
+}
+
+} // namespace
+
+// Counts the allocations of the verification. Not inlined into its callers,
+// where the compiler would see them free what operator new returned.
+[[gnu::noinline]] void* operator new(size_t size)
+{
+    allocations.fetch_add(1, std::memory_order_relaxed);
+    if (auto ptr = std::malloc(size ? size : 1))
+    {
+        return ptr;
+    }
+    throw std::bad_alloc();
+}
+
+[[gnu::noinline]] void operator delete(void* ptr) noexcept
+{
+    std::free(ptr);
+}
+
+[[gnu::noinline]] void operator delete(void* ptr, size_t) noexcept
+{
+    std::free(ptr);
+}
+
+/** @brief Hashing of an image of the given MiB with the given hash function
+ *         and backend, the part of Signature::verifyFile that grows with
+ *         the image size.
+ */
+static void BM_Hash(benchmark::State& state)
+{
+    fs::create_directories(IMG_UPLOAD_DIR);
+    auto file = fs::path(IMG_UPLOAD_DIR) / "bench-hash";
+    auto size = state.range(2) * MiB;
+    writeFile(file, std::string_view(payload(size)).substr(0, size));
+    auto location = tar::locate(file.parent_path(), file.filename());
+    auto md = EVP_get_digestbyname(hashTypes.at(state.range(1)));
+    auto backend = static_cast<HashBackend>(state.range(0));
+
+    {
+        AllocationCounter counter(state);
+        for (auto _ : state)
+        {
+            auto hasher = Hasher::create(md, backend);
+            hasher->update(*location);
+            benchmark::DoNotOptimize(hasher->final());
+        }
+    }
+
+    if (Hasher::create(md, backend)->backend() != backend)
+    {
+        state.SetLabel("backend unavailable, OpenSSL used");
+    }
+    state.SetBytesProcessed(state.iterations() * size);
+    fs::remove(file);
+    reportPeakRss(state);
+}
+BENCHMARK(BM_Hash)
+    ->ArgNames({"backend", "hash", "MiB"})
+    ->ArgsProduct({{static_cast<int>(HashBackend::openssl),
+                    static_cast<int>(HashBackend::kernel)},
+                   {0, 1, 2},
+                   {1, 16, 256}})
+    ->Unit(benchmark::kMillisecond);
+
+/** @brief Signature::verify of an image dir without images: the system
+ *         level verification of MANIFEST and publickey, and the full image
+ *         verification if enabled, with the given key bits and hash.
+ *         Keys are parsed on the first iteration only, as by the version
+ *         manager.
+ */
+static void BM_SystemLevelVerify(benchmark::State& state)
+{
+    fs::create_directories(IMG_UPLOAD_DIR);
+    Fixture fixture(state.range(0), hashTypes.at(state.range(1)), 0);
+
+    {
+        AllocationCounter counter(state);
+        for (auto _ : state)
+        {
+            Signature signature(fixture.imageDir, fixture.confDir);
+            if (!signature.verify())
+            {
+                state.SkipWithError("Verification failed");
+                break;
+            }
+        }
+    }
+
+    reportPeakRss(state);
+}
+BENCHMARK(BM_SystemLevelVerify)
+    ->ArgNames({"bits", "hash"})
+    ->ArgsProduct({{2048, 4096}, {0, 1, 2}})
+    ->Unit(benchmark::kMicrosecond);
+
+/** @brief Signature::verify of an image dir with an image-rofs of the given
+ *         MiB, with the given key bits and hash: the system level
+ *         verification, Signature::verifyFile of the image, and the full
+ *         image verification if enabled. The image is hashed from disk, as
+ *         for images without a digest from ingest.
+ */
+static void BM_VerifyImage(benchmark::State& state)
+{
+    fs::create_directories(IMG_UPLOAD_DIR);
+    auto size = state.range(2) * MiB;
+    Fixture fixture(state.range(0), hashTypes.at(state.range(1)), size);
+
+    {
+        AllocationCounter counter(state);
+        for (auto _ : state)
+        {
+            Signature signature(fixture.imageDir, fixture.confDir);
+            if (!signature.verify())
+            {
+                state.SkipWithError("Verification failed");
+                break;
+            }
+        }
+    }
+
+    state.SetBytesProcessed(state.iterations() * size);
+    reportPeakRss(state);
+}
+BENCHMARK(BM_VerifyImage)
+    ->ArgNames({"bits", "hash", "MiB"})
+    ->ArgsProduct({{2048, 4096}, {0, 1, 2}, {1, 16, 256}})
+    ->Unit(benchmark::kMillisecond);
+
+int main(int argc, char** argv)
+{
+    // Before OpenSSL allocates anything, or it refuses.
+    CRYPTO_set_mem_functions(opensslMalloc, opensslRealloc, opensslFree);
+
+    benchmark::Initialize(&argc, argv);
+    if (benchmark::ReportUnrecognizedArguments(argc, argv))
+    {
+        return 1;
+    }
+    benchmark::RunSpecifiedBenchmarks();
+    benchmark::Shutdown();
+    return 0;
+}
@@ -0,0 +1,309 @@
+#include "config.h"
+
+#include "hash_tree.hpp"
+
+#include "openssl_alloc.hpp"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cctype>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <system_error>
+#include <thread>
+
+namespace phosphor
+{
+namespace software
+{
+namespace image
+{
+
+namespace tar = phosphor::software::manager::tar;
+using namespace std::string_literals;
+
+constexpr auto hashTreeTypeKey = "HashTreeType";
+constexpr auto hashTreeChunkSizeKey = "HashTreeChunkSize";
+constexpr auto hashTreeRootKey = "HashTreeRoot-";
+
+// Keep the two buffers of every thread within reason.
+constexpr uint64_t maxChunkSize = 16 * 1024 * 1024;
+
+// Hash prefixes keeping chunks and nodes apart.
+constexpr uint8_t leafPrefix = 0x00;
+constexpr uint8_t nodePrefix = 0x01;
+
+namespace // anonymous
+{
+
+using EVP_MD_CTX_Ptr =
+    std::unique_ptr<EVP_MD_CTX, decltype(&::EVP_MD_CTX_free)>;
+
+/** @brief Hash a prefix byte followed by the given data */
+std::string hash(const EVP_MD* md, uint8_t prefix, const uint8_t* data,
+                 size_t len, const uint8_t* more = nullptr, size_t moreLen = 0)
+{
+    EVP_MD_CTX_Ptr ctx(EVP_MD_CTX_new(), ::EVP_MD_CTX_free);
+    std::string value(EVP_MD_size(md), '\0');
+    unsigned int valueLen = 0;
+
+    if (!ctx || EVP_DigestInit_ex(ctx.get(), md, nullptr) <= 0 ||
+        EVP_DigestUpdate(ctx.get(), &prefix, 1) <= 0 ||
+        EVP_DigestUpdate(ctx.get(), data, len) <= 0 ||
+        (more && EVP_DigestUpdate(ctx.get(), more, moreLen) <= 0) ||
+        EVP_DigestFinal_ex(ctx.get(),
+                           reinterpret_cast<unsigned char*>(value.data()),
+                           &valueLen) <= 0)
+    {
+        throw std::runtime_error("Failed to compute a hash tree digest");
+    }
+    value.resize(valueLen);
+    return value;
+}
+
+/** @brief Compute the root of the tree over the given chunk hashes */
+std::string root(const EVP_MD* md, size_t mdSize, std::string level)
+{
+    if (level.empty())
+    {
+        return hash(md, leafPrefix, nullptr, 0);
+    }
+
+    while (level.size() > mdSize)
+    {
+        std::string next;
+        for (size_t pos = 0; pos < level.size(); pos += 2 * mdSize)
+        {
+            auto left = reinterpret_cast<const uint8_t*>(&level[pos]);
+            if (pos + mdSize == level.size())
+            {
+                next.append(level, pos, mdSize);
+            }
+            else
+            {
+                next += hash(md, nodePrefix, left, mdSize, left + mdSize,
+                             mdSize);
+            }
+        }
+        level = std::move(next);
+    }
+    return level;
+}
+
+/** @brief Lower case hex encoding of a binary value */
+std::string toHex(const std::string& value)
+{
+    static constexpr auto digits = "0123456789abcdef";
+    std::string hex;
+    hex.reserve(value.size() * 2);
+    for (unsigned char c : value)
+    {
+        hex += digits[c >> 4];
+        hex += digits[c & 0xf];
+    }
+    return hex;
+}
+
+/** @brief Read len bytes at offset of fd into buf, throws on short reads */
+void readChunk(int fd, uint8_t* buf, size_t len, uint64_t offset)
+{
+    size_t pos = 0;
+    while (pos < len)
+    {
+        auto got = pread(fd, buf + pos, len - pos, offset + pos);
+        if (got < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (got <= 0)
+        {
+            auto error = got < 0 ? std::strerror(errno) : "end of file";
+            throw std::runtime_error("read failed, "s + error);
+        }
+        pos += got;
+    }
+}
+
+} // namespace
+
+std::optional<HashTree> HashTree::load(const manager::Manifest& manifest,
+                                       const fs::path& dir,
+                                       const std::string& image)
+{
+    auto rootValue = manifest.get(hashTreeRootKey + image);
+    if (rootValue.empty())
+    {
+        return std::nullopt;
+    }
+
+    HashTree tree;
+    std::string type(manifest.get(hashTreeTypeKey));
+    tree.md = EVP_get_digestbyname(type.c_str());
+    if (!tree.md)
+    {
+        throw std::runtime_error("Unknown hash tree type: " + type);
+    }
+    tree.mdSize = EVP_MD_size(tree.md);
+
+    std::string chunkSize(manifest.get(hashTreeChunkSizeKey));
+    try
+    {
+        size_t pos = 0;
+        tree.chunkLength = std::stoull(chunkSize, &pos);
+        if (pos != chunkSize.size())
+        {
+            tree.chunkLength = 0;
+        }
+    }
+    catch (const std::exception& e)
+    {
+        tree.chunkLength = 0;
+    }
+    if (tree.chunkLength == 0 || tree.chunkLength > maxChunkSize)
+    {
+        throw std::runtime_error("Invalid hash tree chunk size: " + chunkSize);
+    }
+
+    auto location = tar::locate(dir, image);
+    if (!location)
+    {
+        throw std::runtime_error("Missing image of hash tree: " + image);
+    }
+    tree.imageSize = location->size;
+
+    auto leavesFile = dir / (image + HASHTREE_FILE_EXT);
+    std::ifstream is(leavesFile, std::ios::binary);
+    if (!is)
+    {
+        throw std::runtime_error("Failed to read " + leavesFile.string());
+    }
+    tree.leaves.assign(std::istreambuf_iterator<char>(is),
+                       std::istreambuf_iterator<char>());
+
+    auto chunks = (tree.imageSize + tree.chunkLength - 1) / tree.chunkLength;
+    if (tree.leaves.size() != chunks * tree.mdSize)
+    {
+        throw std::runtime_error("Hash tree does not match the size of " +
+                                 image);
+    }
+
+    std::string expected(rootValue);
+    std::transform(expected.begin(), expected.end(), expected.begin(),
+                   [](unsigned char c) { return std::tolower(c); });
+    if (toHex(root(tree.md, tree.mdSize, tree.leaves)) != expected)
+    {
+        throw std::runtime_error("Hash tree does not match the root of " +
+                                 image);
+    }
+
+    return tree;
+}
+
+bool HashTree::verifyChunk(size_t index, const uint8_t* data,
+                           size_t len) const
+{
+    if (index >= chunks())
+    {
+        return false;
+    }
+
+    auto value = hash(md, leafPrefix, data, len);
+    return leaves.compare(index * mdSize, mdSize, value) == 0;
+}
+
+std::vector<size_t> HashTree::verify(const tar::Location& location,
+                                     size_t first, size_t last,
+                                     const std::atomic<bool>* cancel) const
+{
+    if (location.size != imageSize)
+    {
+        throw std::runtime_error("Size of "s + location.file.string() +
+                                 " does not match its hash tree");
+    }
+
+    last = std::min(last, chunks());
+    if (first >= last)
+    {
+        return {};
+    }
+
+    auto fd = open(location.file.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        auto error = errno;
+        throw std::runtime_error("open "s + location.file.string() +
+                                 " failed, errno=" + std::strerror(error));
+    }
+
+    std::atomic<size_t> next = first;
+    std::mutex mutex;
+    std::vector<size_t> failed;
+    std::string error;
+
+    // Each thread takes the next chunk until all are done or cancelled.
+    auto worker = [&]() {
+        auto buffer = std::make_unique<uint8_t[]>(chunkLength);
+        size_t i;
+        while (!(cancel && *cancel) && (i = next++) < last)
+        {
+            auto offset = i * chunkLength;
+            auto len = std::min(chunkLength, imageSize - offset);
+            try
+            {
+                readChunk(fd, buffer.get(), len, location.offset + offset);
+                if (!verifyChunk(i, buffer.get(), len))
+                {
+                    std::lock_guard<std::mutex> lock(mutex);
+                    failed.push_back(i);
+                }
+            }
+            catch (const std::exception& e)
+            {
+                std::lock_guard<std::mutex> lock(mutex);
+                error = e.what();
+                next = last;
+            }
+        }
+    };
+
+    auto count = std::min<size_t>(
+        last - first, std::max(1u, std::thread::hardware_concurrency()));
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < count; i++)
+    {
+        try
+        {
+            threads.emplace_back(worker);
+        }
+        catch (const std::system_error& e)
+        {
+            // Carry on with the threads there are.
+            break;
+        }
+    }
+    worker();
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
+    close(fd);
+
+    if (!error.empty())
+    {
+        throw std::runtime_error(location.file.string() + ": " + error);
+    }
+
+    std::sort(failed.begin(), failed.end());
+    return failed;
+}
+
+} // namespace image
+} // namespace software
+} // namespace phosphor
@@ -0,0 +1,129 @@
+#pragma once
+
+#include "manifest.hpp"
+#include "tar_index.hpp"
+
+#include <openssl/evp.h>
+
+#include <atomic>
+#include <filesystem>
+#include <optional>
+#include <string>
+#include <vector>
+
+namespace phosphor
+{
+namespace software
+{
+namespace image
+{
+
+namespace fs = std::filesystem;
+
+/** @class HashTree
+ *  @brief Hashes of the fixed size chunks of an image, authenticated by
+ *         the root of a hash tree over them.
+ *  @details The manifest gives the hash function (HashTreeType), the chunk
+ *           size (HashTreeChunkSize) and the root of each image that has a
+ *           tree (HashTreeRoot-<image>, in hex). The chunk hashes are
+ *           shipped in <image>HASHTREE_FILE_EXT, one after the other.
+ *
+ *           A chunk hashes to H(0x00 | data) and two nodes hash to
+ *           H(0x01 | left | right). The last node of a level with an odd
+ *           number of nodes moves up a level unchanged.
+ *
+ *           The chunk hashes are only as trustworthy as the manifest, so
+ *           the manifest signature must be verified before using a tree.
+ */
+class HashTree
+{
+  public:
+    /** @brief Load the tree of an image and check it against its root.
+     *
+     *  @param[in] manifest - The image manifest
+     *  @param[in] dir      - Directory of the image
+     *  @param[in] image    - The image file name
+     *
+     *  @return The tree, nullopt if the manifest has no root for the image
+     *
+     *  @throw std::runtime_error if the tree is malformed or does not match
+     *         the root
+     */
+    static std::optional<HashTree> load(const manager::Manifest& manifest,
+                                        const fs::path& dir,
+                                        const std::string& image);
+
+    /** @brief The size of all chunks but the last */
+    uint64_t chunkSize() const
+    {
+        return chunkLength;
+    }
+
+    /** @brief The number of chunks */
+    size_t chunks() const
+    {
+        return leaves.size() / mdSize;
+    }
+
+    /** @brief Check a chunk against its hash.
+     *
+     *  @param[in] index - The chunk number
+     *  @param[in] data  - The chunk data
+     *  @param[in] len   - The chunk length
+     *
+     *  @return true if the chunk matches
+     */
+    bool verifyChunk(size_t index, const uint8_t* data, size_t len) const;
+
+    /** @brief Check a range of chunks of a copy of the image on a thread per
+     *         core. The remaining chunks are skipped once cancel is set.
+     *
+     *  @param[in] location - The image data
+     *  @param[in] first    - The first chunk to check
+     *  @param[in] last     - One past the last chunk to check
+     *  @param[in] cancel   - Optional flag to stop early
+     *
+     *  @return The numbers of the chunks that do not match, in order
+     *
+     *  @throw std::runtime_error if the data cannot be read, or does not
+     *         have the size of the image
+     */
+    std::vector<size_t> verify(const manager::tar::Location& location,
+                               size_t first, size_t last,
+                               const std::atomic<bool>* cancel = nullptr) const;
+
+    /** @brief Check all chunks of a copy of the image.
+     *
+     *  @param[in] location - The image data
+     *  @param[in] cancel   - Optional flag to stop early
+     *
+     *  @return The numbers of the chunks that do not match, in order
+     */
+    std::vector<size_t> verify(const manager::tar::Location& location,
+                               const std::atomic<bool>* cancel = nullptr) const
+    {
+        return verify(location, 0, chunks(), cancel);
+    }
+
+  private:
+    HashTree() = default;
+
+    /** @brief The hash function */
+    const EVP_MD* md = nullptr;
+
+    /** @brief The length of a hash */
+    size_t mdSize = 0;
+
+    /** @brief The size of all chunks but the last */
+    uint64_t chunkLength = 0;
+
+    /** @brief The size of the image */
+    uint64_t imageSize = 0;
+
+    /** @brief The chunk hashes, one after the other */
+    std::string leaves;
+};
+
+} // namespace image
+} // namespace software
+} // namespace phosphor
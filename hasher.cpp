@@ -0,0 +1,384 @@
+#include "config.h"
+
+#include "hasher.hpp"
+
+#include "image_verify.hpp"
+#include "openssl_alloc.hpp"
+
+#include <fcntl.h>
+#include <linux/if_alg.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include <phosphor-logging/log.hpp>
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstring>
+#include <functional>
+#include <future>
+#include <limits>
+#include <mutex>
+#include <stdexcept>
+
+namespace phosphor
+{
+namespace software
+{
+namespace image
+{
+
+using namespace phosphor::logging;
+using namespace std::string_literals;
+namespace tar = phosphor::software::manager::tar;
+
+// Data handed over per read or splice, so that cancellation is noticed
+// soon and memory use stays bounded.
+constexpr size_t hashChunkSize = 1024 * 1024;
+
+namespace // anonymous
+{
+
+/** @brief Read len bytes at offset of fd into buf, throws on short reads */
+void readChunk(int fd, uint8_t* buf, size_t len, uint64_t offset)
+{
+    size_t pos = 0;
+    while (pos < len)
+    {
+        auto got = pread(fd, buf + pos, len - pos, offset + pos);
+        if (got < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (got <= 0)
+        {
+            auto error = got < 0 ? std::strerror(errno) : "end of file";
+            throw std::runtime_error("read failed, "s + error);
+        }
+        pos += got;
+    }
+}
+
+/** @brief Open the file of a range for reading */
+CustomFd openLocation(const tar::Location& location)
+{
+    if (location.offset >
+        static_cast<uint64_t>(std::numeric_limits<off_t>::max()))
+    {
+        throw std::runtime_error("Offset out of range in "s +
+                                 location.file.string());
+    }
+
+    CustomFd fd(open(location.file.c_str(), O_RDONLY | O_CLOEXEC));
+    if (fd() < 0)
+    {
+        auto error = errno;
+        throw std::runtime_error("open "s + location.file.string() +
+                                 " failed, errno=" + std::strerror(error));
+    }
+    return fd;
+}
+
+/** @brief Pass a file range to func one chunk at a time. The next chunk is
+ *         read on another thread while func works on the current one, so
+ *         at most two chunks are held in memory whatever the size.
+ *
+ *  @param[in] location - The file range
+ *  @param[in] cancel   - Optional flag to stop early
+ *  @param[in] func     - Called with each chunk, in order
+ *
+ *  @return false if cancelled, true otherwise
+ */
+bool forEachChunk(const tar::Location& location,
+                  const std::atomic<bool>* cancel,
+                  const std::function<void(const uint8_t*, size_t)>& func)
+{
+    auto fd = openLocation(location);
+
+    // Let the kernel read ahead further than it would by default.
+    posix_fadvise(fd(), location.offset, location.size,
+                  POSIX_FADV_SEQUENTIAL);
+
+    auto chunkSize =
+        static_cast<size_t>(std::min<uint64_t>(location.size, hashChunkSize));
+    std::array<std::unique_ptr<uint8_t[]>, 2> buffers = {
+        std::make_unique<uint8_t[]>(chunkSize),
+        std::make_unique<uint8_t[]>(chunkSize)};
+
+    auto load = [&](size_t buffer, uint64_t pos) {
+        auto len = std::min<uint64_t>(location.size - pos, chunkSize);
+        return std::async(std::launch::async, readChunk, fd(),
+                          buffers[buffer].get(), len, location.offset + pos);
+    };
+
+    // Destroyed ahead of the buffers, waiting for a read still in progress.
+    auto pending = load(0, 0);
+    size_t buffer = 0;
+    for (uint64_t pos = 0; pos < location.size; pos += chunkSize)
+    {
+        pending.get();
+
+        auto len = std::min<uint64_t>(location.size - pos, chunkSize);
+        if (pos + len < location.size)
+        {
+            pending = load(buffer ^ 1, pos + len);
+        }
+
+        if (cancel && *cancel)
+        {
+            return false;
+        }
+
+        func(buffers[buffer].get(), len);
+        buffer ^= 1;
+    }
+
+    return true;
+}
+
+/** @class OpenSSLHasher
+ *  @brief Hashes in user space, reading ahead on another thread.
+ */
+class OpenSSLHasher : public Hasher
+{
+  public:
+    explicit OpenSSLHasher(const EVP_MD* md) :
+        ctx(EVP_MD_CTX_new(), ::EVP_MD_CTX_free)
+    {
+        if (!ctx || EVP_DigestInit_ex(ctx.get(), md, nullptr) <= 0)
+        {
+            throw std::runtime_error("EVP_DigestInit_ex failed");
+        }
+    }
+
+    bool update(const tar::Location& location,
+                const std::atomic<bool>* cancel) override
+    {
+        return forEachChunk(location, cancel,
+                            [this](const uint8_t* data, size_t len) {
+                                if (EVP_DigestUpdate(ctx.get(), data, len) <= 0)
+                                {
+                                    throw std::runtime_error(
+                                        "EVP_DigestUpdate failed");
+                                }
+                            });
+    }
+
+    std::string final() override
+    {
+        unsigned char value[EVP_MAX_MD_SIZE];
+        unsigned int len = 0;
+        if (EVP_DigestFinal_ex(ctx.get(), value, &len) <= 0)
+        {
+            throw std::runtime_error("EVP_DigestFinal_ex failed");
+        }
+        return std::string(reinterpret_cast<char*>(value), len);
+    }
+
+    HashBackend backend() const override
+    {
+        return HashBackend::openssl;
+    }
+
+  private:
+    /** @brief The digest context */
+    EVP_MD_CTX_Ptr ctx;
+};
+
+/** @class KernelHasher
+ *  @brief Hashes in the kernel. File data is spliced through a pipe into
+ *         the AF_ALG socket, it is never copied to user space.
+ */
+class KernelHasher : public Hasher
+{
+  public:
+    /** @brief Constructs KernelHasher
+     *
+     *  @param[in] op     - Operation socket accepted from the AF_ALG socket
+     *  @param[in] mdSize - The digest size
+     */
+    KernelHasher(CustomFd&& op, size_t mdSize) :
+        op(std::move(op)), mdSize(mdSize)
+    {}
+
+    bool update(const tar::Location& location,
+                const std::atomic<bool>* cancel) override
+    {
+        auto fd = openLocation(location);
+
+        int pipeFds[2];
+        if (pipe2(pipeFds, O_CLOEXEC) < 0)
+        {
+            auto error = errno;
+            throw std::runtime_error("pipe2 failed, errno="s +
+                                     std::strerror(error));
+        }
+        CustomFd pipeRead(pipeFds[0]);
+        CustomFd pipeWrite(pipeFds[1]);
+
+        loff_t offset = location.offset;
+        auto remaining = location.size;
+        while (remaining > 0)
+        {
+            if (cancel && *cancel)
+            {
+                return false;
+            }
+
+            auto len = std::min<uint64_t>(remaining, hashChunkSize);
+            auto in = splice(fd(), &offset, pipeWrite(), nullptr, len,
+                             SPLICE_F_MOVE | SPLICE_F_MORE);
+            if (in < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (in <= 0)
+            {
+                auto error = in < 0 ? std::strerror(errno) : "end of file";
+                throw std::runtime_error("splice from "s +
+                                         location.file.string() +
+                                         " failed, " + error);
+            }
+            remaining -= in;
+
+            // More data follows, the digest is finalized by final().
+            while (in > 0)
+            {
+                auto out = splice(pipeRead(), nullptr, op(), nullptr, in,
+                                  SPLICE_F_MOVE | SPLICE_F_MORE);
+                if (out < 0 && errno == EINTR)
+                {
+                    continue;
+                }
+                if (out <= 0)
+                {
+                    auto error = out < 0 ? errno : EIO;
+                    throw std::runtime_error("splice to AF_ALG failed, "s +
+                                             std::strerror(error));
+                }
+                in -= out;
+            }
+        }
+        return true;
+    }
+
+    std::string final() override
+    {
+        if (send(op(), nullptr, 0, 0) < 0)
+        {
+            auto error = errno;
+            throw std::runtime_error("AF_ALG send failed, errno="s +
+                                     std::strerror(error));
+        }
+
+        std::string value(mdSize, '\0');
+        auto len = read(op(), value.data(), value.size());
+        if (len != static_cast<ssize_t>(value.size()))
+        {
+            throw std::runtime_error("AF_ALG read of the digest failed");
+        }
+        return value;
+    }
+
+    HashBackend backend() const override
+    {
+        return HashBackend::kernel;
+    }
+
+  private:
+    /** @brief The operation socket */
+    CustomFd op;
+
+    /** @brief The digest size */
+    size_t mdSize;
+};
+
+/** @brief The kernel crypto API name of a message digest, nullptr if the
+ *         kernel is not asked for it.
+ */
+const char* kernelName(const EVP_MD* md)
+{
+    switch (EVP_MD_type(md))
+    {
+        case NID_sha1:
+            return "sha1";
+        case NID_sha224:
+            return "sha224";
+        case NID_sha256:
+            return "sha256";
+        case NID_sha384:
+            return "sha384";
+        case NID_sha512:
+            return "sha512";
+        default:
+            return nullptr;
+    }
+}
+
+/** @brief Get a kernel hasher, nullptr if the kernel cannot provide one */
+std::unique_ptr<Hasher> createKernelHasher(const EVP_MD* md)
+{
+    auto name = kernelName(md);
+    if (!name)
+    {
+        return nullptr;
+    }
+
+    CustomFd tfm(socket(AF_ALG, SOCK_SEQPACKET | SOCK_CLOEXEC, 0));
+    if (tfm() < 0)
+    {
+        return nullptr;
+    }
+
+    sockaddr_alg addr{};
+    addr.salg_family = AF_ALG;
+    std::strcpy(reinterpret_cast<char*>(addr.salg_type), "hash");
+    std::strcpy(reinterpret_cast<char*>(addr.salg_name), name);
+    if (bind(tfm(), reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0)
+    {
+        return nullptr;
+    }
+
+    CustomFd op(accept4(tfm(), nullptr, nullptr, SOCK_CLOEXEC));
+    if (op() < 0)
+    {
+        return nullptr;
+    }
+
+    return std::make_unique<KernelHasher>(std::move(op), EVP_MD_size(md));
+}
+
+} // namespace
+
+HashBackend Hasher::defaultBackend()
+{
+#ifdef WANT_KERNEL_HASH
+    return HashBackend::kernel;
+#else
+    return HashBackend::openssl;
+#endif
+}
+
+std::unique_ptr<Hasher> Hasher::create(const EVP_MD* md, HashBackend backend)
+{
+    if (backend == HashBackend::kernel)
+    {
+        auto hasher = createKernelHasher(md);
+        if (hasher)
+        {
+            return hasher;
+        }
+
+        static std::once_flag logged;
+        std::call_once(logged, [] {
+            log<level::INFO>("Kernel hashing is not available, using OpenSSL");
+        });
+    }
+
+    return std::make_unique<OpenSSLHasher>(md);
+}
+
+} // namespace image
+} // namespace software
+} // namespace phosphor
@@ -0,0 +1,81 @@
+#pragma once
+
+#include "tar_index.hpp"
+
+#include <openssl/evp.h>
+
+#include <atomic>
+#include <memory>
+#include <string>
+
+namespace phosphor
+{
+namespace software
+{
+namespace image
+{
+
+/** @brief Where image data is hashed */
+enum class HashBackend
+{
+    /** @brief In user space by OpenSSL */
+    openssl,
+    /** @brief By the kernel crypto API through an AF_ALG socket, which
+     *         uses a hash engine of the SoC where there is one. Falls back
+     *         to OpenSSL where the kernel lacks the hash function.
+     */
+    kernel,
+};
+
+/** @class Hasher
+ *  @brief Computes the message digest of file data.
+ */
+class Hasher
+{
+  public:
+    virtual ~Hasher() = default;
+
+    /** @brief Get a hasher for a message digest.
+     *
+     *  @param[in] md      - The message digest
+     *  @param[in] backend - Where to hash the data
+     *
+     *  @return The hasher
+     *
+     *  @throw std::runtime_error if the digest cannot be computed at all
+     */
+    static std::unique_ptr<Hasher> create(const EVP_MD* md,
+                                          HashBackend backend);
+
+    /** @brief The backend chosen at build time, kernel if kernel-hash is
+     *         enabled, openssl otherwise.
+     */
+    static HashBackend defaultBackend();
+
+    /** @brief Hash a file range, after the data hashed so far.
+     *
+     *  @param[in] location - The file range
+     *  @param[in] cancel   - Optional flag to stop early
+     *
+     *  @return false if cancelled, true otherwise
+     *
+     *  @throw std::runtime_error if the file cannot be read or hashed
+     */
+    virtual bool update(const manager::tar::Location& location,
+                        const std::atomic<bool>* cancel = nullptr) = 0;
+
+    /** @brief Get the digest of all data hashed.
+     *
+     *  @return The raw digest
+     *
+     *  @throw std::runtime_error if the digest cannot be computed
+     */
+    virtual std::string final() = 0;
+
+    /** @brief The backend doing the hashing */
+    virtual HashBackend backend() const = 0;
+};
+
+} // namespace image
+} // namespace software
+} // namespace phosphor
@@ -0,0 +1,583 @@
+#include "config.h"
+
+#include "image_digest.hpp"
+
+#include "manifest.hpp"
+#include "tar_index.hpp"
+
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <phosphor-logging/log.hpp>
+
+#include <cerrno>
+#include <fstream>
+#include <iterator>
+#include <set>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+
+namespace phosphor
+{
+namespace software
+{
+namespace image
+{
+
+using namespace phosphor::logging;
+namespace tar = phosphor::software::manager::tar;
+
+constexpr auto hashFunctionKey = "HashType";
+
+// The manifest is a handful of short lines, do not buffer arbitrary data.
+constexpr size_t maxManifestSize = 64 * 1024;
+
+namespace // anonymous
+{
+
+using EVP_MD_CTX_Ptr =
+    std::unique_ptr<EVP_MD_CTX, decltype(&::EVP_MD_CTX_free)>;
+using EVP_PKEY_CTX_Ptr =
+    std::unique_ptr<EVP_PKEY_CTX, decltype(&::EVP_PKEY_CTX_free)>;
+
+int64_t nanoseconds(const struct timespec& ts)
+{
+    return static_cast<int64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+/** @brief Whether a record file or dir is owned by the service and cannot be
+ *         written by others.
+ */
+bool isPrivate(const struct stat& st)
+{
+    return st.st_uid == geteuid() && (st.st_mode & (S_IWGRP | S_IWOTH)) == 0;
+}
+
+/** @brief Write a record file only the service can write, replacing it
+ *         atomically.
+ *  @return 0 on success, the errno of the call that failed otherwise
+ */
+int writeRecord(const fs::path& path, const std::string& data)
+{
+    std::error_code ec;
+    fs::create_directories(path.parent_path(), ec);
+    fs::permissions(path.parent_path(), fs::perms::owner_all, ec);
+
+    auto tmp = path;
+    tmp += ".tmp";
+
+    int error = 0;
+    auto fd = open(tmp.c_str(),
+                   O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC,
+                   S_IRUSR | S_IWUSR);
+    if (fd < 0)
+    {
+        return errno;
+    }
+
+    size_t written = 0;
+    while (written < data.size())
+    {
+        auto rc = write(fd, data.data() + written, data.size() - written);
+        if (rc < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (rc <= 0)
+        {
+            error = rc < 0 ? errno : ENOSPC;
+            break;
+        }
+        written += rc;
+    }
+    if (!error && fsync(fd) != 0)
+    {
+        error = errno;
+    }
+    close(fd);
+
+    if (!error && rename(tmp.c_str(), path.c_str()) != 0)
+    {
+        error = errno;
+    }
+    if (error)
+    {
+        unlink(tmp.c_str());
+    }
+    return error;
+}
+
+/** @brief Read a record file, unless others than the service could have
+ *         written it.
+ *  @return true if the record was read
+ */
+bool readRecord(const fs::path& path, std::string& data)
+{
+    struct stat dirSt, st;
+    if (lstat(path.parent_path().c_str(), &dirSt) != 0)
+    {
+        return false;
+    }
+
+    auto fd = open(path.c_str(), O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return false;
+    }
+    if (fstat(fd, &st) != 0)
+    {
+        close(fd);
+        return false;
+    }
+    if (!S_ISDIR(dirSt.st_mode) || !isPrivate(dirSt) || !S_ISREG(st.st_mode) ||
+        !isPrivate(st))
+    {
+        close(fd);
+        log<level::WARNING>("Ignoring a record others can write",
+                            entry("PATH=%s", path.c_str()));
+        return false;
+    }
+
+    data.clear();
+    char buf[4096];
+    while (true)
+    {
+        auto len = read(fd, buf, sizeof(buf));
+        if (len < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (len <= 0)
+        {
+            close(fd);
+            return len == 0;
+        }
+        data.append(buf, len);
+    }
+}
+
+} // namespace
+
+DigestCollector::DigestCollector(const std::set<std::string>& imageNames) :
+    imageNames(imageNames)
+{}
+
+void DigestCollector::begin(const fs::path& path, const tar::Entry& /*member*/)
+{
+    inManifest = false;
+    current.clear();
+
+    // A member extracted again replaces the earlier file.
+    result.erase(path.string());
+
+    if (path == MANIFEST_FILE_NAME)
+    {
+        inManifest = true;
+        manifest.clear();
+    }
+    else if (md && imageNames.count(path.string()))
+    {
+        ctx.reset(EVP_MD_CTX_new());
+        if (ctx && EVP_DigestInit_ex(ctx.get(), md, nullptr) > 0)
+        {
+            current = path.string();
+            size = 0;
+        }
+    }
+}
+
+void DigestCollector::update(const uint8_t* data, size_t len)
+{
+    if (inManifest)
+    {
+        if (manifest.size() + len <= maxManifestSize)
+        {
+            manifest.append(reinterpret_cast<const char*>(data), len);
+        }
+    }
+    else if (!current.empty())
+    {
+        if (EVP_DigestUpdate(ctx.get(), data, len) <= 0)
+        {
+            current.clear();
+        }
+        size += len;
+    }
+}
+
+void DigestCollector::end()
+{
+    if (inManifest)
+    {
+        inManifest = false;
+        md = nullptr;
+
+        hashFunc = manager::Manifest(std::move(manifest)).get(hashFunctionKey);
+        manifest.clear();
+
+        if (!hashFunc.empty())
+        {
+            OpenSSL_add_all_digests();
+            md = EVP_get_digestbyname(hashFunc.c_str());
+            if (!md)
+            {
+                log<level::INFO>("Unknown manifest hash type, images will be "
+                                 "hashed at verification",
+                                 entry("HASH=%s", hashFunc.c_str()));
+            }
+        }
+    }
+    else if (!current.empty())
+    {
+        unsigned char value[EVP_MAX_MD_SIZE];
+        unsigned int len = 0;
+        if (EVP_DigestFinal_ex(ctx.get(), value, &len) > 0)
+        {
+            result[current] = {hashFunc, size,
+                               std::string(reinterpret_cast<char*>(value),
+                                           len)};
+        }
+        current.clear();
+    }
+}
+
+TarballVerifier::TarballVerifier(const fs::path& signedConfPath,
+                                 std::string signature) :
+    signature(std::move(signature)),
+    keyring(KeyCache::instance().keyring(signedConfPath))
+{
+    // The key the tarball was signed with is only known once the manifest
+    // arrived, hash with the hash function of every system key till then.
+    for (const auto& [keyType, key] : *keyring)
+    {
+        auto md = KeyCache::instance().digest(key.hashFunc);
+        if (!md || contexts.count(key.hashFunc))
+        {
+            continue;
+        }
+
+        EVP_MD_CTX_Ptr ctx(EVP_MD_CTX_new(), ::EVP_MD_CTX_free);
+        if (ctx && EVP_DigestInit_ex(ctx.get(), md, nullptr) > 0)
+        {
+            contexts.emplace(key.hashFunc, std::move(ctx));
+        }
+    }
+}
+
+void TarballVerifier::update(const uint8_t* data, size_t len)
+{
+    for (auto& [hashFunc, ctx] : contexts)
+    {
+        if (EVP_DigestUpdate(ctx.get(), data, len) <= 0)
+        {
+            throw std::runtime_error("Failed to hash the tarball with " +
+                                     hashFunc);
+        }
+    }
+}
+
+bool TarballVerifier::verify(const std::string& keyType)
+{
+    std::map<std::string, std::string> digests;
+    for (auto& [hashFunc, ctx] : contexts)
+    {
+        unsigned char value[EVP_MAX_MD_SIZE];
+        unsigned int len = 0;
+        if (EVP_DigestFinal_ex(ctx.get(), value, &len) > 0)
+        {
+            digests[hashFunc].assign(reinterpret_cast<char*>(value), len);
+        }
+    }
+    contexts.clear();
+
+    // The declared key type first, the others in case the tarball was
+    // signed with another system key.
+    std::vector<const SystemKey*> keys;
+    auto declared = keyring->find(keyType);
+    if (declared != keyring->end())
+    {
+        keys.push_back(&declared->second);
+    }
+    for (const auto& [name, key] : *keyring)
+    {
+        if (name != keyType)
+        {
+            keys.push_back(&key);
+        }
+    }
+
+    for (const auto* key : keys)
+    {
+        auto digest = digests.find(key->hashFunc);
+        auto publicKey = KeyCache::instance().publicKey(key->publicKey);
+        if (digest == digests.end() || !publicKey)
+        {
+            continue;
+        }
+
+        if (verifyDigest(publicKey.get(),
+                         KeyCache::instance().digest(key->hashFunc),
+                         digest->second,
+                         reinterpret_cast<const uint8_t*>(signature.data()),
+                         signature.size()) == 1)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+int verifyDigest(EVP_PKEY* key, const EVP_MD* md, const std::string& digest,
+                 const uint8_t* signature, size_t len)
+{
+    // The digest is verified the same way EVP_DigestVerifyFinal verifies
+    // the digest it computed itself.
+    EVP_PKEY_CTX_Ptr ctx(EVP_PKEY_CTX_new(key, nullptr), ::EVP_PKEY_CTX_free);
+    if (!ctx || EVP_PKEY_verify_init(ctx.get()) <= 0 ||
+        EVP_PKEY_CTX_set_signature_md(ctx.get(), md) <= 0)
+    {
+        return -1;
+    }
+
+    auto result = EVP_PKEY_verify(
+        ctx.get(), signature, len,
+        reinterpret_cast<const unsigned char*>(digest.data()), digest.size());
+    return result < 0 ? -1 : result;
+}
+
+std::string fingerprint(const fs::path& imageDirPath,
+                        const fs::path& signedConfPath, const Digests& digests)
+{
+    EVP_MD_CTX_Ptr ctx(EVP_MD_CTX_new(), ::EVP_MD_CTX_free);
+    if (!ctx || EVP_DigestInit_ex(ctx.get(), EVP_sha256(), nullptr) <= 0)
+    {
+        return {};
+    }
+    auto add = [&ctx](const std::string& line) {
+        EVP_DigestUpdate(ctx.get(), line.data(), line.size());
+        EVP_DigestUpdate(ctx.get(), "\n", 1);
+    };
+
+    try
+    {
+        // Sorted, as directory order is not stable.
+        std::set<fs::path> files;
+        for (const auto& entry : fs::recursive_directory_iterator(imageDirPath))
+        {
+            if (entry.is_regular_file())
+            {
+                files.insert(entry.path());
+            }
+        }
+        for (const auto& file : files)
+        {
+            struct stat st;
+            if (stat(file.c_str(), &st) != 0)
+            {
+                return {};
+            }
+            add("file " + file.lexically_relative(imageDirPath).string() +
+                " " + std::to_string(st.st_dev) + " " +
+                std::to_string(st.st_ino) + " " + std::to_string(st.st_size) +
+                " " + std::to_string(st.st_mtim.tv_sec) + "." +
+                std::to_string(st.st_mtim.tv_nsec) + " " +
+                std::to_string(st.st_ctim.tv_sec) + "." +
+                std::to_string(st.st_ctim.tv_nsec));
+        }
+
+        for (const auto& [name, digest] : digests)
+        {
+            add("digest " + name + " " + digest.hashFunc + " " +
+                std::to_string(digest.value.size()));
+            add(digest.value);
+        }
+
+        // The keys are small, hash their contents.
+        std::set<fs::path> keys;
+        for (const auto& entry :
+             fs::recursive_directory_iterator(signedConfPath))
+        {
+            if (entry.is_regular_file())
+            {
+                keys.insert(entry.path());
+            }
+        }
+        for (const auto& key : keys)
+        {
+            std::ifstream is(key, std::ios::binary);
+            if (!is)
+            {
+                return {};
+            }
+            std::string contents((std::istreambuf_iterator<char>(is)),
+                                 std::istreambuf_iterator<char>());
+            add("key " + key.lexically_relative(signedConfPath).string() +
+                " " + std::to_string(contents.size()));
+            add(contents);
+        }
+    }
+    catch (const std::exception& e)
+    {
+        return {};
+    }
+
+    unsigned char value[EVP_MAX_MD_SIZE];
+    unsigned int len = 0;
+    if (EVP_DigestFinal_ex(ctx.get(), value, &len) <= 0)
+    {
+        return {};
+    }
+
+    static constexpr auto digits = "0123456789abcdef";
+    std::string hex;
+    for (unsigned int i = 0; i < len; i++)
+    {
+        hex += digits[value[i] >> 4];
+        hex += digits[value[i] & 0xf];
+    }
+    return hex;
+}
+
+bool storeIngestVerified(const fs::path& recordDir,
+                         const std::string& versionId,
+                         const std::string& fingerprint)
+{
+    auto path = recordDir / versionId;
+    auto error = writeRecord(path, fingerprint + '\n');
+    if (error)
+    {
+        log<level::ERR>("Failed to record the verification at ingest",
+                        entry("PATH=%s", path.c_str()),
+                        entry("ERRNO=%d", error));
+        return false;
+    }
+    return true;
+}
+
+std::string restoreIngestVerified(const fs::path& recordDir,
+                                  const std::string& versionId)
+{
+    std::string fingerprint;
+    if (!readRecord(recordDir / versionId, fingerprint))
+    {
+        return {};
+    }
+    return fingerprint.substr(0, fingerprint.find('\n'));
+}
+
+void removeIngestVerified(const fs::path& recordDir,
+                          const std::string& versionId)
+{
+    std::error_code ec;
+    fs::remove(recordDir / versionId, ec);
+}
+
+bool storeDigests(const fs::path& recordDir, const std::string& versionId,
+                  const fs::path& imageDirPath, const Digests& digests)
+{
+    std::ostringstream os;
+    for (const auto& [name, digest] : digests)
+    {
+        // Bind the digest to the extracted file, so that a file changed or
+        // replaced since extraction does not match its digest anymore. An
+        // image left in the tarball is bound to the tarball.
+        auto location = tar::locate(imageDirPath, name);
+        struct stat st;
+        if (!location || stat(location->file.c_str(), &st) != 0)
+        {
+            continue;
+        }
+
+        os << name << ' ' << digest.hashFunc << ' ' << digest.size << ' '
+           << st.st_dev << ' ' << st.st_ino << ' '
+           << nanoseconds(st.st_mtim) << ' ' << nanoseconds(st.st_ctim)
+           << ' ';
+        for (unsigned char c : digest.value)
+        {
+            constexpr auto hex = "0123456789abcdef";
+            os << hex[c >> 4] << hex[c & 0xf];
+        }
+        os << '\n';
+    }
+
+    auto path = recordDir / versionId;
+    auto error = writeRecord(path, os.str());
+    if (error)
+    {
+        log<level::ERR>("Failed to store image digests",
+                        entry("PATH=%s", path.c_str()),
+                        entry("ERRNO=%d", error));
+        return false;
+    }
+    return true;
+}
+
+Digests restoreDigests(const fs::path& recordDir, const std::string& versionId,
+                       const fs::path& imageDirPath)
+{
+    Digests digests;
+    std::string record;
+    if (!readRecord(recordDir / versionId, record))
+    {
+        return digests;
+    }
+
+    std::istringstream is(record);
+    std::string line;
+    while (std::getline(is, line))
+    {
+        std::istringstream fields(line);
+        std::string name;
+        std::string hex;
+        Digest digest;
+        if (!(fields >> name >> digest.hashFunc >> digest.size >>
+              digest.dev >> digest.ino >> digest.mtime >> digest.ctime >>
+              hex) ||
+            hex.size() % 2)
+        {
+            continue;
+        }
+
+        try
+        {
+            for (size_t i = 0; i < hex.size(); i += 2)
+            {
+                auto byte = std::stoi(hex.substr(i, 2), nullptr, 16);
+                digest.value.push_back(static_cast<char>(byte));
+            }
+        }
+        catch (const std::exception& e)
+        {
+            continue;
+        }
+
+        // Discard digests of files changed or replaced since they were
+        // extracted. Any change to a file changes its change time.
+        auto location = tar::locate(imageDirPath, name);
+        struct stat st;
+        if (!location || location->size != digest.size ||
+            stat(location->file.c_str(), &st) != 0 ||
+            st.st_dev != digest.dev || st.st_ino != digest.ino ||
+            nanoseconds(st.st_mtim) != digest.mtime ||
+            nanoseconds(st.st_ctim) != digest.ctime)
+        {
+            continue;
+        }
+
+        digests.emplace(std::move(name), std::move(digest));
+    }
+
+    return digests;
+}
+
+void removeDigests(const fs::path& recordDir, const std::string& versionId)
+{
+    std::error_code ec;
+    fs::remove(recordDir / versionId, ec);
+}
+
+} // namespace image
+} // namespace software
+} // namespace phosphor
@@ -0,0 +1,251 @@
+#pragma once
+
+#include "key_cache.hpp"
+#include "openssl_alloc.hpp"
+#include "tar_extractor.hpp"
+
+#include <openssl/evp.h>
+
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <set>
+#include <string>
+
+namespace phosphor
+{
+namespace software
+{
+namespace image
+{
+
+namespace fs = std::filesystem;
+
+/** @struct Digest
+ *  @brief Message digest of an image file, computed during extraction.
+ */
+struct Digest
+{
+    /** @brief Hash function name as given by the manifest HashType */
+    std::string hashFunc;
+
+    /** @brief Size of the hashed file, used to detect stale digests */
+    uint64_t size;
+
+    /** @brief Raw digest value */
+    std::string value;
+
+    /** @brief Device and inode of the file, set on store */
+    uint64_t dev = 0;
+    uint64_t ino = 0;
+
+    /** @brief Modification and change times of the file in nanoseconds,
+     *         set on store */
+    int64_t mtime = 0;
+    int64_t ctime = 0;
+};
+
+/** @brief Digests keyed by image file name */
+using Digests = std::map<std::string, Digest>;
+
+/** @class DigestCollector
+ *  @brief Hashes image files while the tarball is being extracted.
+ *  @details The hash function is taken from the HashType of the manifest,
+ *           so only images that follow the manifest in the tarball are
+ *           hashed. Images without a digest are verified from disk.
+ */
+class DigestCollector : public phosphor::software::manager::tar::Observer
+{
+  public:
+    /** @brief Constructs DigestCollector
+     *
+     *  @param[in] imageNames - Names of the images to hash
+     */
+    explicit DigestCollector(const std::set<std::string>& imageNames);
+
+    void begin(const fs::path& path,
+               const phosphor::software::manager::tar::Entry& member) override;
+
+    void update(const uint8_t* data, size_t len) override;
+
+    void end() override;
+
+    /** @brief The digests of all completely extracted images */
+    const Digests& digests() const
+    {
+        return result;
+    }
+
+  private:
+    /** @brief Names of the images to hash */
+    std::set<std::string> imageNames;
+
+    /** @brief Hash function name from the manifest */
+    std::string hashFunc;
+
+    /** @brief Digest algorithm matching hashFunc */
+    const EVP_MD* md = nullptr;
+
+    /** @brief Manifest contents while the manifest is extracted */
+    std::string manifest;
+
+    /** @brief Whether the current member is the manifest */
+    bool inManifest = false;
+
+    /** @brief Name of the image currently being hashed, empty if none */
+    std::string current;
+
+    /** @brief Number of bytes hashed for the current image */
+    uint64_t size = 0;
+
+    /** @brief Digest context of the current image */
+    std::unique_ptr<EVP_MD_CTX, decltype(&::EVP_MD_CTX_free)> ctx{
+        nullptr, ::EVP_MD_CTX_free};
+
+    /** @brief Collected digests */
+    Digests result;
+};
+
+/** @class TarballVerifier
+ *  @brief Checks a detached signature over a whole tarball against the
+ *         public keys of the system, hashing the tarball while it is
+ *         received. A tarball that passes needs no further verification
+ *         of its images.
+ */
+class TarballVerifier
+{
+  public:
+    /** @brief Constructs TarballVerifier
+     *
+     *  @param[in] signedConfPath - Path of public key and hash function
+     *                              files
+     *  @param[in] signature      - The detached signature
+     */
+    TarballVerifier(const fs::path& signedConfPath, std::string signature);
+
+    /** @brief Hash the next part of the tarball.
+     *
+     *  @throw std::runtime_error if the data cannot be hashed
+     */
+    void update(const uint8_t* data, size_t len);
+
+    /** @brief Check the signature once the whole tarball was hashed.
+     *
+     *  @param[in] keyType - Key type declared by the manifest, tried first
+     *
+     *  @return true if the signature matches with one of the system keys
+     */
+    bool verify(const std::string& keyType);
+
+  private:
+    /** @brief The detached signature */
+    std::string signature;
+
+    /** @brief The system keys */
+    std::shared_ptr<const Keyring> keyring;
+
+    /** @brief Digest contexts of the hash functions of the system keys */
+    std::map<std::string,
+             std::unique_ptr<EVP_MD_CTX, decltype(&::EVP_MD_CTX_free)>>
+        contexts;
+};
+
+/** @brief Check a signature over a digest.
+ *
+ *  @param[in] key       - The public key
+ *  @param[in] md        - The message digest of the signature
+ *  @param[in] digest    - The raw digest value
+ *  @param[in] signature - The signature
+ *  @param[in] len       - The signature size
+ *
+ *  @return 1 if the signature matches, 0 if not, -1 on errors
+ */
+int verifyDigest(EVP_PKEY* key, const EVP_MD* md, const std::string& digest,
+                 const uint8_t* signature, size_t len);
+
+/** @brief Fingerprint of everything the verification of an image depends on:
+ *         the identity, size and change times of the image files, their
+ *         digests computed during extraction, and the contents of the
+ *         system keys and hash functions. Any change to a file changes its
+ *         change time, and so the fingerprint.
+ *
+ *  @param[in] imageDirPath   - Directory of the extracted images
+ *  @param[in] signedConfPath - Path of public key and hash function files
+ *  @param[in] digests        - Digests the images are verified with
+ *
+ *  @return The fingerprint in hex, empty if the files cannot be read
+ */
+std::string fingerprint(const fs::path& imageDirPath,
+                        const fs::path& signedConfPath, const Digests& digests);
+
+/** @brief Record that the images of a version passed a tarball signature
+ *         check at ingest. The record is kept out of the image dir, in a dir
+ *         only the services can write to.
+ *
+ *  @param[in] recordDir   - Directory of the records
+ *  @param[in] versionId   - The version id
+ *  @param[in] fingerprint - Fingerprint of the images at ingest
+ *
+ *  @return true if recorded
+ */
+bool storeIngestVerified(const fs::path& recordDir,
+                         const std::string& versionId,
+                         const std::string& fingerprint);
+
+/** @brief The fingerprint recorded by storeIngestVerified. A record that
+ *         others than the service could have written is ignored.
+ *
+ *  @param[in] recordDir - Directory of the records
+ *  @param[in] versionId - The version id
+ *
+ *  @return The fingerprint, empty if the images were not verified at ingest
+ */
+std::string restoreIngestVerified(const fs::path& recordDir,
+                                  const std::string& versionId);
+
+/** @brief Remove the record of storeIngestVerified, if any.
+ *
+ *  @param[in] recordDir - Directory of the records
+ *  @param[in] versionId - The version id
+ */
+void removeIngestVerified(const fs::path& recordDir,
+                          const std::string& versionId);
+
+/** @brief Record the digests of the images of a version. The record is kept
+ *         out of the image dir, in a dir only the services can write to,
+ *         and binds each digest to the identity and change time of its
+ *         file.
+ *
+ *  @param[in] recordDir    - Directory of the records
+ *  @param[in] versionId    - The version id
+ *  @param[in] imageDirPath - Directory of the extracted images
+ *  @param[in] digests      - Digests to store
+ *
+ *  @return true if the digests were stored
+ */
+bool storeDigests(const fs::path& recordDir, const std::string& versionId,
+                  const fs::path& imageDirPath, const Digests& digests);
+
+/** @brief The digests recorded by storeDigests whose files did not change
+ *         since. A record that others than the service could have written
+ *         is ignored.
+ *
+ *  @param[in] recordDir    - Directory of the records
+ *  @param[in] versionId    - The version id
+ *  @param[in] imageDirPath - Directory of the extracted images
+ *
+ *  @return The stored digests, empty if there are none
+ */
+Digests restoreDigests(const fs::path& recordDir, const std::string& versionId,
+                       const fs::path& imageDirPath);
+
+/** @brief Remove the record of storeDigests, if any.
+ *
+ *  @param[in] recordDir - Directory of the records
+ *  @param[in] versionId - The version id
+ */
+void removeDigests(const fs::path& recordDir, const std::string& versionId);
+
+} // namespace image
+} // namespace software
+} // namespace phosphor
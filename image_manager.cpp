@@ -2,13 +2,16 @@
 
 #include "image_manager.hpp"
 
+#include "tar_extractor.hpp"
+#include "tar_index.hpp"
 #include "version.hpp"
 #include "watch.hpp"
 
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/stat.h>
-#include <sys/wait.h>
+#include <systemd/sd-bus.h>
 #include <unistd.h>
 
 #include <elog-errors.hpp>
@@ -16,10 +19,25 @@
 #include <phosphor-logging/log.hpp>
 #include <xyz/openbmc_project/Software/Image/error.hpp>
 
+#ifdef WANT_SIGNATURE_VERIFY
+#include "image_digest.hpp"
+#include "images.hpp"
+#endif
+
 #include <algorithm>
+#include <chrono>
 #include <cstring>
 #include <filesystem>
+#include <fstream>
+#include <functional>
+#include <iterator>
+#include <map>
+#include <optional>
+#include <set>
+#include <stdexcept>
 #include <string>
+#include <variant>
+#include <vector>
 
 namespace phosphor
 {
@@ -29,6 +47,7 @@ namespace manager
 {
 
 using namespace phosphor::logging;
+using namespace std::string_literals;
 using namespace sdbusplus::xyz::openbmc_project::Software::Image::Error;
 namespace Software = phosphor::logging::xyz::openbmc_project::Software;
 using ManifestFail = Software::Image::ManifestFileFailure;
@@ -36,6 +55,7 @@ using UnTarFail = Software::Image::UnTarFailure;
 using InternalFail = Software::Image::InternalFailure;
 using ImageFail = Software::Image::ImageFailure;
 namespace fs = std::filesystem;
+namespace MatchRules = sdbusplus::bus::match::rules;
 
 struct RemovablePath
 {
@@ -56,6 +76,12 @@ struct RemovablePath
 namespace // anonymous
 {
 
+// The manifest is a handful of short lines, refuse to buffer anything larger.
+constexpr size_t maxManifestSize = 64 * 1024;
+
+// A detached signature is a few hundred bytes, whatever the key.
+constexpr size_t maxSignatureSize = 64 * 1024;
+
 std::vector<std::string> getSoftwareObjects(sdbusplus::bus::bus& bus)
 {
     std::vector<std::string> paths;
@@ -69,8 +95,302 @@ std::vector<std::string> getSoftwareObjects(sdbusplus::bus::bus& bus)
     return paths;
 }
 
+/** @class ManifestObserver
+ *  @brief Captures the manifest while a tarball is extracted, and passes
+ *         all extracted data on to another observer.
+ */
+class ManifestObserver : public tar::Observer
+{
+  public:
+    /** @brief Constructs ManifestObserver
+     *
+     *  @param[in] onManifest - Called with the manifest contents once the
+     *                          manifest is extracted, throws to abort
+     *  @param[in] next       - Optional observer of all extracted data
+     */
+    ManifestObserver(std::function<void(std::string&&)> onManifest,
+                     tar::Observer* next) :
+        onManifest(std::move(onManifest)),
+        next(next)
+    {}
+
+    void begin(const fs::path& path, const tar::Entry& member) override
+    {
+        if (path == INDEX_FILE_NAME || path == TARBALL_FILE_NAME)
+        {
+            throw std::runtime_error("Reserved file name in tarball: " +
+                                     path.string());
+        }
+
+        inManifest = (path == MANIFEST_FILE_NAME);
+        if (inManifest)
+        {
+            if (member.size > maxManifestSize)
+            {
+                throw std::runtime_error("Manifest file too large");
+            }
+            contents.clear();
+        }
+        if (next)
+        {
+            next->begin(path, member);
+        }
+    }
+
+    void update(const uint8_t* data, size_t len) override
+    {
+        if (inManifest)
+        {
+            contents.append(reinterpret_cast<const char*>(data), len);
+        }
+        if (next)
+        {
+            next->update(data, len);
+        }
+    }
+
+    void end() override
+    {
+        if (next)
+        {
+            next->end();
+        }
+        if (inManifest)
+        {
+            inManifest = false;
+            onManifest(std::move(contents));
+        }
+    }
+
+  private:
+    /** @brief Called once the manifest is extracted */
+    std::function<void(std::string&&)> onManifest;
+
+    /** @brief Observer of all extracted data */
+    tar::Observer* next;
+
+    /** @brief Whether the current member is the manifest */
+    bool inManifest = false;
+
+    /** @brief Manifest contents */
+    std::string contents;
+};
+
 } // namespace
 
+/** @struct Upload
+ *  @brief An uploaded tarball on its way to a Version object.
+ */
+struct Upload
+{
+    Upload(const Upload&) = delete;
+    Upload& operator=(const Upload&) = delete;
+
+    /** @brief Constructs an upload of a tarball file
+     *
+     *  @param[in] tarFilePath - The tarball, removed once done along with
+     *                           its detached signature, if any
+     */
+    explicit Upload(const fs::path& tarFilePath) :
+        source(tarFilePath), tarball(tarFilePath),
+        signatureFile(tarFilePath.string() + SIGNATURE_FILE_EXT),
+        tmpDir(fs::path())
+    {}
+
+    /** @brief Constructs an upload streamed through a file descriptor
+     *
+     *  @param[in] fd        - The tarball stream, closed once done
+     *  @param[in] call      - The Upload method call to answer once done
+     *  @param[in] signature - Detached signature of the tarball, if any
+     */
+    Upload(int fd, sdbusplus::message::message&& call,
+           std::string&& signature) :
+        source("fd from "s + call.get_sender()),
+        tarball(fs::path()), signatureFile(fs::path()), tmpDir(fs::path()),
+        fd(fd), call(std::move(call)), signature(std::move(signature))
+    {}
+
+    ~Upload()
+    {
+        if (fd >= 0)
+        {
+            close(fd);
+        }
+    }
+
+    /** @brief Answer the Upload method call, if any.
+     *
+     *  @param[in] success - Whether the version id is returned, or an error
+     */
+    void reply(bool success)
+    {
+        if (!call)
+        {
+            return;
+        }
+
+        try
+        {
+            if (success)
+            {
+                auto reply = call->new_method_return();
+                reply.append(id);
+                reply.method_return();
+            }
+            else
+            {
+                ImageFailure e;
+                sd_bus_error error =
+                    SD_BUS_ERROR_MAKE_CONST(e.name(), e.description());
+                sd_bus_reply_method_error(call->get(), &error);
+            }
+        }
+        catch (const sdbusplus::exception::SdBusError& e)
+        {
+            log<level::ERR>("Failed to reply to Upload",
+                            entry("ERROR=%s", e.what()));
+        }
+        call.reset();
+    }
+
+    /** @brief The tarball path or stream origin, for logs */
+    std::string source;
+
+    /** @brief The tarball, removed once the upload is done */
+    RemovablePath tarball;
+
+    /** @brief Detached signature file of the tarball, removed once the
+     *         upload is done */
+    RemovablePath signatureFile;
+
+    /** @brief The extraction dir, removed unless it became the image dir */
+    RemovablePath tmpDir;
+
+    /** @brief The tarball stream, -1 for tarball files */
+    int fd = -1;
+
+    /** @brief The pending Upload method call */
+    std::optional<sdbusplus::message::message> call;
+
+    /** @brief Detached signature of the whole tarball, empty if none */
+    std::string signature;
+
+    /** @brief The manifest that was checked */
+    Manifest manifest;
+
+    /** @brief Version string from the manifest */
+    std::string version;
+
+    /** @brief Purpose from the manifest */
+    Version::VersionPurpose purpose = Version::VersionPurpose::Unknown;
+
+    /** @brief Version id */
+    std::string id;
+
+    /** @brief Whether id was reserved before the extraction */
+    bool reserved = false;
+
+    /** @brief Whether tmpDir holds the complete image */
+    bool extracted = false;
+
+    /** @brief Digests of the images computed during extraction */
+    image::Digests digests;
+
+    /** @brief Fingerprint of the images whose tarball signature was checked,
+     *         empty if none was */
+    std::string ingestFingerprint;
+};
+
+// As defined by xyz/openbmc_project/Software/Upload.interface.yaml. The
+// generated bindings answer a call as soon as the method returns, while
+// these calls are answered once the image is extracted.
+const sdbusplus::vtable::vtable_t Manager::uploadVtable[] = {
+    sdbusplus::vtable::start(),
+    sdbusplus::vtable::method("Upload", "h", "s", Manager::uploadCallback),
+    sdbusplus::vtable::method("UploadSigned", "hay", "s",
+                              Manager::uploadCallback),
+    sdbusplus::vtable::end()};
+
+Manager::Manager(sdbusplus::bus::bus& bus, sd_event* loop) :
+    bus(bus),
+    softwareObjectsAdded(
+        bus,
+        MatchRules::interfacesAdded() +
+            MatchRules::argNpath(0, std::string{SOFTWARE_OBJPATH} + "/"),
+        std::bind(std::mem_fn(&Manager::softwareObjectAdded), this,
+                  std::placeholders::_1)),
+    softwareObjectsRemoved(
+        bus,
+        MatchRules::interfacesRemoved() +
+            MatchRules::argNpath(0, std::string{SOFTWARE_OBJPATH} + "/"),
+        std::bind(std::mem_fn(&Manager::softwareObjectRemoved), this,
+                  std::placeholders::_1)),
+    osRelease(loop, OS_RELEASE_FILE), dispatcher(loop),
+    workers(IMAGE_INGEST_WORKERS),
+    uploadInterface(bus, SOFTWARE_OBJPATH, UPLOAD_IFACE, uploadVtable, this)
+{
+    // Subscribe before the initial query, so no object goes missing.
+    syncSoftwareObjects();
+}
+
+void Manager::syncSoftwareObjects()
+{
+    try
+    {
+        auto paths = getSoftwareObjects(bus);
+        softwareObjects.insert(paths.begin(), paths.end());
+        softwareObjectsSynced = true;
+    }
+    catch (const sdbusplus::exception::SdBusError& e)
+    {
+        log<level::ERR>("Failed to get the software objects",
+                        entry("ERROR=%s", e.what()));
+    }
+}
+
+void Manager::softwareObjectAdded(sdbusplus::message::message& msg)
+{
+    sdbusplus::message::object_path objPath;
+    std::map<std::string, std::map<std::string, std::variant<std::string>>>
+        interfaces;
+    msg.read(objPath, interfaces);
+    std::string path(std::move(objPath));
+
+    if (interfaces.find(VERSION_BUSNAME) != interfaces.end())
+    {
+        softwareObjects.insert(std::move(path));
+    }
+}
+
+void Manager::softwareObjectRemoved(sdbusplus::message::message& msg)
+{
+    sdbusplus::message::object_path objPath;
+    std::vector<std::string> interfaces;
+    msg.read(objPath, interfaces);
+    std::string path(std::move(objPath));
+
+    if (std::find(interfaces.begin(), interfaces.end(), VERSION_BUSNAME) !=
+        interfaces.end())
+    {
+        softwareObjects.erase(path);
+    }
+}
+
+bool Manager::isKnownVersion(const std::string& id)
+{
+    auto objPath = std::string{SOFTWARE_OBJPATH} + '/' + id;
+
+    // This service only manages the uploaded versions, and there could be
+    // active versions on D-Bus that is not managed by this service.
+    // So check D-Bus if there is an existing version.
+    if (!softwareObjectsSynced)
+    {
+        syncSoftwareObjects();
+    }
+    return versions.find(id) != versions.end() || pendingIds.count(id) ||
+           softwareObjects.count(objPath);
+}
+
 int Manager::processImage(const std::string& tarFilePath)
 {
     if (!fs::is_regular_file(tarFilePath))
@@ -80,35 +400,115 @@ int Manager::processImage(const std::string& tarFilePath)
         report<ManifestFileFailure>(ManifestFail::PATH(tarFilePath.c_str()));
         return -1;
     }
-    RemovablePath tarPathRemove(tarFilePath);
-    fs::path tmpDirPath(std::string{IMG_UPLOAD_DIR});
-    tmpDirPath /= "imageXXXXXX";
-    auto tmpDir = tmpDirPath.string();
 
-    // Create a tmp dir to extract tarball.
-    if (!mkdtemp(tmpDir.data()))
+    // The tarball is checked and extracted on a worker, while the versions
+    // and the bus are only ever used from the event loop thread.
+    auto upload = std::make_shared<Upload>(tarFilePath);
+    workers.post([this, upload]() {
+        if (prepareImage(*upload) < 0)
+        {
+            log<level::ERR>("Error processing image",
+                            entry("IMAGE=%s", upload->source.c_str()));
+            return;
+        }
+        dispatcher.post([this, upload]() { reserveImage(upload); });
+    });
+    return 0;
+}
+
+int Manager::uploadCallback(sd_bus_message* msg, void* context,
+                            sd_bus_error* error)
+{
+    auto manager = static_cast<Manager*>(context);
+    auto call = sdbusplus::message::message(msg);
+    sdbusplus::message::unix_fd image;
+    call.read(image);
+
+    // UploadSigned also passes a detached signature of the whole tarball.
+    std::vector<uint8_t> signature;
+    if (std::strcmp(call.get_member(), "UploadSigned") == 0)
     {
-        log<level::ERR>("Error occurred during mkdtemp",
-                        entry("ERRNO=%d", errno));
-        report<InternalFailure>(InternalFail::FAIL("mkdtemp"));
-        return -1;
+        call.read(signature);
+        if (signature.empty() || signature.size() > maxSignatureSize)
+        {
+            return sd_bus_error_set_errno(error, EINVAL);
+        }
     }
 
-    tmpDirPath = tmpDir;
-    RemovablePath tmpDirToRemove(tmpDirPath);
-    fs::path manifestPath = tmpDirPath;
-    manifestPath /= MANIFEST_FILE_NAME;
+    // The descriptor belongs to the message, keep a copy of it. The copy
+    // shares the flags of the caller, which are left as they are: it is
+    // polled while read.
+    auto fd = fcntl(image.fd, F_DUPFD_CLOEXEC, 0);
+    if (fd < 0)
+    {
+        return sd_bus_error_set_errno(error, errno);
+    }
 
-    // Untar tarball into the tmp dir
-    auto rc = unTar(tarFilePath, tmpDirPath.string());
-    if (rc < 0)
+    // The stream is checked while it is extracted, the call is answered
+    // by addVersion once the image is complete.
+    auto upload = std::make_shared<Upload>(
+        fd, std::move(call), std::string(signature.begin(), signature.end()));
+    manager->workers.post([manager, upload]() {
+        manager->extractImage(*upload);
+        manager->dispatcher.post(
+            [manager, upload]() { manager->addVersion(*upload); });
+    });
+    return 1;
+}
+
+int Manager::prepareImage(Upload& upload)
+{
+    // Read the manifest ahead of the image payload, so that an image for
+    // another machine or a version that already exists is rejected without
+    // extracting it.
+    std::string contents;
+    try
     {
-        log<level::ERR>("Error occurred during untar");
+        tar::readMember(upload.tarball.path, MANIFEST_FILE_NAME, contents,
+                        maxManifestSize);
+    }
+    catch (const std::exception& e)
+    {
+        log<level::ERR>("Failed to read manifest from tarball",
+                        entry("FILENAME=%s", upload.source.c_str()),
+                        entry("ERROR=%s", e.what()));
+        report<UnTarFailure>(UnTarFail::PATH(upload.source.c_str()));
         return -1;
     }
+    upload.manifest = Manifest(std::move(contents));
+
+#ifdef WANT_SIGNATURE_VERIFY
+    // A detached signature is uploaded ahead of its tarball.
+    const auto& signatureFile = upload.signatureFile.path;
+    std::error_code ec;
+    if (fs::exists(signatureFile, ec))
+    {
+        auto size = fs::file_size(signatureFile, ec);
+        std::ifstream is(signatureFile, std::ios::binary);
+        upload.signature.assign(std::istreambuf_iterator<char>(is), {});
+        if (ec || !is || size == 0 || size > maxSignatureSize ||
+            upload.signature.size() != size)
+        {
+            log<level::ERR>("Failed to read tarball signature",
+                            entry("FILENAME=%s", signatureFile.c_str()));
+            report<ImageFailure>(
+                ImageFail::FAIL("Failed to read tarball signature"),
+                ImageFail::PATH(signatureFile.c_str()));
+            return -1;
+        }
+    }
+#endif
+
+    return checkManifest(upload);
+}
+
+int Manager::checkManifest(Upload& upload)
+{
+    const auto& tarFilePath = upload.source;
+    const auto& manifest = upload.manifest;
 
     // Verify the manifest file
-    if (!fs::is_regular_file(manifestPath))
+    if (manifest.empty())
     {
         log<level::ERR>("Error No manifest file",
                         entry("FILENAME=%s", tarFilePath.c_str()));
@@ -117,8 +517,8 @@ int Manager::processImage(const std::string& tarFilePath)
     }
 
     // Get version
-    auto version = Version::getValue(manifestPath.string(), "version");
-    if (version.empty())
+    upload.version = manifest.get("version");
+    if (upload.version.empty())
     {
         log<level::ERR>("Error unable to read version from manifest file");
         report<ManifestFileFailure>(ManifestFail::PATH(tarFilePath.c_str()));
@@ -126,7 +526,7 @@ int Manager::processImage(const std::string& tarFilePath)
     }
 
     // Get running machine name
-    std::string currMachine = Version::getBMCMachine(OS_RELEASE_FILE);
+    std::string currMachine = osRelease.getValue("OPENBMC_TARGET_MACHINE");
     if (currMachine.empty())
     {
         log<level::ERR>("Failed to read machine name from osRelease",
@@ -137,18 +537,18 @@ int Manager::processImage(const std::string& tarFilePath)
     }
 
     // Get machine name for image to be upgraded
-    std::string machineStr =
-        Version::getValue(manifestPath.string(), "MachineName");
+    auto machineStr = manifest.get("MachineName");
     if (!machineStr.empty())
     {
         if (machineStr != currMachine)
         {
             log<level::ERR>("BMC upgrade: Machine name doesn't match",
                             entry("CURR_MACHINE=%s", currMachine.c_str()),
-                            entry("NEW_MACHINE=%s", machineStr.c_str()));
+                            entry("NEW_MACHINE=%s",
+                                  std::string(machineStr).c_str()));
             report<ImageFailure>(
                 ImageFail::FAIL("Machine name does not match"),
-                ImageFail::PATH(manifestPath.string().c_str()));
+                ImageFail::PATH(tarFilePath.c_str()));
             return -1;
         }
     }
@@ -157,11 +557,11 @@ int Manager::processImage(const std::string& tarFilePath)
         log<level::WARNING>("No machine name in Manifest file");
         report<ImageFailure>(
             ImageFail::FAIL("MANIFEST is missing machine name"),
-            ImageFail::PATH(manifestPath.string().c_str()));
+            ImageFail::PATH(tarFilePath.c_str()));
     }
 
     // Get purpose
-    auto purposeString = Version::getValue(manifestPath.string(), "purpose");
+    std::string purposeString(manifest.get("purpose"));
     if (purposeString.empty())
     {
         log<level::ERR>("Error unable to read purpose from manifest file");
@@ -169,10 +569,10 @@ int Manager::processImage(const std::string& tarFilePath)
         return -1;
     }
 
-    auto purpose = Version::VersionPurpose::Unknown;
     try
     {
-        purpose = Version::convertVersionPurposeFromString(purposeString);
+        upload.purpose =
+            Version::convertVersionPurposeFromString(purposeString);
     }
     catch (const sdbusplus::exception::InvalidEnumString& e)
     {
@@ -181,48 +581,248 @@ int Manager::processImage(const std::string& tarFilePath)
     }
 
     // Compute id
-    auto id = Version::getId(version);
+    upload.id = Version::getId(upload.version);
+    return 0;
+}
+
+void Manager::reserveImage(std::shared_ptr<Upload> upload)
+{
+    if (isKnownVersion(upload->id))
+    {
+        log<level::INFO>("Software Object with the same version already exists",
+                         entry("VERSION_ID=%s", upload->id.c_str()));
+        return;
+    }
+
+    // Keep other uploads of the same version out until this one is done.
+    pendingIds.insert(upload->id);
+    upload->reserved = true;
+    workers.post([this, upload]() {
+        extractImage(*upload);
+        dispatcher.post([this, upload]() { addVersion(*upload); });
+    });
+}
+
+int Manager::extractImage(Upload& upload)
+{
+    fs::path tmpDirPath(std::string{IMG_UPLOAD_DIR});
+    tmpDirPath /= "imageXXXXXX";
+    auto tmpDir = tmpDirPath.string();
+
+    // Create a tmp dir to extract tarball.
+    if (!mkdtemp(tmpDir.data()))
+    {
+        log<level::ERR>("Error occurred during mkdtemp",
+                        entry("ERRNO=%d", errno));
+        report<InternalFailure>(InternalFail::FAIL("mkdtemp"));
+        return -1;
+    }
+
+    tmpDirPath = tmpDir;
+    upload.tmpDir.path = tmpDirPath;
+
+    tar::Observer* digests = nullptr;
+#ifdef WANT_SIGNATURE_VERIFY
+    // Hash the images while they are extracted, so that the signature
+    // verification does not have to read them again.
+    std::set<std::string> hashedImages(image::bmcImages.begin(),
+                                       image::bmcImages.end());
+    for (const auto& optionalImage : image::getOptionalImages())
+    {
+        hashedImages.insert(optionalImage);
+    }
+    image::DigestCollector digestCollector(hashedImages);
+    digests = &digestCollector;
+
+    // The detached signature of a tarball is checked while the tarball is
+    // read, so its images need not be verified on activation.
+    std::optional<image::TarballVerifier> tarballVerifier;
+    tar::Tap tap;
+    if (!upload.signature.empty())
+    {
+        tarballVerifier.emplace(SIGNED_IMAGE_CONF_PATH,
+                                std::move(upload.signature));
+        tap = [&tarballVerifier](const uint8_t* data, size_t len) {
+            tarballVerifier->update(data, len);
+        };
+    }
+#else
+    tar::Tap tap;
+#endif
+
+    // A manifest checked ahead of the extraction must not be replaced by
+    // another one, a streamed manifest is checked as soon as it arrives.
+    ManifestObserver observer(
+        [this, &upload](std::string&& contents) {
+            if (!upload.manifest.empty())
+            {
+                if (contents != upload.manifest.contents())
+                {
+                    throw std::runtime_error("Manifest changed");
+                }
+                return;
+            }
+            upload.manifest = Manifest(std::move(contents));
+            if (checkManifest(upload) < 0)
+            {
+                throw std::runtime_error("Manifest check failed");
+            }
+        },
+        digests);
+
+    tar::Index index;
+    tar::Index* members = nullptr;
+#ifdef WANT_TARBALL_INDEX
+    // Large images of a tarball file are left in the tarball and read in
+    // place, instead of holding a second copy of them in the upload dir.
+    if (upload.fd < 0)
+    {
+        members = &index;
+    }
+#endif
+
+    // Untar tarball into the tmp dir
+    auto rc = upload.fd < 0
+                  ? unTar(upload.source, tmpDirPath.string(), &observer,
+                          members, tap)
+                  : unTar(upload.fd, upload.source, tmpDirPath.string(),
+                          &observer, tap);
+    if (rc < 0)
+    {
+        log<level::ERR>("Error occurred during untar");
+        return -1;
+    }
+
+    // Verify the manifest file
+    if (upload.manifest.empty())
+    {
+        log<level::ERR>("Error No manifest file",
+                        entry("FILENAME=%s", upload.source.c_str()));
+        report<ManifestFileFailure>(
+            ManifestFail::PATH(upload.source.c_str()));
+        return -1;
+    }
+
+    if (!index.empty())
+    {
+        if (!tar::storeIndex(tmpDirPath, index))
+        {
+            return -1;
+        }
+
+        // Keep the tarball the index refers to along with the image.
+        std::error_code ec;
+        fs::rename(upload.tarball.path, tmpDirPath / TARBALL_FILE_NAME, ec);
+        if (ec)
+        {
+            log<level::ERR>("Error keeping the tarball with the image",
+                            entry("FILENAME=%s", upload.source.c_str()),
+                            entry("ERROR=%s", ec.message().c_str()));
+            return -1;
+        }
+        upload.tarball.path.clear();
+    }
+
+#ifdef WANT_SIGNATURE_VERIFY
+    // Stored once the image dir is in place, bound to its files.
+    upload.digests = digestCollector.digests();
+
+    if (tarballVerifier)
+    {
+        if (!tarballVerifier->verify(upload.manifest.get("KeyType")))
+        {
+            log<level::ERR>("Tarball signature validation failed",
+                            entry("FILENAME=%s", upload.source.c_str()));
+            report<ImageFailure>(
+                ImageFail::FAIL("Tarball signature validation failed"),
+                ImageFail::PATH(upload.source.c_str()));
+            return -1;
+        }
+
+        // Taken last, everything in the dir is covered by it.
+        upload.ingestFingerprint =
+            image::fingerprint(tmpDirPath, SIGNED_IMAGE_CONF_PATH,
+                               upload.digests);
+    }
+#endif
+
+    upload.extracted = true;
+    return 0;
+}
+
+void Manager::addVersion(Upload& upload)
+{
+    if (upload.reserved)
+    {
+        pendingIds.erase(upload.id);
+    }
+    if (!upload.extracted)
+    {
+        log<level::ERR>("Error processing image",
+                        entry("IMAGE=%s", upload.source.c_str()));
+        upload.reply(false);
+        return;
+    }
+
+    // A streamed upload is checked for an existing version only now.
+    if (!upload.reserved && isKnownVersion(upload.id))
+    {
+        log<level::INFO>("Software Object with the same version already exists",
+                         entry("VERSION_ID=%s", upload.id.c_str()));
+        upload.reply(true);
+        return;
+    }
 
     fs::path imageDirPath = std::string{IMG_UPLOAD_DIR};
-    imageDirPath /= id;
+    imageDirPath /= upload.id;
 
-    if (fs::exists(imageDirPath))
+    std::error_code ec;
+    if (fs::exists(imageDirPath, ec))
     {
-        fs::remove_all(imageDirPath);
+        fs::remove_all(imageDirPath, ec);
     }
 
     // Rename the temp dir to image dir
-    fs::rename(tmpDirPath, imageDirPath);
+    fs::rename(upload.tmpDir.path, imageDirPath, ec);
+    if (ec)
+    {
+        log<level::ERR>("Error moving image to image dir",
+                        entry("PATH=%s", imageDirPath.c_str()),
+                        entry("ERROR=%s", ec.message().c_str()));
+        upload.reply(false);
+        return;
+    }
 
     // Clear the path, so it does not attemp to remove a non-existing path
-    tmpDirToRemove.path.clear();
+    upload.tmpDir.path.clear();
 
-    auto objPath = std::string{SOFTWARE_OBJPATH} + '/' + id;
-
-    // This service only manages the uploaded versions, and there could be
-    // active versions on D-Bus that is not managed by this service.
-    // So check D-Bus if there is an existing version.
-    auto allSoftwareObjs = getSoftwareObjects(bus);
-    auto it =
-        std::find(allSoftwareObjs.begin(), allSoftwareObjs.end(), objPath);
-    if (versions.find(id) == versions.end() && it == allSoftwareObjs.end())
-    {
-        // Create Version object
-        auto versionPtr = std::make_unique<Version>(
-            bus, objPath, version, purpose, imageDirPath.string(),
-            std::bind(&Manager::erase, this, std::placeholders::_1));
-        versionPtr->deleteObject =
-            std::make_unique<phosphor::software::manager::Delete>(bus, objPath,
-                                                                  *versionPtr);
-        versions.insert(std::make_pair(id, std::move(versionPtr)));
+#ifdef WANT_SIGNATURE_VERIFY
+    // Recorded out of the image dir, where anyone able to write the image
+    // could forge it.
+    image::storeDigests(DIGEST_DIR, upload.id, imageDirPath, upload.digests);
+    if (upload.ingestFingerprint.empty())
+    {
+        image::removeIngestVerified(INGEST_VERIFIED_DIR, upload.id);
     }
     else
     {
-        log<level::INFO>("Software Object with the same version already exists",
-                         entry("VERSION_ID=%s", id.c_str()));
-        fs::remove_all(imageDirPath);
+        image::storeIngestVerified(INGEST_VERIFIED_DIR, upload.id,
+                                   upload.ingestFingerprint);
     }
-    return 0;
+#endif
+
+    auto objPath = std::string{SOFTWARE_OBJPATH} + '/' + upload.id;
+
+    // Create Version object
+    auto versionPtr = std::make_unique<Version>(
+        bus, objPath, upload.version, upload.purpose, imageDirPath.string(),
+        std::bind(&Manager::erase, this, std::placeholders::_1));
+    versionPtr->deleteObject =
+        std::make_unique<phosphor::software::manager::Delete>(bus, objPath,
+                                                              *versionPtr);
+    versions.insert(std::make_pair(upload.id, std::move(versionPtr)));
+
+    upload.reply(true);
 }
 
 void Manager::erase(std::string entryId)
@@ -250,11 +850,16 @@ void Manager::erase(std::string entryId)
     {
         fs::remove_all(imageDirPath);
     }
+#ifdef WANT_SIGNATURE_VERIFY
+    image::removeDigests(DIGEST_DIR, entryId);
+    image::removeIngestVerified(INGEST_VERIFIED_DIR, entryId);
+#endif
     this->versions.erase(entryId);
 }
 
 int Manager::unTar(const std::string& tarFilePath,
-                   const std::string& extractDirPath)
+                   const std::string& extractDirPath, tar::Observer* observer,
+                   tar::Index* index, const tar::Tap& tap)
 {
     if (tarFilePath.empty())
     {
@@ -271,35 +876,48 @@ int Manager::unTar(const std::string& tarFilePath,
 
     log<level::INFO>("Untaring", entry("FILENAME=%s", tarFilePath.c_str()),
                      entry("EXTRACTIONDIR=%s", extractDirPath.c_str()));
-    int status = 0;
-    pid_t pid = fork();
-
-    if (pid == 0)
+    try
     {
-        // child process
-        execl("/bin/tar", "tar", "-xf", tarFilePath.c_str(), "-C",
-              extractDirPath.c_str(), (char*)0);
-        // execl only returns on fail
-        log<level::ERR>("Failed to execute untar file",
-                        entry("FILENAME=%s", tarFilePath.c_str()));
+        // The tarball is removed once extracted, free its tmpfs pages while
+        // extracting so both do not have to fit in memory at once.
+        tar::extract(tarFilePath, extractDirPath, observer, index, true, tap);
+    }
+    catch (const std::exception& e)
+    {
+        log<level::ERR>("Failed to untar file",
+                        entry("FILENAME=%s", tarFilePath.c_str()),
+                        entry("ERROR=%s", e.what()));
         report<UnTarFailure>(UnTarFail::PATH(tarFilePath.c_str()));
         return -1;
     }
-    else if (pid > 0)
+
+    return 0;
+}
+
+int Manager::unTar(int fd, const std::string& source,
+                   const std::string& extractDirPath, tar::Observer* observer,
+                   const tar::Tap& tap)
+{
+    log<level::INFO>("Untaring", entry("FILENAME=%s", source.c_str()),
+                     entry("EXTRACTIONDIR=%s", extractDirPath.c_str()));
+    try
     {
-        waitpid(pid, &status, 0);
-        if (WEXITSTATUS(status))
+        // A stalled client must not hold the worker forever.
+        tar::Reader reader(fd, tap,
+                           std::chrono::steady_clock::now() +
+                               std::chrono::seconds(IMAGE_UPLOAD_TIMEOUT));
+        tar::extract(reader, extractDirPath, observer);
+        if (tap)
         {
-            log<level::ERR>("Failed to untar file",
-                            entry("FILENAME=%s", tarFilePath.c_str()));
-            report<UnTarFailure>(UnTarFail::PATH(tarFilePath.c_str()));
-            return -1;
+            reader.drain();
         }
     }
-    else
+    catch (const std::exception& e)
     {
-        log<level::ERR>("fork() failed.");
-        report<UnTarFailure>(UnTarFail::PATH(tarFilePath.c_str()));
+        log<level::ERR>("Failed to untar stream",
+                        entry("FILENAME=%s", source.c_str()),
+                        entry("ERROR=%s", e.what()));
+        report<UnTarFailure>(UnTarFail::PATH(source.c_str()));
         return -1;
     }
 
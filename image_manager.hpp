@@ -1,8 +1,17 @@
 #pragma once
+#include "manifest.hpp"
+#include "os_release.hpp"
+#include "tar_extractor.hpp"
 #include "version.hpp"
+#include "worker_pool.hpp"
 
+#include <sdbusplus/bus/match.hpp>
 #include <sdbusplus/server.hpp>
+#include <sdbusplus/server/interface.hpp>
+#include <sdbusplus/vtable.hpp>
 
+#include <memory>
+#include <set>
 #include <string>
 
 namespace phosphor
@@ -12,26 +21,41 @@ namespace software
 namespace manager
 {
 
+struct Upload;
+
 /** @class Manager
  *  @brief Contains a map of Version dbus objects.
  *  @details The software image manager class that contains the Version dbus
- *           objects and their version ids.
+ *           objects and their version ids. Besides tarballs placed in the
+ *           upload dir, it accepts tarballs streamed through a file
+ *           descriptor by the Upload method of UPLOAD_IFACE, which returns
+ *           the version id once the image is extracted.
+ *
+ *           A tarball may come with a detached signature over all of it,
+ *           placed in the upload dir ahead of the tarball with the
+ *           SIGNATURE_FILE_EXT extension, or passed along with the stream
+ *           to the UploadSigned method. The signature is checked against
+ *           the system keys while the tarball is extracted, and the image
+ *           is rejected if it does not match. Its images are then not
+ *           verified again on activation.
  */
 class Manager
 {
   public:
     /** @brief Constructs Manager Class
      *
-     * @param[in] bus - The Dbus bus object
+     * @param[in] bus  - The Dbus bus object
+     * @param[in] loop - The sd-event loop the bus is attached to
      */
-    Manager(sdbusplus::bus::bus& bus) : bus(bus){};
+    Manager(sdbusplus::bus::bus& bus, sd_event* loop);
 
     /**
-     * @brief Verify and untar the tarball. Verify the manifest file.
-     *        Create and populate the version and filepath interfaces.
+     * @brief Queue the tarball for processing. The tarball is verified and
+     *        extracted on a worker thread, the version and filepath
+     *        interfaces are created on the event loop thread afterwards.
      *
      * @param[in]  tarballFilePath - Tarball path.
-     * @param[out] result          - 0 if successful.
+     * @param[out] result          - 0 if the tarball was queued.
      */
     int processImage(const std::string& tarballFilePath);
 
@@ -51,15 +75,161 @@ class Manager
     /** @brief Persistent sdbusplus DBus bus connection. */
     sdbusplus::bus::bus& bus;
 
+    /** @brief Paths of the Version objects under SOFTWARE_OBJPATH of all
+     *         services, including the ones not managed by this service */
+    std::set<std::string> softwareObjects;
+
+    /** @brief Whether softwareObjects has been filled from the mapper */
+    bool softwareObjectsSynced = false;
+
+    /** @brief sdbusplus signal match for added software objects */
+    sdbusplus::bus::match_t softwareObjectsAdded;
+
+    /** @brief sdbusplus signal match for removed software objects */
+    sdbusplus::bus::match_t softwareObjectsRemoved;
+
+    /** @brief The running BMC os-release, for the machine name */
+    OsRelease osRelease;
+
+    /** @brief Version ids of the uploads currently being extracted */
+    std::set<std::string> pendingIds;
+
+    /** @brief Runs the completion of uploads on the event loop thread */
+    utils::EventDispatcher dispatcher;
+
+    /** @brief Verifies and extracts uploads, destroyed before the members
+     *         above so no worker uses them once they are gone. */
+    utils::WorkerPool workers;
+
+    /** @brief vtable of the Upload and UploadSigned methods of
+     *         Upload.interface.yaml */
+    static const sdbusplus::vtable::vtable_t uploadVtable[];
+
+    /** @brief The UPLOAD_IFACE object, destroyed first so no new uploads
+     *         arrive during destruction. */
+    sdbusplus::server::interface::interface uploadInterface;
+
+    /**
+     * @brief Check whether a version is already known, either managed by
+     *        this service, being extracted or on D-Bus.
+     *
+     * @param[in]  id     - The version id.
+     * @param[out] result - true if the version exists.
+     */
+    bool isKnownVersion(const std::string& id);
+
+    /**
+     * @brief sd-bus callback of the Upload and UploadSigned methods. Queues
+     *        the extraction of the tarball streamed through the file
+     *        descriptor argument, the version id is returned once the image
+     *        is extracted. The call fails if the tarball is not read within
+     *        IMAGE_UPLOAD_TIMEOUT seconds.
+     *
+     * @param[in] msg     - The method call
+     * @param[in] context - Pointer to the Manager object
+     * @param[in] error   - Error to return when the call fails right away
+     * @returns 1 once queued, negative errno on failure
+     */
+    static int uploadCallback(sd_bus_message* msg, void* context,
+                              sd_bus_error* error);
+
+    /**
+     * @brief Fill softwareObjects with the Version objects known to the
+     *        mapper. The signal matches keep it current afterwards.
+     */
+    void syncSoftwareObjects();
+
     /**
-     * @brief Untar the tarball.
+     * @brief Callback for InterfacesAdded under SOFTWARE_OBJPATH.
+     *
+     * @param[in] msg - Data associated with the signal
+     */
+    void softwareObjectAdded(sdbusplus::message::message& msg);
+
+    /**
+     * @brief Callback for InterfacesRemoved under SOFTWARE_OBJPATH.
+     *
+     * @param[in] msg - Data associated with the signal
+     */
+    void softwareObjectRemoved(sdbusplus::message::message& msg);
+
+    /**
+     * @brief Read and check the manifest of an upload. Runs on a worker.
+     *
+     * @param[in]  upload - The upload.
+     * @param[out] result - 0 if successful.
+     */
+    int prepareImage(Upload& upload);
+
+    /**
+     * @brief Check the manifest of an upload and compute its version id.
+     *        Runs on a worker.
+     *
+     * @param[in]  upload - The upload.
+     * @param[out] result - 0 if successful.
+     */
+    int checkManifest(Upload& upload);
+
+    /**
+     * @brief Reserve the version id of an upload and queue its extraction,
+     *        unless the version already exists. Runs on the event loop
+     *        thread.
+     *
+     * @param[in] upload - The upload.
+     */
+    void reserveImage(std::shared_ptr<Upload> upload);
+
+    /**
+     * @brief Extract an upload into a temporary dir, checking the manifest
+     *        of streamed uploads on the way. Runs on a worker.
+     *
+     * @param[in]  upload - The upload.
+     * @param[out] result - 0 if successful.
+     */
+    int extractImage(Upload& upload);
+
+    /**
+     * @brief Release the version id of an upload, move the extracted image
+     *        to its image dir and create its Version object. Answers the
+     *        Upload method call of streamed uploads. Runs on the event loop
+     *        thread.
+     *
+     * @param[in] upload - The upload.
+     */
+    void addVersion(Upload& upload);
+
+    /**
+     * @brief Untar the tarball. The tarball is consumed, it can only be
+     *        removed afterwards unless images were left in it.
      *
      * @param[in]  tarballFilePath - Tarball path.
      * @param[in]  extractDirPath  - Dir path to extract tarball ball to.
+     * @param[in]  observer        - Optional observer of the extracted data.
+     * @param[out] index           - Optional index of the images left in
+     *                               the tarball, see tar::extract().
+     * @param[in]  tap             - Optional receiver of the whole tarball.
      * @param[out] result          - 0 if successful.
      */
     static int unTar(const std::string& tarballFilePath,
-                     const std::string& extractDirPath);
+                     const std::string& extractDirPath,
+                     tar::Observer* observer = nullptr,
+                     tar::Index* index = nullptr,
+                     const tar::Tap& tap = nullptr);
+
+    /**
+     * @brief Untar a tarball stream.
+     *
+     * @param[in]  fd             - Tarball stream.
+     * @param[in]  source         - Origin of the stream, for logs.
+     * @param[in]  extractDirPath - Dir path to extract tarball ball to.
+     * @param[in]  observer       - Optional observer of the extracted data.
+     * @param[in]  tap            - Optional receiver of the whole stream.
+     * @param[out] result         - 0 if successful.
+     */
+    static int unTar(int fd, const std::string& source,
+                     const std::string& extractDirPath,
+                     tar::Observer* observer = nullptr,
+                     const tar::Tap& tap = nullptr);
 };
 
 } // namespace manager
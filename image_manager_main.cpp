@@ -22,7 +22,7 @@ int main()
 
     try
     {
-        phosphor::software::manager::Manager imageManager(bus);
+        phosphor::software::manager::Manager imageManager(bus, loop);
         phosphor::software::manager::Watch watch(
             loop, std::bind(std::mem_fn(&Manager::processImage), &imageManager,
                             std::placeholders::_1));
@@ -3,8 +3,9 @@
 #include "image_verify.hpp"
 
 #include "images.hpp"
-#include "utils.hpp"
-#include "version.hpp"
+#include "key_cache.hpp"
+#include "manifest.hpp"
+#include "tar_index.hpp"
 
 #include <fcntl.h>
 #include <openssl/err.h>
@@ -15,8 +16,15 @@
 #include <phosphor-logging/log.hpp>
 #include <xyz/openbmc_project/Common/error.hpp>
 
+#include <algorithm>
+#include <atomic>
 #include <fstream>
+#include <memory>
 #include <set>
+#include <stdexcept>
+#include <system_error>
+#include <thread>
+#include <vector>
 
 namespace phosphor
 {
@@ -34,63 +42,23 @@ constexpr auto keyTypeTag = "KeyType";
 constexpr auto hashFunctionTag = "HashType";
 
 Signature::Signature(const fs::path& imageDirPath,
-                     const fs::path& signedConfPath) :
+                     const fs::path& signedConfPath, Digests digests,
+                     HashBackend backend) :
     imageDirPath(imageDirPath),
-    signedConfPath(signedConfPath)
+    signedConfPath(signedConfPath), digests(std::move(digests)),
+    backend(backend)
 {
-    fs::path file(imageDirPath / MANIFEST_FILE_NAME);
+    manifest = Manifest::load(imageDirPath / MANIFEST_FILE_NAME);
 
-    keyType = Version::getValue(file, keyTypeTag);
-    hashType = Version::getValue(file, hashFunctionTag);
-}
-
-AvailableKeyTypes Signature::getAvailableKeyTypesFromSystem() const
-{
-    AvailableKeyTypes keyTypes{};
-
-    // Find the path of all the files
-    if (!fs::is_directory(signedConfPath))
-    {
-        log<level::ERR>("Signed configuration path not found in the system");
-        elog<InternalFailure>();
-    }
-
-    // Look for all the hash and public key file names get the key value
-    // For example:
-    // /etc/activationdata/OpenBMC/publickey
-    // /etc/activationdata/OpenBMC/hashfunc
-    // /etc/activationdata/GA/publickey
-    // /etc/activationdata/GA/hashfunc
-    // Set will have OpenBMC, GA
-
-    for (const auto& p : fs::recursive_directory_iterator(signedConfPath))
-    {
-        if ((p.path().filename() == HASH_FILE_NAME) ||
-            (p.path().filename() == PUBLICKEY_FILE_NAME))
-        {
-            // extract the key types
-            // /etc/activationdata/OpenBMC/  -> get OpenBMC from the path
-            auto key = p.path().parent_path();
-            keyTypes.insert(key.filename());
-        }
-    }
-
-    return keyTypes;
-}
-
-inline KeyHashPathPair Signature::getKeyHashFileNames(const Key_t& key) const
-{
-    fs::path hashpath(signedConfPath / key / HASH_FILE_NAME);
-    fs::path keyPath(signedConfPath / key / PUBLICKEY_FILE_NAME);
-
-    return std::make_pair(std::move(hashpath), std::move(keyPath));
+    keyType = manifest.get(keyTypeTag);
+    hashType = manifest.get(hashFunctionTag);
 }
 
 bool Signature::verifyFullImage()
 {
     bool ret = true;
 #ifdef WANT_SIGNATURE_FULL_VERIFY
-    std::vector<std::string> fullImages = {
+    std::vector<fs::path> fullImages = {
         fs::path(imageDirPath) / "image-bmc.sig",
         fs::path(imageDirPath) / "image-hostfw.sig",
         fs::path(imageDirPath) / "image-kernel.sig",
@@ -102,13 +70,8 @@ bool Signature::verifyFullImage()
         fs::path(imageDirPath) / "MANIFEST.sig",
         fs::path(imageDirPath) / "publickey.sig"};
 
-    // Merge files
-    std::string tmpFullFile = "/tmp/image-full";
-    utils::mergeFiles(fullImages, tmpFullFile);
-
-    // Validate the full image files
-    fs::path pkeyFullFile(tmpFullFile);
-
+    // Validate the full image files, hashed in order without merging them
+    // into a copy first.
     std::string imageFullSig = "image-full.sig";
     fs::path pkeyFullFileSig(imageDirPath / imageFullSig);
     pkeyFullFileSig.replace_extension(SIGNATURE_FILE_EXT);
@@ -116,8 +79,7 @@ bool Signature::verifyFullImage()
     // image specific publickey file name.
     fs::path publicKeyFile(imageDirPath / PUBLICKEY_FILE_NAME);
 
-    ret = verifyFile(pkeyFullFile, pkeyFullFileSig, publicKeyFile, hashType);
-    fs::remove(tmpFullFile);
+    ret = verifyFiles(fullImages, pkeyFullFileSig, publicKeyFile, hashType);
 #endif
 
     return ret;
@@ -138,6 +100,13 @@ bool Signature::verify()
         // image specific publickey file name.
         fs::path publicKeyFile(imageDirPath / PUBLICKEY_FILE_NAME);
 
+        // Image files and their signature files, verified all at once.
+        std::vector<std::pair<fs::path, fs::path>> images;
+
+        // Image files with a hash tree in the manifest, now known to be
+        // genuine, and verified against it instead of a signature file.
+        std::vector<std::pair<std::string, HashTree>> trees;
+
         // Validate the BMC image files.
         for (const auto& bmcImage : bmcImages)
         {
@@ -149,19 +118,25 @@ bool Signature::verify()
             fs::path sigFile(file);
             sigFile.replace_extension(SIGNATURE_FILE_EXT);
 
-            // Make sure the existence of the image file and sig file in the system.
-            if ( fs::exists(file) && fs::exists(sigFile) )
+            // The image may be extracted or left in the tarball.
+            auto hasImage = tar::locate(imageDirPath, bmcImage).has_value();
+
+            if (hasImage)
             {
-                // Verify the signature.
-                auto valid = verifyFile(file, sigFile, publicKeyFile, hashType);
-                if (valid == false)
+                auto tree = HashTree::load(manifest, imageDirPath, bmcImage);
+                if (tree)
                 {
-                    log<level::ERR>("Image file Signature Validation failed",
-                                    entry("IMAGE=%s", bmcImage.c_str()));
-                    return false;
+                    trees.emplace_back(bmcImage, std::move(*tree));
+                    continue;
                 }
             }
-            else if ( fs::exists(file) && ! fs::exists(sigFile) )
+
+            // Make sure the existence of the image file and sig file in the system.
+            if ( hasImage && fs::exists(sigFile) )
+            {
+                images.emplace_back(file, sigFile);
+            }
+            else if ( hasImage && ! fs::exists(sigFile) )
             {
                 log<level::ERR>("Image file Signature is not exist",
                                 entry("IMAGE=%s", bmcImage.c_str()));
@@ -176,23 +151,34 @@ bool Signature::verify()
             fs::path file(imageDirPath);
             file /= optionalImage;
 
-            if (fs::exists(file))
+            if (tar::locate(imageDirPath, optionalImage))
             {
+                auto tree =
+                    HashTree::load(manifest, imageDirPath, optionalImage);
+                if (tree)
+                {
+                    trees.emplace_back(optionalImage, std::move(*tree));
+                    continue;
+                }
+
                 // Build Signature File name
                 fs::path sigFile(file);
                 sigFile.replace_extension(SIGNATURE_FILE_EXT);
 
-                // Verify the signature.
-                auto valid = verifyFile(file, sigFile, publicKeyFile, hashType);
-                if (valid == false)
-                {
-                    log<level::ERR>("Image file Signature Validation failed",
-                                    entry("IMAGE=%s", optionalImage.c_str()));
-                    return false;
-                }
+                images.emplace_back(file, sigFile);
             }
         }
 
+        if (verifyImages(images, publicKeyFile) == false)
+        {
+            return false;
+        }
+
+        if (verifyTrees(trees) == false)
+        {
+            return false;
+        }
+
         if (verifyFullImage() == false)
         {
             log<level::ERR>("Image full file Signature Validation failed");
@@ -214,11 +200,104 @@ bool Signature::verify()
     }
 }
 
+bool Signature::verifyImages(
+    const std::vector<std::pair<fs::path, fs::path>>& images,
+    const fs::path& publicKey)
+{
+    std::atomic<bool> failed = false;
+    std::atomic<size_t> next = 0;
+
+    // Each thread takes the next image until all are done or one failed.
+    auto worker = [&]() {
+        size_t i;
+        while (!failed && (i = next++) < images.size())
+        {
+            const auto& [file, sigFile] = images[i];
+            auto valid = false;
+            try
+            {
+                valid = verifyImage(file, sigFile, publicKey, &failed);
+            }
+            catch (const InternalFailure& e)
+            {
+                valid = false;
+            }
+            catch (const std::exception& e)
+            {
+                log<level::ERR>(e.what());
+                valid = false;
+            }
+
+            // Images cancelled after the first failure are not reported.
+            if (!valid && !failed.exchange(true))
+            {
+                log<level::ERR>("Image file Signature Validation failed",
+                                entry("IMAGE=%s", file.filename().c_str()));
+            }
+        }
+    };
+
+    auto count = std::min<size_t>(
+        images.size(), std::max(1u, std::thread::hardware_concurrency()));
+    std::vector<std::thread> threads;
+    for (size_t i = 1; i < count; i++)
+    {
+        try
+        {
+            threads.emplace_back(worker);
+        }
+        catch (const std::system_error& e)
+        {
+            // Carry on with the threads there are.
+            break;
+        }
+    }
+    worker();
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
+
+    return !failed;
+}
+
+bool Signature::verifyTrees(
+    const std::vector<std::pair<std::string, HashTree>>& trees)
+{
+    for (const auto& [image, tree] : trees)
+    {
+        auto location = tar::locate(imageDirPath, image);
+        if (!location)
+        {
+            log<level::ERR>("Failed to find the image file.",
+                            entry("IMAGE=%s", image.c_str()));
+            return false;
+        }
+
+        auto failed = tree.verify(*location);
+        if (!failed.empty())
+        {
+            log<level::ERR>("Image file hash tree validation failed",
+                            entry("IMAGE=%s", image.c_str()),
+                            entry("CHUNK=%zu", failed.front()),
+                            entry("CHUNKS=%zu", failed.size()));
+            return false;
+        }
+    }
+    return true;
+}
+
 bool Signature::systemLevelVerify()
 {
+    if (!fs::is_directory(signedConfPath))
+    {
+        log<level::ERR>("Signed configuration path not found in the system");
+        elog<InternalFailure>();
+    }
+
     // Get available key types from the system.
-    auto keyTypes = getAvailableKeyTypesFromSystem();
-    if (keyTypes.empty())
+    auto keyring = KeyCache::instance().keyring(signedConfPath);
+    if (keyring->empty())
     {
         log<level::ERR>("Missing Signature configuration data in system");
         elog<InternalFailure>();
@@ -234,6 +313,22 @@ bool Signature::systemLevelVerify()
     fs::path manifestFileSig(manifestFile);
     manifestFileSig.replace_extension(SIGNATURE_FILE_EXT);
 
+    // Try the key type declared by the manifest first, the others only if
+    // it does not verify the image.
+    std::vector<const SystemKey*> keys;
+    auto declared = keyring->find(keyType);
+    if (declared != keyring->end())
+    {
+        keys.push_back(&declared->second);
+    }
+    for (const auto& [name, key] : *keyring)
+    {
+        if (name != keyType)
+        {
+            keys.push_back(&key);
+        }
+    }
+
     auto valid = false;
 
     // Verify the file signature with available key types
@@ -241,22 +336,18 @@ bool Signature::systemLevelVerify()
     // For any internal failure during the key/hash pair specific
     // validation, should continue the validation with next
     // available Key/hash pair.
-    for (const auto& keyType : keyTypes)
+    for (const auto& key : keys)
     {
-        auto keyHashPair = getKeyHashFileNames(keyType);
-
-        auto hashFunc = Version::getValue(keyHashPair.first, hashFunctionTag);
-
         try
         {
             // Verify manifest file signature
-            valid = verifyFile(manifestFile, manifestFileSig,
-                               keyHashPair.second, hashFunc);
+            valid = verifyFile(manifestFile, manifestFileSig, key->publicKey,
+                               key->hashFunc);
             if (valid)
             {
                 // Verify publickey file signature.
-                valid = verifyFile(pkeyFile, pkeyFileSig, keyHashPair.second,
-                                   hashFunc);
+                valid = verifyFile(pkeyFile, pkeyFileSig, key->publicKey,
+                                   key->hashFunc);
                 if (valid)
                 {
                     break;
@@ -273,38 +364,45 @@ bool Signature::systemLevelVerify()
 
 bool Signature::verifyFile(const fs::path& file, const fs::path& sigFile,
                            const fs::path& publicKey,
-                           const std::string& hashFunc)
+                           const std::string& hashFunc,
+                           const std::atomic<bool>* cancel)
 {
 
     // Check existence of the files in the system.
-    if (!(fs::exists(file) && fs::exists(sigFile)))
+    auto location = tar::locate(file.parent_path(), file.filename());
+    if (!(location && fs::exists(sigFile)))
     {
         log<level::ERR>("Failed to find the Data or signature file.",
                         entry("FILE=%s", file.c_str()));
         elog<InternalFailure>();
     }
 
-    // Create RSA.
-    auto publicRSA = createPublicRSA(publicKey);
-    if (publicRSA == nullptr)
+    return verifyFiles({file}, sigFile, publicKey, hashFunc, cancel);
+}
+
+bool Signature::verifyFiles(const std::vector<fs::path>& files,
+                            const fs::path& sigFile, const fs::path& publicKey,
+                            const std::string& hashFunc,
+                            const std::atomic<bool>* cancel)
+{
+    if (!fs::exists(sigFile))
+    {
+        log<level::ERR>("Failed to find the signature file.",
+                        entry("FILE=%s", sigFile.c_str()));
+        elog<InternalFailure>();
+    }
+
+    // Get the RSA key, parsed once per key file.
+    auto pKeyPtr = KeyCache::instance().publicKey(publicKey);
+    if (pKeyPtr == nullptr)
     {
         log<level::ERR>("Failed to create RSA",
                         entry("FILE=%s", publicKey.c_str()));
         elog<InternalFailure>();
     }
 
-    // Assign key to RSA.
-    EVP_PKEY_Ptr pKeyPtr(EVP_PKEY_new(), ::EVP_PKEY_free);
-    EVP_PKEY_assign_RSA(pKeyPtr.get(), publicRSA);
-
-    // Initializes a digest context.
-    EVP_MD_CTX_Ptr rsaVerifyCtx(EVP_MD_CTX_new(), ::EVP_MD_CTX_free);
-
-    // Adds all digest algorithms to the internal table
-    OpenSSL_add_all_digests();
-
     // Create Hash structure.
-    auto hashStruct = EVP_get_digestbyname(hashFunc.c_str());
+    auto hashStruct = KeyCache::instance().digest(hashFunc);
     if (!hashStruct)
     {
         log<level::ERR>("EVP_get_digestbynam: Unknown message digest",
@@ -312,80 +410,117 @@ bool Signature::verifyFile(const fs::path& file, const fs::path& sigFile,
         elog<InternalFailure>();
     }
 
-    auto result = EVP_DigestVerifyInit(rsaVerifyCtx.get(), nullptr, hashStruct,
-                                       nullptr, pKeyPtr.get());
+    // Hash the data files one after the other, in chunks, so memory use
+    // does not grow with the image size and a cancelled verification stops
+    // early.
+    std::string digest;
+    try
+    {
+        auto hasher = Hasher::create(hashStruct, backend);
+        for (const auto& file : files)
+        {
+            auto location = tar::locate(file.parent_path(), file.filename());
+            if (!location || location->size == 0)
+            {
+                continue;
+            }
+
+            if (!hasher->update(*location, cancel))
+            {
+                return false;
+            }
+        }
+        digest = hasher->final();
+    }
+    catch (const std::runtime_error& e)
+    {
+        log<level::ERR>("Error occurred while hashing the image",
+                        entry("ERROR=%s", e.what()),
+                        entry("PATH=%s", sigFile.c_str()));
+        elog<InternalFailure>();
+    }
+
+    return verifyDigest(digest, sigFile, publicKey, hashFunc);
+}
 
-    if (result <= 0)
+bool Signature::verifyImage(const fs::path& file, const fs::path& sigFile,
+                            const fs::path& publicKey,
+                            const std::atomic<bool>* cancel)
+{
+    auto it = digests.find(file.filename());
+    if (it != digests.end() && it->second.hashFunc == hashType)
     {
-        log<level::ERR>("Error occurred during EVP_DigestVerifyInit",
-                        entry("ERRCODE=%lu", ERR_get_error()));
+        return verifyDigest(it->second.value, sigFile, publicKey, hashType);
+    }
+
+    return verifyFile(file, sigFile, publicKey, hashType, cancel);
+}
+
+bool Signature::verifyDigest(const std::string& digest, const fs::path& sigFile,
+                             const fs::path& publicKey,
+                             const std::string& hashFunc)
+{
+    if (!fs::exists(sigFile))
+    {
+        log<level::ERR>("Failed to find the signature file.",
+                        entry("FILE=%s", sigFile.c_str()));
         elog<InternalFailure>();
     }
 
-    // Hash the data file and update the verification context
-    auto size = fs::file_size(file);
-    auto dataPtr = mapFile(file, size);
+    // Get the RSA key, parsed once per key file.
+    auto pKeyPtr = KeyCache::instance().publicKey(publicKey);
+    if (pKeyPtr == nullptr)
+    {
+        log<level::ERR>("Failed to create RSA",
+                        entry("FILE=%s", publicKey.c_str()));
+        elog<InternalFailure>();
+    }
 
-    result = EVP_DigestVerifyUpdate(rsaVerifyCtx.get(), dataPtr(), size);
-    if (result <= 0)
+    // Create Hash structure.
+    auto hashStruct = KeyCache::instance().digest(hashFunc);
+    if (!hashStruct)
     {
-        log<level::ERR>("Error occurred during EVP_DigestVerifyUpdate",
-                        entry("ERRCODE=%lu", ERR_get_error()));
+        log<level::ERR>("EVP_get_digestbynam: Unknown message digest",
+                        entry("HASH=%s", hashFunc.c_str()));
         elog<InternalFailure>();
     }
 
-    // Verify the data with signature.
-    size = fs::file_size(sigFile);
+    auto size = fs::file_size(sigFile);
     auto signature = mapFile(sigFile, size);
 
-    result = EVP_DigestVerifyFinal(
-        rsaVerifyCtx.get(), reinterpret_cast<unsigned char*>(signature()),
-        size);
+    auto result = image::verifyDigest(
+        pKeyPtr.get(), hashStruct, digest,
+        reinterpret_cast<const uint8_t*>(signature()), size);
 
     // Check the verification result.
     if (result < 0)
     {
-        log<level::ERR>("Error occurred during EVP_DigestVerifyFinal",
+        log<level::ERR>("Error occurred during EVP_PKEY_verify",
                         entry("ERRCODE=%lu", ERR_get_error()));
         elog<InternalFailure>();
     }
 
     if (result == 0)
     {
-        log<level::ERR>("EVP_DigestVerifyFinal:Signature validation failed",
+        log<level::ERR>("EVP_PKEY_verify:Signature validation failed",
                         entry("PATH=%s", sigFile.c_str()));
         return false;
     }
     return true;
 }
 
-inline RSA* Signature::createPublicRSA(const fs::path& publicKey)
-{
-    RSA* rsa = nullptr;
-    auto size = fs::file_size(publicKey);
-
-    // Read public key file
-    auto data = mapFile(publicKey, size);
-
-    BIO_MEM_Ptr keyBio(BIO_new_mem_buf(data(), -1), &::BIO_free);
-    if (keyBio.get() == nullptr)
-    {
-        log<level::ERR>("Failed to create new BIO Memory buffer");
-        elog<InternalFailure>();
-    }
-
-    rsa = PEM_read_bio_RSA_PUBKEY(keyBio.get(), &rsa, nullptr, nullptr);
-
-    return rsa;
-}
-
-CustomMap Signature::mapFile(const fs::path& path, size_t size)
+CustomMap Signature::mapFile(const fs::path& path, size_t size,
+                             uint64_t offset)
 {
 
     CustomFd fd(open(path.c_str(), O_RDONLY));
 
-    return CustomMap(mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd(), 0),
-                     size);
+    // The mapping has to start on a page boundary.
+    auto skip = offset % sysconf(_SC_PAGESIZE);
+
+    return CustomMap(mmap(nullptr, size + skip, PROT_READ, MAP_PRIVATE, fd(),
+                          offset - skip),
+                     size + skip, skip);
 }
 
 } // namespace image
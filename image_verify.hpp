@@ -1,4 +1,8 @@
 #pragma once
+#include "hash_tree.hpp"
+#include "hasher.hpp"
+#include "image_digest.hpp"
+#include "manifest.hpp"
 #include "openssl_alloc.hpp"
 
 #include <openssl/evp.h>
@@ -7,9 +11,12 @@
 #include <sys/mman.h>
 #include <unistd.h>
 
+#include <atomic>
 #include <filesystem>
 #include <set>
 #include <string>
+#include <utility>
+#include <vector>
 
 namespace phosphor
 {
@@ -42,8 +49,20 @@ struct CustomFd
     CustomFd() = delete;
     CustomFd(const CustomFd&) = delete;
     CustomFd& operator=(const CustomFd&) = delete;
-    CustomFd(CustomFd&&) = default;
-    CustomFd& operator=(CustomFd&&) = default;
+    CustomFd(CustomFd&& other) : fd(std::exchange(other.fd, -1))
+    {}
+    CustomFd& operator=(CustomFd&& other)
+    {
+        if (this != &other)
+        {
+            if (fd >= 0)
+            {
+                close(fd);
+            }
+            fd = std::exchange(other.fd, -1);
+        }
+        return *this;
+    }
     /** @brief Saves File descriptor and uses it to do file operation
      *
      *  @param[in] fd - File descriptor
@@ -82,6 +101,9 @@ struct CustomMap
     /** @brief length of the mapping   */
     size_t length;
 
+    /** @brief offset of the data from the start of the mapping */
+    size_t skip;
+
   public:
     CustomMap() = delete;
     CustomMap(const CustomMap&) = delete;
@@ -93,8 +115,10 @@ struct CustomMap
      *         and length of the file.
      *  @param[in]  addr - Starting address of the map
      *  @param[in]  length - length of the map
+     *  @param[in]  skip - offset of the data from the start of the map
      */
-    CustomMap(void* addr, size_t length) : addr(addr), length(length)
+    CustomMap(void* addr, size_t length, size_t skip = 0) :
+        addr(addr), length(length), skip(skip)
     {}
 
     ~CustomMap()
@@ -104,7 +128,7 @@ struct CustomMap
 
     void* operator()() const
     {
-        return addr;
+        return static_cast<char*>(addr) + skip;
     }
 };
 
@@ -128,8 +152,13 @@ class Signature
      * @param[in]  imageDirPath - image path
      * @param[in]  signedConfPath - Path of public key
      *                              hash function files
+     * @param[in]  digests - Image digests computed during extraction,
+     *                       images without one are hashed from disk
+     * @param[in]  backend - Where to hash the image files
      */
-    Signature(const fs::path& imageDirPath, const fs::path& signedConfPath);
+    Signature(const fs::path& imageDirPath, const fs::path& signedConfPath,
+              Digests digests = {},
+              HashBackend backend = Hasher::defaultBackend());
 
     /**
      * @brief Image signature verification function.
@@ -155,48 +184,92 @@ class Signature
     bool systemLevelVerify();
 
     /**
-     *  @brief Return all key types stored in the BMC based on the
-     *         public key and hashfunc files stored in the BMC.
+     * @brief Verify the file signature using public key and hash function
      *
-     *  @return list
+     * @param[in]  - Image file path
+     * @param[in]  - Signature file path
+     * @param[in]  - Public key
+     * @param[in]  - Hash function name
+     * @param[in]  - Optional flag to stop hashing early, returning false
+     * @return true if signature verification was successful, false if not
      */
-    AvailableKeyTypes getAvailableKeyTypesFromSystem() const;
+    bool verifyFile(const fs::path& file, const fs::path& signature,
+                    const fs::path& publicKey, const std::string& hashFunc,
+                    const std::atomic<bool>* cancel = nullptr);
 
     /**
-     *  @brief Return public key and hash function file names for the
-     *  corresponding key type
+     * @brief Verify the signature of files hashed one after the other, as if
+     *        they were concatenated. Files that are missing or empty are
+     *        skipped, like utils::mergeFiles does.
      *
-     *  @param[in]  key - key type
-     *  @return Pair of hash and public key file names
+     * @param[in]  - Image file paths, in order
+     * @param[in]  - Signature file path
+     * @param[in]  - Public key
+     * @param[in]  - Hash function name
+     * @param[in]  - Optional flag to stop hashing early, returning false
+     * @return true if signature verification was successful, false if not
      */
-    inline KeyHashPathPair getKeyHashFileNames(const Key_t& key) const;
+    bool verifyFiles(const std::vector<fs::path>& files,
+                     const fs::path& signature, const fs::path& publicKey,
+                     const std::string& hashFunc,
+                     const std::atomic<bool>* cancel = nullptr);
 
     /**
-     * @brief Verify the file signature using public key and hash function
+     * @brief Verify a precomputed digest against the signature file
      *
-     * @param[in]  - Image file path
+     * @param[in]  - Raw digest value
      * @param[in]  - Signature file path
      * @param[in]  - Public key
      * @param[in]  - Hash function name
      * @return true if signature verification was successful, false if not
      */
-    bool verifyFile(const fs::path& file, const fs::path& signature,
-                    const fs::path& publicKey, const std::string& hashFunc);
+    bool verifyDigest(const std::string& digest, const fs::path& signature,
+                      const fs::path& publicKey, const std::string& hashFunc);
+
+    /**
+     * @brief Verify an image file signature with the image specific public
+     *        key and hash function, using the digest computed during
+     *        extraction when there is a current one.
+     *
+     * @param[in]  - Image file path
+     * @param[in]  - Signature file path
+     * @param[in]  - Public key
+     * @param[in]  - Optional flag to stop hashing early, returning false
+     * @return true if signature verification was successful, false if not
+     */
+    bool verifyImage(const fs::path& file, const fs::path& signature,
+                     const fs::path& publicKey,
+                     const std::atomic<bool>* cancel = nullptr);
 
     /**
-     * @brief Create RSA object from the public key
-     * @param[in]  - publickey
-     * @param[out] - RSA Object.
+     * @brief Verify image files on a thread per core. The remaining images
+     *        are cancelled as soon as one of them fails verification.
+     *
+     * @param[in]  - Image file and signature file paths
+     * @param[in]  - Public key
+     * @return true if all signatures were verified, false if not
      */
-    inline RSA* createPublicRSA(const fs::path& publicKey);
+    bool verifyImages(const std::vector<std::pair<fs::path, fs::path>>& images,
+                      const fs::path& publicKey);
+
+    /**
+     * @brief Verify image files against their hash trees, the chunks of
+     *        each image on a thread per core.
+     *
+     * @param[in]  - Image file names and their trees
+     * @return true if all chunks matched, false if not
+     */
+    bool verifyTrees(
+        const std::vector<std::pair<std::string, HashTree>>& trees);
 
     /**
      * @brief Memory map the  file
      * @param[in]  - file path
      * @param[in]  - file size
+     * @param[in]  - offset of the data in the file
      * @param[out] - Custom Mmap address
      */
-    CustomMap mapFile(const fs::path& path, size_t size);
+    CustomMap mapFile(const fs::path& path, size_t size, uint64_t offset = 0);
 
     /**
      * @brief Verify the full file signature using public key and hash function
@@ -216,6 +289,15 @@ class Signature
 
     /** @brief Hash type defined in mainfest file */
     Hash_t hashType;
+
+    /** @brief Image digests computed during extraction */
+    Digests digests;
+
+    /** @brief The image manifest */
+    manager::Manifest manifest;
+
+    /** @brief Where image files are hashed */
+    HashBackend backend;
 };
 
 } // namespace image
@@ -4,6 +4,7 @@
 
 #include "images.hpp"
 #include "serialize.hpp"
+#include "tar_index.hpp"
 #include "version.hpp"
 
 #include <phosphor-logging/elog-errors.hpp>
@@ -12,8 +13,11 @@
 #include <xyz/openbmc_project/Common/error.hpp>
 #include <xyz/openbmc_project/Software/Image/error.hpp>
 
+#include <algorithm>
+#include <chrono>
 #include <filesystem>
 #include <fstream>
+#include <future>
 #include <queue>
 #include <set>
 #include <list>
@@ -35,9 +39,85 @@ using namespace phosphor::logging;
 using namespace sdbusplus::xyz::openbmc_project::Software::Image::Error;
 using namespace phosphor::software::image;
 namespace fs = std::filesystem;
+namespace tar = phosphor::software::manager::tar;
 using NotAllowed = sdbusplus::xyz::openbmc_project::Common::Error::NotAllowed;
 using VersionPurpose = server::Version::VersionPurpose;
 
+namespace // anonymous
+{
+
+using Clock = std::chrono::steady_clock;
+
+/** @brief Milliseconds elapsed since a point in time, for the logs */
+long long millisecondsSince(Clock::time_point start)
+{
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+               Clock::now() - start)
+        .count();
+}
+
+} // namespace
+
+ItemUpdater::ItemUpdater(sdbusplus::bus::bus& bus, const std::string& path) :
+    ItemUpdaterInherit(bus, path.c_str(), false), bus(bus), helper(bus),
+    versionMatch(bus,
+                 MatchRules::interfacesAdded() +
+                     MatchRules::path("/xyz/openbmc_project/software"),
+                 std::bind(std::mem_fn(&ItemUpdater::createActivation), this,
+                           std::placeholders::_1))
+{
+    auto start = Clock::now();
+
+    // The mapper and the u-boot environment are read while the versions
+    // are found on the filesystem. The activations are associated with
+    // their inventory items once the versions are all found.
+    inventoryQuery = std::async(std::launch::async, [start]() {
+        auto paths = queryInventoryPaths();
+        log<level::INFO>("Inventory query completed",
+                         entry("INVENTORY_MS=%lld", millisecondsSince(start)));
+        return paths;
+    });
+    auto fieldMode = std::async(std::launch::async, readFieldModeStatus);
+
+    {
+        // The associations of all the versions found, set at once, and the
+        // priorities and purposes stored while finding them.
+        AssociationBatch batch(*this);
+        StateBatch stateBatch;
+
+        auto phase = Clock::now();
+        processBMCImage();
+        auto bmcMs = millisecondsSince(phase);
+
+        phase = Clock::now();
+        processHostImage();
+        auto hostMs = millisecondsSince(phase);
+
+        phase = Clock::now();
+        processMcuImage();
+        auto mcuMs = millisecondsSince(phase);
+
+        phase = Clock::now();
+        restoreFieldModeStatus(fieldMode.get());
+#ifdef HOST_BIOS_UPGRADE
+        createBIOSObject();
+#endif
+        // Done with the query before the event loop starts.
+        addPendingInventoryAssociations();
+        auto waitMs = millisecondsSince(phase);
+
+        log<level::INFO>("ItemUpdater startup phases",
+                         entry("BMC_MS=%lld", bmcMs),
+                         entry("HOST_MS=%lld", hostMs),
+                         entry("MCU_MS=%lld", mcuMs),
+                         entry("WAIT_MS=%lld", waitMs));
+    }
+    emit_object_added();
+
+    log<level::INFO>("ItemUpdater ready",
+                     entry("STARTUP_MS=%lld", millisecondsSince(start)));
+}
+
 void ItemUpdater::createActivation(sdbusplus::message::message& msg)
 {
 
@@ -130,22 +210,10 @@ void ItemUpdater::createActivation(sdbusplus::message::message& msg)
         {
             activationState = server::Activation::Activations::Ready;
             // Create an association to the BMC inventory item
-            std::string _inventoryPath;
-            if (purpose == VersionPurpose::Host)
-            {
-                _inventoryPath = hostInventoryPath;
-            }
-            else if (purpose == VersionPurpose::MCU)
-            {
-                _inventoryPath = mcuInventoryPath;
-            }
-            else
-            {
-                _inventoryPath = bmcInventoryPath;
-            }
             associations.emplace_back(
                 std::make_tuple(ACTIVATION_FWD_ASSOCIATION,
-                                ACTIVATION_REV_ASSOCIATION, _inventoryPath));
+                                ACTIVATION_REV_ASSOCIATION,
+                                inventoryPath(purpose)));
         }
 
         std::unique_ptr<Activation> activationPtr;
@@ -216,9 +284,7 @@ void ItemUpdater::createHostVersion(const std::string& version)
     AssociationList associations = {};
 
     // Create an association to the system inventory item
-    associations.emplace_back(std::make_tuple(ACTIVATION_FWD_ASSOCIATION,
-                                              ACTIVATION_REV_ASSOCIATION,
-                                              hostInventoryPath));
+    associateInventory(associations, id, purpose);
 
     // Create an active association since this image is active
     createActiveAssociation(path);
@@ -285,9 +351,7 @@ void ItemUpdater::createMcuVersion(const std::string& version)
     AssociationList associations = {};
 
     // Create an association to the system inventory item
-    associations.emplace_back(std::make_tuple(ACTIVATION_FWD_ASSOCIATION,
-                                              ACTIVATION_REV_ASSOCIATION,
-                                              mcuInventoryPath));
+    associateInventory(associations, id, purpose);
 
     // Create an active association since this image is active
     createActiveAssociation(path);
@@ -412,9 +476,8 @@ void ItemUpdater::processBMCImage()
             if (activationState == server::Activation::Activations::Active)
             {
                 // Create an association to the BMC inventory item
-                associations.emplace_back(std::make_tuple(
-                    ACTIVATION_FWD_ASSOCIATION, ACTIVATION_REV_ASSOCIATION,
-                    bmcInventoryPath));
+                associateInventory(associations, id,
+                                   server::Version::VersionPurpose::BMC);
                 // Create an active association since this image is active
                 createActiveAssociation(path);
             }
@@ -496,6 +559,8 @@ void ItemUpdater::processBMCImage()
 
 void ItemUpdater::erase(std::string entryId)
 {
+    AssociationBatch batch(*this);
+
     // Find entry in versions map
     auto it = versions.find(entryId);
     if (it != versions.end())
@@ -556,6 +621,9 @@ void ItemUpdater::erase(std::string entryId)
 
 void ItemUpdater::deleteAll()
 {
+    AssociationBatch batch(*this);
+    StateBatch stateBatch;
+
     std::vector<std::string> deletableVersions;
 
     for (const auto& versionIt : versions)
@@ -644,56 +712,21 @@ void ItemUpdater::savePriority(const std::string& versionId, uint8_t value)
 
 void ItemUpdater::freePriority(uint8_t value, const std::string& versionId)
 {
-    std::map<std::string, uint8_t> priorityMap;
-
-    // Insert the requested version and priority, it may not exist yet.
-    priorityMap.insert(std::make_pair(versionId, value));
-
-    for (const auto& intf : activations)
+    // The version has the value in the index already, move the others in
+    // its way.
+    for (const auto& [priority, id] : priorities.collisions(versionId, value))
     {
-        if (intf.second->redundancyPriority)
+        auto it = activations.find(id);
+        if (it != activations.end() && it->second->redundancyPriority)
         {
-            priorityMap.insert(std::make_pair(
-                intf.first, intf.second->redundancyPriority.get()->priority()));
+            it->second->redundancyPriority->sdbusPriority(priority);
         }
     }
 
-    // Lambda function to compare 2 priority values, use <= to allow duplicates
-    typedef std::function<bool(std::pair<std::string, uint8_t>,
-                               std::pair<std::string, uint8_t>)>
-        cmpPriority;
-    cmpPriority cmpPriorityFunc =
-        [](std::pair<std::string, uint8_t> priority1,
-           std::pair<std::string, uint8_t> priority2) {
-            return priority1.second <= priority2.second;
-        };
-
-    // Sort versions by ascending priority
-    std::set<std::pair<std::string, uint8_t>, cmpPriority> prioritySet(
-        priorityMap.begin(), priorityMap.end(), cmpPriorityFunc);
-
-    auto freePriorityValue = value;
-    for (auto& element : prioritySet)
-    {
-        if (element.first == versionId)
-        {
-            continue;
-        }
-        if (element.second == freePriorityValue)
-        {
-            ++freePriorityValue;
-            auto it = activations.find(element.first);
-            it->second->redundancyPriority.get()->sdbusPriority(
-                freePriorityValue);
-        }
-    }
-
-    auto lowestVersion = prioritySet.begin()->first;
-    if (value == prioritySet.begin()->second)
-    {
-        lowestVersion = versionId;
-    }
-    updateUbootEnvVars(lowestVersion);
+    // The version taking the value wins a tie for the lowest one.
+    auto lowest = priorities.lowest();
+    updateUbootEnvVars(!lowest || lowest->first == value ? versionId
+                                                         : lowest->second);
 }
 
 void ItemUpdater::reset()
@@ -747,167 +780,212 @@ bool ItemUpdater::fieldModeEnabled(bool value)
     return control::FieldMode::fieldModeEnabled();
 }
 
-void ItemUpdater::restoreFieldModeStatus()
+bool ItemUpdater::readFieldModeStatus()
 {
     std::ifstream input("/dev/mtd/u-boot-env");
     std::string envVar;
     std::getline(input, envVar);
 
-    if (envVar.find("fieldmode=true") != std::string::npos)
+    return envVar.find("fieldmode=true") != std::string::npos;
+}
+
+void ItemUpdater::restoreFieldModeStatus(bool enabled)
+{
+    if (enabled)
     {
         ItemUpdater::fieldModeEnabled(true);
     }
 }
 
-void ItemUpdater::setHostInventoryPath()
+ItemUpdater::InventoryPaths ItemUpdater::queryInventoryPaths()
 {
-    auto depth = 0;
-    auto mapperCall = bus.new_method_call(MAPPER_BUSNAME, MAPPER_PATH,
-                                          MAPPER_INTERFACE, "GetSubTreePaths");
-
-    mapperCall.append(INVENTORY_PATH);
-    mapperCall.append(depth);
-    std::vector<std::string> filter = {"xyz.openbmc_project.Inventory.Item.System"};
-    mapperCall.append(filter);
+    InventoryPaths paths;
+    const std::string hostInterface =
+        "xyz.openbmc_project.Inventory.Item.System";
+    const std::string mcuInterface = "xyz.openbmc_project.Inventory.Item.Mcu";
 
     try
     {
+        auto bus = sdbusplus::bus::new_default();
+        auto depth = 0;
+        auto mapperCall = bus.new_method_call(
+            MAPPER_BUSNAME, MAPPER_PATH, MAPPER_INTERFACE, "GetSubTree");
+
+        mapperCall.append(INVENTORY_PATH);
+        mapperCall.append(depth);
+        std::vector<std::string> filter = {BMC_INVENTORY_INTERFACE,
+                                           hostInterface, mcuInterface};
+        mapperCall.append(filter);
+
         auto response = bus.call(mapperCall);
 
-        using ObjectPaths = std::vector<std::string>;
-        ObjectPaths result;
+        using ObjectTree = std::map<
+            std::string, std::map<std::string, std::vector<std::string>>>;
+        ObjectTree result;
         response.read(result);
 
-        if (!result.empty())
+        // The first path with each interface, as GetSubTreePaths did.
+        for (const auto& [path, services] : result)
         {
-            hostInventoryPath = result.front();
+            for (const auto& [service, interfaces] : services)
+            {
+                for (const auto& interface : interfaces)
+                {
+                    if (interface == BMC_INVENTORY_INTERFACE &&
+                        paths.bmc.empty())
+                    {
+                        paths.bmc = path;
+                    }
+                    else if (interface == hostInterface && paths.host.empty())
+                    {
+                        paths.host = path;
+                    }
+                    else if (interface == mcuInterface && paths.mcu.empty())
+                    {
+                        paths.mcu = path;
+                    }
+                }
+            }
         }
     }
-    catch (const sdbusplus::exception::SdBusError& e)
+    catch (const std::exception& e)
     {
-        log<level::ERR>("Error in mapper host GetSubTreePath");
-        return;
+        log<level::ERR>("Error in mapper inventory GetSubTree",
+                        entry("ERROR=%s", e.what()));
     }
 
-    return;
+    return paths;
 }
 
-void ItemUpdater::setBMCInventoryPath()
+const ItemUpdater::InventoryPaths& ItemUpdater::inventory()
 {
-    auto depth = 0;
-    auto mapperCall = bus.new_method_call(MAPPER_BUSNAME, MAPPER_PATH,
-                                          MAPPER_INTERFACE, "GetSubTreePaths");
-
-    mapperCall.append(INVENTORY_PATH);
-    mapperCall.append(depth);
-    std::vector<std::string> filter = {BMC_INVENTORY_INTERFACE};
-    mapperCall.append(filter);
-
-    try
+    if (inventoryQuery.valid())
     {
-        auto response = bus.call(mapperCall);
-
-        using ObjectPaths = std::vector<std::string>;
-        ObjectPaths result;
-        response.read(result);
+        inventoryPaths = inventoryQuery.get();
+    }
+    return inventoryPaths;
+}
 
-        if (!result.empty())
-        {
-            bmcInventoryPath = result.front();
-        }
+const std::string& ItemUpdater::inventoryPath(VersionPurpose purpose)
+{
+    if (purpose == VersionPurpose::Host)
+    {
+        return inventory().host;
     }
-    catch (const sdbusplus::exception::SdBusError& e)
+    if (purpose == VersionPurpose::MCU)
     {
-        log<level::ERR>("Error in mapper GetSubTreePath");
+        return inventory().mcu;
+    }
+    return inventory().bmc;
+}
+
+void ItemUpdater::associateInventory(AssociationList& associations,
+                                     const std::string& versionId,
+                                     VersionPurpose purpose)
+{
+    if (inventoryQuery.valid())
+    {
+        pendingInventory.emplace_back(versionId, purpose);
         return;
     }
+    associations.emplace_back(std::make_tuple(ACTIVATION_FWD_ASSOCIATION,
+                                              ACTIVATION_REV_ASSOCIATION,
+                                              inventoryPath(purpose)));
+}
 
-    return;
+void ItemUpdater::addPendingInventoryAssociations()
+{
+    inventory();
+    for (const auto& [versionId, purpose] : pendingInventory)
+    {
+        auto it = activations.find(versionId);
+        if (it == activations.end())
+        {
+            continue;
+        }
+        auto associations = it->second->associations();
+        associations.emplace_back(std::make_tuple(ACTIVATION_FWD_ASSOCIATION,
+                                                  ACTIVATION_REV_ASSOCIATION,
+                                                  inventoryPath(purpose)));
+        it->second->associations(associations);
+    }
+    pendingInventory.clear();
 }
 
-void ItemUpdater::setMcuInventoryPath()
+ItemUpdater::AssociationBatch::AssociationBatch(ItemUpdater& updater) :
+    updater(updater)
 {
-    auto depth = 0;
-    auto mapperCall = bus.new_method_call(MAPPER_BUSNAME, MAPPER_PATH,
-                                          MAPPER_INTERFACE, "GetSubTreePaths");
+    updater.associationBatches++;
+}
 
-    mapperCall.append(INVENTORY_PATH);
-    mapperCall.append(depth);
-    std::vector<std::string> filter = {"xyz.openbmc_project.Inventory.Item.Mcu"};
-    mapperCall.append(filter);
+ItemUpdater::AssociationBatch::~AssociationBatch()
+{
+    if (--updater.associationBatches > 0 || !updater.associationsChanged)
+    {
+        return;
+    }
 
+    updater.associationsChanged = false;
     try
     {
-        auto response = bus.call(mapperCall);
-
-        using ObjectPaths = std::vector<std::string>;
-        ObjectPaths result;
-        response.read(result);
-
-        if (!result.empty())
-        {
-            mcuInventoryPath = result.front();
-        }
+        updater.associations(updater.assocs);
     }
-    catch (const sdbusplus::exception::SdBusError& e)
+    catch (const std::exception& e)
     {
-        log<level::INFO>("Error in mapper Mcu GetSubTreePath");
-        return;
+        log<level::ERR>("Failed to update the associations",
+                        entry("ERROR=%s", e.what()));
     }
+}
 
-    return;
+void ItemUpdater::updateAssociations()
+{
+    if (associationBatches > 0)
+    {
+        associationsChanged = true;
+        return;
+    }
+    associations(assocs);
 }
 
 void ItemUpdater::createActiveAssociation(const std::string& path)
 {
     assocs.emplace_back(
         std::make_tuple(ACTIVE_FWD_ASSOCIATION, ACTIVE_REV_ASSOCIATION, path));
-    associations(assocs);
+    updateAssociations();
 }
 
 void ItemUpdater::createFunctionalAssociation(const std::string& path)
 {
     assocs.emplace_back(std::make_tuple(FUNCTIONAL_FWD_ASSOCIATION,
                                         FUNCTIONAL_REV_ASSOCIATION, path));
-    associations(assocs);
+    updateAssociations();
 }
 
 void ItemUpdater::createUpdateableAssociation(const std::string& path)
 {
     assocs.emplace_back(std::make_tuple(UPDATEABLE_FWD_ASSOCIATION,
                                         UPDATEABLE_REV_ASSOCIATION, path));
-    associations(assocs);
+    updateAssociations();
 }
 
 void ItemUpdater::removeAssociations(const std::string& path)
 {
-    for (auto iter = assocs.begin(); iter != assocs.end();)
+    auto size = assocs.size();
+    assocs.erase(std::remove_if(assocs.begin(), assocs.end(),
+                                [&path](const auto& assoc) {
+                                    return std::get<2>(assoc) == path;
+                                }),
+                 assocs.end());
+    if (assocs.size() != size)
     {
-        if ((std::get<2>(*iter)).compare(path) == 0)
-        {
-            iter = assocs.erase(iter);
-            associations(assocs);
-        }
-        else
-        {
-            ++iter;
-        }
+        updateAssociations();
     }
 }
 
 bool ItemUpdater::isLowestPriority(uint8_t value)
 {
-    for (const auto& intf : activations)
-    {
-        if (intf.second->redundancyPriority)
-        {
-            if (intf.second->redundancyPriority.get()->priority() < value)
-            {
-                return false;
-            }
-        }
-    }
-    return true;
+    auto lowest = priorities.lowest();
+    return !lowest || lowest->first >= value;
 }
 
 void ItemUpdater::updateUbootEnvVars(const std::string& versionId)
@@ -917,30 +995,17 @@ void ItemUpdater::updateUbootEnvVars(const std::string& versionId)
 
 void ItemUpdater::resetUbootEnvVars()
 {
-    decltype(activations.begin()->second->redundancyPriority.get()->priority())
-        lowestPriority = std::numeric_limits<uint8_t>::max();
-    decltype(activations.begin()->second->versionId) lowestPriorityVersion;
-    for (const auto& intf : activations)
-    {
-        if (!intf.second->redundancyPriority.get())
-        {
-            // Skip this version if the redundancyPriority is not initialized.
-            continue;
-        }
-
-        if (intf.second->redundancyPriority.get()->priority() <= lowestPriority)
-        {
-            lowestPriority = intf.second->redundancyPriority.get()->priority();
-            lowestPriorityVersion = intf.second->versionId;
-        }
-    }
+    auto lowest = priorities.lowest();
 
     // Update the U-boot environment variable to point to the lowest priority
-    updateUbootEnvVars(lowestPriorityVersion);
+    updateUbootEnvVars(lowest ? lowest->second : std::string());
 }
 
 void ItemUpdater::freeSpace(Activation& caller)
 {
+    AssociationBatch batch(*this);
+    StateBatch stateBatch;
+
     //  Versions with the highest priority in front
     std::priority_queue<std::pair<int, std::string>,
                         std::vector<std::pair<int, std::string>>,
@@ -1019,6 +1084,9 @@ void ItemUpdater::updateHostVer(std::string version)
         return;
     }
     log<level::INFO>(("Try to update host version: " + version).c_str());
+    AssociationBatch batch(*this);
+    // The host version may have been written to bios-release just before.
+    phosphor::software::manager::FunctionalVersions::instance().refresh();
     auto _verId = VersionClass::getId(version);
     std::list<std::string> nonActiveHostVids = {};
     std::string activeHostVid;
@@ -1101,10 +1169,8 @@ bool ItemUpdater::checkImage(const std::string& filePath,
 
     for (auto& bmcImage : imageList)
     {
-        fs::path file(filePath);
-        file /= bmcImage;
-        std::ifstream efile(file.c_str());
-        if (efile.good() != 1)
+        // The image may be extracted or left in the uploaded tarball.
+        if (!tar::locate(filePath, bmcImage))
         {
             valid = false;
             break;
@@ -4,6 +4,7 @@
 #include "activation_mcu.hpp"
 
 #include "item_updater_helper.hpp"
+#include "priority_index.hpp"
 #include "version.hpp"
 #include "xyz/openbmc_project/Collection/DeleteAll/server.hpp"
 #include "xyz/openbmc_project/Software/Version/server.hpp"
@@ -15,7 +16,9 @@
 #include <xyz/openbmc_project/Common/FactoryReset/server.hpp>
 #include <xyz/openbmc_project/Control/FieldMode/server.hpp>
 
+#include <future>
 #include <string>
+#include <utility>
 #include <vector>
 
 namespace phosphor
@@ -57,29 +60,40 @@ class ItemUpdater : public ItemUpdaterInherit
         active
     };
 
-    /** @brief Constructs ItemUpdater
+    /** @brief Constructs ItemUpdater, creating the objects of the versions
+     *  found. The inventory items they are associated with are looked up
+     *  meanwhile, and the time taken by each phase is logged.
      *
      * @param[in] bus    - The D-Bus bus object
      */
-    ItemUpdater(sdbusplus::bus::bus& bus, const std::string& path) :
-        ItemUpdaterInherit(bus, path.c_str(), false), bus(bus), helper(bus),
-        versionMatch(bus,
-                     MatchRules::interfacesAdded() +
-                         MatchRules::path("/xyz/openbmc_project/software"),
-                     std::bind(std::mem_fn(&ItemUpdater::createActivation),
-                               this, std::placeholders::_1))
+    ItemUpdater(sdbusplus::bus::bus& bus, const std::string& path);
+
+    /** @class AssociationBatch
+     *  @brief Defers the updates of the Associations property while it
+     *         exists, so an operation that changes several associations
+     *         sends them once. Batches may be nested, the property is set
+     *         when the outermost one ends.
+     */
+    class AssociationBatch
     {
-        setBMCInventoryPath();
-        processBMCImage();
-        setHostInventoryPath();
-        processHostImage();
-        setMcuInventoryPath();
-        processMcuImage();
-        restoreFieldModeStatus();
-#ifdef HOST_BIOS_UPGRADE
-        createBIOSObject();
-#endif
-        emit_object_added();
+      public:
+        AssociationBatch(const AssociationBatch&) = delete;
+        AssociationBatch& operator=(const AssociationBatch&) = delete;
+
+        /** @brief Starts a batch
+         *
+         * @param[in] updater - The ItemUpdater whose associations change
+         */
+        explicit AssociationBatch(ItemUpdater& updater);
+
+        /** @brief Ends the batch, setting the Associations property if it
+         *         is the outermost one and an association changed.
+         */
+        ~AssociationBatch();
+
+      private:
+        /** @brief The ItemUpdater whose associations change */
+        ItemUpdater& updater;
     };
 
     /** @brief Save priority value to persistent storage (flash and optionally
@@ -92,7 +106,8 @@ class ItemUpdater : public ItemUpdaterInherit
     void savePriority(const std::string& versionId, uint8_t value);
 
     /** @brief Sets the given priority free by incrementing
-     *  any existing priority with the same value by 1
+     *  any existing priority with the same value by 1, and the ones
+     *  with the values they are incremented to in turn
      *
      *  @param[in] value - The priority that needs to be set free.
      *  @param[in] versionId - The Id of the version for which we
@@ -202,6 +217,10 @@ class ItemUpdater : public ItemUpdaterInherit
      * version id */
     std::map<std::string, std::unique_ptr<VersionClass>> versions;
 
+    /** @brief The priorities of the versions, kept by their
+     *  RedundancyPriority objects. Destroyed after the activations. */
+    PriorityIndex priorities;
+
     /** @brief Vector of needed BMC images in the tarball*/
     std::vector<std::string> imageUpdateList;
 
@@ -262,29 +281,85 @@ class ItemUpdater : public ItemUpdaterInherit
      */
     bool fieldModeEnabled(bool value) override;
 
-    /** @brief Sets the BMC inventory item path under
-     *  /xyz/openbmc_project/inventory/system/chassis/. */
-    void setBMCInventoryPath();
+    /** @struct InventoryPaths
+     *  @brief The paths of the inventory items the versions are associated
+     *  with, empty if there is none.
+     */
+    struct InventoryPaths
+    {
+        /** @brief The path to the BMC inventory item. */
+        std::string bmc;
+
+        /** @brief The path to the System inventory item. */
+        std::string host;
+
+        /** @brief The path to the MCU inventory item. */
+        std::string mcu;
+    };
+
+    /** @brief Finds the BMC, System and Mcu inventory items under
+     *  INVENTORY_PATH with a single mapper query, on a connection of its
+     *  own so it can run on any thread.
+     *
+     *  @return The inventory paths
+     */
+    static InventoryPaths queryInventoryPaths();
+
+    /** @brief The inventory paths, waiting for the query started by the
+     *  constructor the first time.
+     */
+    const InventoryPaths& inventory();
+
+    /** @brief The inventory item of the versions of a purpose.
+     *
+     *  @param[in] purpose - The version purpose
+     *
+     *  @return The inventory path, waiting for the query like inventory()
+     */
+    const std::string&
+        inventoryPath(server::Version::VersionPurpose purpose);
+
+    /** @brief Associates the activation of a version with its inventory
+     *  item. While the startup query runs the association is left out and
+     *  added by addPendingInventoryAssociations(), so the scan does not
+     *  wait for the mapper.
+     *
+     *  @param[in] associations - The associations of the activation
+     *  @param[in] versionId    - The version id
+     *  @param[in] purpose      - The version purpose
+     */
+    void associateInventory(AssociationList& associations,
+                            const std::string& versionId,
+                            server::Version::VersionPurpose purpose);
 
-    /** @brief Sets the System inventory item path under
-     *  /xyz/openbmc_project/inventory/system/chassis/. */
-    void setHostInventoryPath();
+    /** @brief Adds the inventory associations left out during the startup
+     *  scan to the activations, once the query completed.
+     */
+    void addPendingInventoryAssociations();
 
-    /** @brief Sets the Mcu inventory item path under
-     *  /xyz/openbmc_project/inventory/system/chassis/. */
-    void setMcuInventoryPath();
+    /** @brief Versions and purposes waiting for their inventory association
+     */
+    std::vector<std::pair<std::string, server::Version::VersionPurpose>>
+        pendingInventory;
 
-    /** @brief The path to the BMC inventory item. */
-    std::string bmcInventoryPath;
+    /** @brief The inventory query running during startup */
+    std::future<InventoryPaths> inventoryQuery;
 
-    /** @brief The path to the System inventory item. */
-    std::string hostInventoryPath;
+    /** @brief The inventory paths once the query completed */
+    InventoryPaths inventoryPaths;
 
-    /** @brief The path to the MCU inventory item. */
-    std::string mcuInventoryPath;
+    /** @brief Reads the field mode status from the u-boot environment, on
+     *  any thread.
+     *
+     *  @return true if field mode is enabled
+     */
+    static bool readFieldModeStatus();
 
-    /** @brief Restores field mode status on reboot. */
-    void restoreFieldModeStatus();
+    /** @brief Restores field mode status on reboot.
+     *
+     *  @param[in] enabled - The status read by readFieldModeStatus()
+     */
+    void restoreFieldModeStatus(bool enabled);
 
     /** @brief Persistent sdbusplus D-Bus bus connection. */
     sdbusplus::bus::bus& bus;
@@ -302,6 +377,18 @@ class ItemUpdater : public ItemUpdaterInherit
     /** @brief This entry's associations */
     AssociationList assocs = {};
 
+    /** @brief Number of AssociationBatch objects in existence */
+    unsigned associationBatches = 0;
+
+    /** @brief Whether assocs changed since the Associations property was
+     *  last set */
+    bool associationsChanged = false;
+
+    /** @brief Set the Associations property to assocs, or defer it to the
+     *  end of the current AssociationBatch.
+     */
+    void updateAssociations();
+
     /** @brief Clears read only partition for
      * given Activation D-Bus object.
      *
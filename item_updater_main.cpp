@@ -2,6 +2,10 @@
 
 #include "item_updater.hpp"
 
+#ifdef WANT_SIGNATURE_VERIFY
+#include "key_cache.hpp"
+#endif
+
 #include <sdbusplus/bus.hpp>
 #include <sdbusplus/server/manager.hpp>
 
@@ -14,6 +18,12 @@ int main()
 
     phosphor::software::updater::ItemUpdater updater(bus, SOFTWARE_OBJPATH);
 
+#ifdef WANT_SIGNATURE_VERIFY
+    // Index the system keys now rather than on the first verification.
+    phosphor::software::image::KeyCache::instance().keyring(
+        SIGNED_IMAGE_CONF_PATH);
+#endif
+
     bus.request_name(BUSNAME_UPDATER);
 
     while (true)
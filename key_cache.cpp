@@ -0,0 +1,264 @@
+#include "config.h"
+
+#include "key_cache.hpp"
+
+#include "manifest.hpp"
+#include "openssl_alloc.hpp"
+
+#include <fcntl.h>
+#include <openssl/pem.h>
+#include <openssl/rsa.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <array>
+#include <cerrno>
+#include <string>
+#include <system_error>
+
+namespace phosphor
+{
+namespace software
+{
+namespace image
+{
+
+namespace // anonymous
+{
+
+// Key files are looked up by the path of each image dir, drop them all
+// rather than growing without bounds.
+constexpr size_t maxKeys = 32;
+
+// Changes to the dirs of a keyring that make it scanned again.
+constexpr uint32_t watchMask = IN_CREATE | IN_DELETE | IN_MODIFY |
+                               IN_CLOSE_WRITE | IN_MOVED_FROM | IN_MOVED_TO |
+                               IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF;
+
+constexpr auto hashFunctionTag = "HashType";
+
+using BIO_MEM_Ptr = std::unique_ptr<BIO, decltype(&::BIO_free)>;
+
+/** @brief Parse an RSA public key in PEM format */
+std::shared_ptr<EVP_PKEY> parseKey(const std::string& pem)
+{
+    BIO_MEM_Ptr keyBio(BIO_new_mem_buf(pem.data(), pem.size()), &::BIO_free);
+    if (!keyBio)
+    {
+        return nullptr;
+    }
+
+    auto rsa = PEM_read_bio_RSA_PUBKEY(keyBio.get(), nullptr, nullptr, nullptr);
+    if (!rsa)
+    {
+        return nullptr;
+    }
+
+    std::shared_ptr<EVP_PKEY> key(EVP_PKEY_new(), ::EVP_PKEY_free);
+    if (!key || EVP_PKEY_assign_RSA(key.get(), rsa) <= 0)
+    {
+        RSA_free(rsa);
+        return nullptr;
+    }
+    return key;
+}
+
+/** @brief Whether inotify reported anything since the last call */
+bool changed(int fd)
+{
+    std::array<char, 4096> buf;
+    auto result = false;
+    while (true)
+    {
+        auto len = read(fd, buf.data(), buf.size());
+        if (len > 0)
+        {
+            result = true;
+            continue;
+        }
+        if (len < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        // Nothing left to read, or an error that calls for a new scan.
+        return result || !(len < 0 && errno == EAGAIN);
+    }
+}
+
+/** @brief Find the key types of a signed configuration dir, watching each
+ *         of its dirs with fd if it is valid. For example:
+ *         /etc/activationdata/OpenBMC/publickey
+ *         /etc/activationdata/OpenBMC/hashfunc
+ *         /etc/activationdata/GA/publickey
+ *         /etc/activationdata/GA/hashfunc
+ *         give the OpenBMC and GA key types.
+ */
+std::shared_ptr<const Keyring> scan(const fs::path& confDir, int fd)
+{
+    auto keyring = std::make_shared<Keyring>();
+    std::error_code ec;
+    for (auto it = fs::recursive_directory_iterator(confDir, ec);
+         !ec && it != fs::recursive_directory_iterator(); it.increment(ec))
+    {
+        if (it->is_directory(ec))
+        {
+            if (fd >= 0)
+            {
+                inotify_add_watch(fd, it->path().c_str(), watchMask);
+            }
+            continue;
+        }
+
+        auto name = it->path().filename();
+        if (name != HASH_FILE_NAME && name != PUBLICKEY_FILE_NAME)
+        {
+            continue;
+        }
+
+        // /etc/activationdata/OpenBMC/  -> get OpenBMC from the path
+        auto keyType = it->path().parent_path().filename().string();
+        if (keyring->count(keyType))
+        {
+            continue;
+        }
+
+        auto hashFile = manager::Manifest::load(confDir / keyType /
+                                                HASH_FILE_NAME);
+        keyring->emplace(keyType,
+                         SystemKey{confDir / keyType / PUBLICKEY_FILE_NAME,
+                                   std::string(hashFile.get(hashFunctionTag))});
+    }
+    return keyring;
+}
+
+} // namespace
+
+KeyCache& KeyCache::instance()
+{
+    static KeyCache cache;
+    return cache;
+}
+
+std::shared_ptr<EVP_PKEY> KeyCache::publicKey(const fs::path& path)
+{
+    auto fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+    {
+        return nullptr;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0)
+    {
+        close(fd);
+        return nullptr;
+    }
+
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto it = keys.find(path);
+        if (it != keys.end() && it->second.dev == st.st_dev &&
+            it->second.ino == st.st_ino && it->second.size == st.st_size &&
+            it->second.mtime.tv_sec == st.st_mtim.tv_sec &&
+            it->second.mtime.tv_nsec == st.st_mtim.tv_nsec)
+        {
+            close(fd);
+            return it->second.key;
+        }
+    }
+
+    // Parse the file that was checked above, not whatever is at the path
+    // by now.
+    std::string pem(st.st_size, '\0');
+    size_t pos = 0;
+    while (pos < pem.size())
+    {
+        auto len = read(fd, pem.data() + pos, pem.size() - pos);
+        if (len <= 0)
+        {
+            break;
+        }
+        pos += len;
+    }
+    close(fd);
+    pem.resize(pos);
+
+    auto key = parseKey(pem);
+    if (!key)
+    {
+        return nullptr;
+    }
+
+    std::lock_guard<std::mutex> lock(mutex);
+    if (keys.size() >= maxKeys)
+    {
+        keys.clear();
+    }
+    keys[path] = {st.st_dev, st.st_ino, st.st_size, st.st_mtim, key};
+    return key;
+}
+
+KeyCache::~KeyCache()
+{
+    for (auto& [confDir, ring] : rings)
+    {
+        if (ring.fd >= 0)
+        {
+            close(ring.fd);
+        }
+    }
+}
+
+std::shared_ptr<const Keyring> KeyCache::keyring(const fs::path& confDir)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    auto& ring = rings[confDir];
+    if (ring.keys && ring.fd >= 0 && !changed(ring.fd))
+    {
+        return ring.keys;
+    }
+
+    // Watch before scanning, so changes made during the scan are not
+    // missed. Without a watch the dir is scanned on every lookup.
+    if (ring.fd >= 0)
+    {
+        close(ring.fd);
+    }
+    ring.fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (ring.fd >= 0 &&
+        inotify_add_watch(ring.fd, confDir.c_str(), watchMask) < 0)
+    {
+        close(ring.fd);
+        ring.fd = -1;
+    }
+
+    ring.keys = scan(confDir, ring.fd);
+    return ring.keys;
+}
+
+const EVP_MD* KeyCache::digest(const std::string& name)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    auto it = digests.find(name);
+    if (it != digests.end())
+    {
+        return it->second;
+    }
+
+    // Adds all digest algorithms to the internal table
+    static std::once_flag added;
+    std::call_once(added, [] { OpenSSL_add_all_digests(); });
+
+    // Unknown names come from manifests, do not keep them.
+    auto md = EVP_get_digestbyname(name.c_str());
+    if (md)
+    {
+        digests.emplace(name, md);
+    }
+    return md;
+}
+
+} // namespace image
+} // namespace software
+} // namespace phosphor
@@ -0,0 +1,122 @@
+#pragma once
+
+#include <openssl/evp.h>
+#include <sys/types.h>
+#include <time.h>
+
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+
+namespace phosphor
+{
+namespace software
+{
+namespace image
+{
+
+namespace fs = std::filesystem;
+
+/** @struct SystemKey
+ *  @brief A key type provisioned in a signed configuration dir.
+ */
+struct SystemKey
+{
+    /** @brief The public key file */
+    fs::path publicKey;
+
+    /** @brief The hash function given by the hash file */
+    std::string hashFunc;
+};
+
+/** @brief Provisioned key types by name */
+using Keyring = std::map<std::string, SystemKey>;
+
+/** @class KeyCache
+ *  @brief Public keys, message digests and keyrings, looked up once per
+ *         process.
+ *  @details A key file is parsed again only once it is replaced or
+ *           rewritten, as told by its device, inode, size and modification
+ *           time. A signed configuration dir is scanned again only once
+ *           inotify reports a change in it. Safe to use from any thread.
+ */
+class KeyCache
+{
+  public:
+    KeyCache(const KeyCache&) = delete;
+    KeyCache& operator=(const KeyCache&) = delete;
+    KeyCache(KeyCache&&) = delete;
+    KeyCache& operator=(KeyCache&&) = delete;
+
+    /** @brief The cache shared by all signature verifications */
+    static KeyCache& instance();
+
+    /** @brief Get the RSA public key of a PEM file.
+     *
+     *  @param[in] path - The public key file
+     *
+     *  @return The key, nullptr if the file cannot be read or parsed
+     */
+    std::shared_ptr<EVP_PKEY> publicKey(const fs::path& path);
+
+    /** @brief Get a message digest by name.
+     *
+     *  @param[in] name - The hash function name, e.g. SHA256
+     *
+     *  @return The digest, nullptr if the name is unknown
+     */
+    const EVP_MD* digest(const std::string& name);
+
+    /** @brief Get the key types provisioned in a signed configuration dir,
+     *         found from their public key and hash files.
+     *
+     *  @param[in] confDir - The signed configuration dir
+     *
+     *  @return The key types, empty if there are none
+     */
+    std::shared_ptr<const Keyring> keyring(const fs::path& confDir);
+
+  private:
+    KeyCache() = default;
+
+    ~KeyCache();
+
+    /** @struct Key
+     *  @brief A parsed key and the identity of the file it came from.
+     */
+    struct Key
+    {
+        dev_t dev;
+        ino_t ino;
+        off_t size;
+        timespec mtime;
+        std::shared_ptr<EVP_PKEY> key;
+    };
+
+    /** @struct Ring
+     *  @brief The keyring of a dir and the inotify instance watching it.
+     */
+    struct Ring
+    {
+        std::shared_ptr<const Keyring> keys;
+        int fd = -1;
+    };
+
+    /** @brief Protects keys, digests and rings */
+    std::mutex mutex;
+
+    /** @brief Parsed keys by file path */
+    std::map<fs::path, Key> keys;
+
+    /** @brief Known digests by name */
+    std::map<std::string, const EVP_MD*> digests;
+
+    /** @brief Keyrings by signed configuration dir */
+    std::map<fs::path, Ring> rings;
+};
+
+} // namespace image
+} // namespace software
+} // namespace phosphor
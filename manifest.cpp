@@ -0,0 +1,79 @@
+#include "manifest.hpp"
+
+#include <fstream>
+#include <iterator>
+#include <limits>
+
+namespace phosphor
+{
+namespace software
+{
+namespace manager
+{
+
+Manifest::Manifest(std::string contents) : data(std::move(contents))
+{
+    // Offsets are stored in 32 bits, manifests are a few lines long.
+    if (data.size() > std::numeric_limits<uint32_t>::max())
+    {
+        data.clear();
+    }
+
+    std::string_view view(data);
+    size_t pos = 0;
+    while (pos < view.size())
+    {
+        auto end = view.find('\n', pos);
+        if (end == std::string_view::npos)
+        {
+            end = view.size();
+        }
+
+        auto line = view.substr(pos, end - pos);
+        if (!line.empty() && line.back() == '\r')
+        {
+            // If the manifest has CRLF line terminators, e.g. is created on
+            // Windows, the line will contain \r at the end, remove it.
+            line.remove_suffix(1);
+        }
+
+        auto sep = line.find('=');
+        if (sep != std::string_view::npos)
+        {
+            fields.push_back({static_cast<uint32_t>(pos),
+                              static_cast<uint32_t>(sep),
+                              static_cast<uint32_t>(pos + sep + 1),
+                              static_cast<uint32_t>(line.size() - sep - 1)});
+        }
+
+        pos = end + 1;
+    }
+}
+
+Manifest Manifest::load(const fs::path& path)
+{
+    std::ifstream is(path, std::ios::binary);
+    if (!is)
+    {
+        return Manifest();
+    }
+    return Manifest(std::string(std::istreambuf_iterator<char>(is),
+                                std::istreambuf_iterator<char>()));
+}
+
+std::string_view Manifest::get(std::string_view key) const
+{
+    std::string_view view(data);
+    for (const auto& field : fields)
+    {
+        if (view.substr(field.keyPos, field.keyLen) == key)
+        {
+            return view.substr(field.valuePos, field.valueLen);
+        }
+    }
+    return {};
+}
+
+} // namespace manager
+} // namespace software
+} // namespace phosphor
@@ -0,0 +1,86 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <string>
+#include <string_view>
+#include <vector>
+
+namespace phosphor
+{
+namespace software
+{
+namespace manager
+{
+
+namespace fs = std::filesystem;
+
+/** @class Manifest
+ *  @brief Key/value pairs of an image MANIFEST, or of any other file made
+ *         of key=value lines such as the os-release file.
+ *  @details The contents are parsed once on construction, lookups return
+ *           views into the contents held by the object.
+ */
+class Manifest
+{
+  public:
+    /** @brief Constructs an empty Manifest */
+    Manifest() = default;
+
+    /** @brief Constructs Manifest
+     *
+     *  @param[in] contents - The manifest file contents
+     */
+    explicit Manifest(std::string contents);
+
+    /** @brief Read and parse a manifest file.
+     *
+     *  @param[in] path - The manifest file path
+     *
+     *  @return The manifest, empty if the file cannot be read
+     */
+    static Manifest load(const fs::path& path);
+
+    /** @brief Get the value of the first line starting with key=
+     *
+     *  @param[in] key - The key, without the '='
+     *
+     *  @return The value, empty if the key is not present
+     */
+    std::string_view get(std::string_view key) const;
+
+    /** @brief The manifest file contents */
+    const std::string& contents() const
+    {
+        return data;
+    }
+
+    /** @brief Whether the manifest has no key/value pairs */
+    bool empty() const
+    {
+        return fields.empty();
+    }
+
+  private:
+    /** @struct Field
+     *  @brief Location of a key and its value in the contents. Offsets
+     *         rather than views, so copies of the object stay valid.
+     */
+    struct Field
+    {
+        uint32_t keyPos;
+        uint32_t keyLen;
+        uint32_t valuePos;
+        uint32_t valueLen;
+    };
+
+    /** @brief The manifest file contents */
+    std::string data;
+
+    /** @brief The key/value pairs in file order */
+    std::vector<Field> fields;
+};
+
+} // namespace manager
+} // namespace software
+} // namespace phosphor
@@ -0,0 +1,118 @@
+#include "os_release.hpp"
+
+#include <sys/inotify.h>
+#include <unistd.h>
+
+#include <phosphor-logging/log.hpp>
+
+#include <cerrno>
+#include <cstddef>
+#include <cstring>
+#include <stdexcept>
+
+namespace phosphor
+{
+namespace software
+{
+namespace manager
+{
+
+using namespace phosphor::logging;
+using namespace std::string_literals;
+
+OsRelease::OsRelease(sd_event* loop, const fs::path& path) : path(path)
+{
+    fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (-1 == fd)
+    {
+        auto error = errno;
+        throw std::runtime_error("inotify_init1 failed, errno="s +
+                                 std::strerror(error));
+    }
+
+    // Watch the directory, the file may be replaced rather than rewritten.
+    wd = inotify_add_watch(fd, path.parent_path().c_str(),
+                           IN_CLOSE_WRITE | IN_MOVED_TO | IN_MOVED_FROM |
+                               IN_CREATE | IN_DELETE);
+    if (-1 == wd)
+    {
+        auto error = errno;
+        close(fd);
+        throw std::runtime_error("inotify_add_watch failed, errno="s +
+                                 std::strerror(error));
+    }
+
+    auto rc = sd_event_add_io(loop, &source, fd, EPOLLIN, callback, this);
+    if (0 > rc)
+    {
+        close(fd);
+        throw std::runtime_error("failed to add to event loop, rc="s +
+                                 std::strerror(-rc));
+    }
+}
+
+OsRelease::~OsRelease()
+{
+    sd_event_source_unref(source);
+    inotify_rm_watch(fd, wd);
+    close(fd);
+}
+
+std::string OsRelease::getValue(std::string_view key)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (!snapshot)
+    {
+        snapshot = Manifest::load(path);
+    }
+
+    auto value = snapshot->get(key);
+
+    // Support quoted and unquoted values
+    if (value.size() >= 2 && value.front() == '"' && value.back() == '"')
+    {
+        value = value.substr(1, value.size() - 2);
+    }
+    return std::string(value);
+}
+
+int OsRelease::callback(sd_event_source* /* s */, int fd, uint32_t revents,
+                        void* userdata)
+{
+    if (!(revents & EPOLLIN))
+    {
+        return 0;
+    }
+
+    alignas(inotify_event) uint8_t buffer[4096];
+    auto bytes = read(fd, buffer, sizeof(buffer));
+    if (0 > bytes)
+    {
+        auto error = errno;
+        throw std::runtime_error("failed to read inotify event, errno="s +
+                                 std::strerror(error));
+    }
+
+    auto osRelease = static_cast<OsRelease*>(userdata);
+    auto name = osRelease->path.filename();
+    decltype(bytes) offset = 0;
+    while (offset < bytes)
+    {
+        auto event = reinterpret_cast<inotify_event*>(&buffer[offset]);
+        if (event->len && name == event->name)
+        {
+            log<level::INFO>("os-release changed, dropping cached copy",
+                             entry("FILENAME=%s", osRelease->path.c_str()));
+            std::lock_guard<std::mutex> lock(osRelease->mutex);
+            osRelease->snapshot.reset();
+        }
+
+        offset += offsetof(inotify_event, name) + event->len;
+    }
+
+    return 0;
+}
+
+} // namespace manager
+} // namespace software
+} // namespace phosphor
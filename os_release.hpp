@@ -0,0 +1,87 @@
+#pragma once
+
+#include "manifest.hpp"
+
+#include <systemd/sd-event.h>
+
+#include <filesystem>
+#include <mutex>
+#include <optional>
+#include <string>
+#include <string_view>
+
+namespace phosphor
+{
+namespace software
+{
+namespace manager
+{
+
+namespace fs = std::filesystem;
+
+/** @class OsRelease
+ *  @brief Cached snapshot of the os-release file.
+ *  @details The file is parsed on first use. The snapshot is dropped when
+ *           inotify reports a change to the file, so the next lookup reads
+ *           it again. Lookups are safe to use from any thread.
+ */
+class OsRelease
+{
+  public:
+    OsRelease() = delete;
+    OsRelease(const OsRelease&) = delete;
+    OsRelease& operator=(const OsRelease&) = delete;
+    OsRelease(OsRelease&&) = delete;
+    OsRelease& operator=(OsRelease&&) = delete;
+
+    /** @brief Constructs OsRelease
+     *
+     *  @param[in] loop - sd-event object receiving the inotify events
+     *  @param[in] path - The os-release file path
+     */
+    OsRelease(sd_event* loop, const fs::path& path);
+
+    ~OsRelease();
+
+    /** @brief Get the value of a key, with surrounding quotes removed.
+     *
+     *  @param[in] key - The key, e.g. OPENBMC_TARGET_MACHINE
+     *
+     *  @return The value, empty if the key is not present
+     */
+    std::string getValue(std::string_view key);
+
+  private:
+    /** @brief sd-event callback
+     *
+     *  @param[in] s - event source
+     *  @param[in] fd - inotify fd
+     *  @param[in] revents - events that matched for fd
+     *  @param[in] userdata - pointer to OsRelease object
+     *  @returns 0 on success
+     */
+    static int callback(sd_event_source* s, int fd, uint32_t revents,
+                        void* userdata);
+
+    /** @brief The os-release file path */
+    fs::path path;
+
+    /** @brief inotify file descriptor */
+    int fd = -1;
+
+    /** @brief watch descriptor of the directory holding the file */
+    int wd = -1;
+
+    /** @brief sd-event source of fd */
+    sd_event_source* source = nullptr;
+
+    /** @brief Protects snapshot */
+    std::mutex mutex;
+
+    /** @brief The parsed file, unset until read or after a change */
+    std::optional<Manifest> snapshot;
+};
+
+} // namespace manager
+} // namespace software
+} // namespace phosphor
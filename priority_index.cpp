@@ -0,0 +1,99 @@
+#include "priority_index.hpp"
+
+#include <iterator>
+#include <limits>
+
+namespace phosphor
+{
+namespace software
+{
+namespace updater
+{
+
+void PriorityIndex::add(const std::string& versionId, uint8_t value)
+{
+    auto [it, added] = versions.emplace(versionId, std::make_pair(value, 0));
+    it->second.second++;
+    if (added)
+    {
+        order.emplace(value, versionId);
+    }
+    else
+    {
+        set(versionId, value);
+    }
+}
+
+void PriorityIndex::remove(const std::string& versionId)
+{
+    auto it = versions.find(versionId);
+    if (it == versions.end() || --it->second.second > 0)
+    {
+        return;
+    }
+
+    order.erase(Entry(it->second.first, versionId));
+    versions.erase(it);
+}
+
+void PriorityIndex::set(const std::string& versionId, uint8_t value)
+{
+    auto it = versions.find(versionId);
+    if (it == versions.end() || it->second.first == value)
+    {
+        return;
+    }
+
+    // Move the node to its new place rather than allocating a new one.
+    auto node = order.extract(Entry(it->second.first, versionId));
+    node.value().first = value;
+    order.insert(std::move(node));
+    it->second.first = value;
+}
+
+const PriorityIndex::Entry* PriorityIndex::lowest() const
+{
+    if (order.empty())
+    {
+        return nullptr;
+    }
+
+    // The last of the versions sharing the lowest value.
+    auto value = order.begin()->first;
+    if (value == std::numeric_limits<uint8_t>::max())
+    {
+        return &*order.rbegin();
+    }
+    return &*std::prev(order.lower_bound(Entry(value + 1, std::string())));
+}
+
+std::vector<PriorityIndex::Entry>
+    PriorityIndex::collisions(const std::string& versionId,
+                              uint8_t value) const
+{
+    std::vector<Entry> result;
+    auto next = value;
+    auto it = order.lower_bound(Entry(value, std::string()));
+    while (it != order.end() && it->first == next &&
+           next < std::numeric_limits<uint8_t>::max())
+    {
+        // Of the versions sharing the value the last one moves, the others
+        // stay, as freePriority used to order them.
+        auto end = order.lower_bound(Entry(next + 1, std::string()));
+        auto moved = end;
+        while (moved != it && (--moved)->second == versionId)
+        {}
+        if (moved->second == versionId)
+        {
+            // Only the version itself has the value.
+            break;
+        }
+        result.emplace_back(++next, moved->second);
+        it = end;
+    }
+    return result;
+}
+
+} // namespace updater
+} // namespace software
+} // namespace phosphor
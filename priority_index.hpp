@@ -0,0 +1,85 @@
+#pragma once
+
+#include <cstdint>
+#include <map>
+#include <set>
+#include <string>
+#include <utility>
+#include <vector>
+
+namespace phosphor
+{
+namespace software
+{
+namespace updater
+{
+
+/** @class PriorityIndex
+ *  @brief The RedundancyPriority values of all versions, kept in order as
+ *         they change.
+ *  @details A version is in the index while it has a RedundancyPriority
+ *           object. The object replacing another one of the same version is
+ *           created before the old one is destroyed, so the index counts
+ *           the objects of each version.
+ */
+class PriorityIndex
+{
+  public:
+    /** @brief A priority value and the version that has it */
+    using Entry = std::pair<uint8_t, std::string>;
+
+    /** @brief Add a RedundancyPriority object of a version.
+     *
+     *  @param[in] versionId - The version id
+     *  @param[in] value     - The priority value
+     */
+    void add(const std::string& versionId, uint8_t value);
+
+    /** @brief Remove a RedundancyPriority object of a version, the version
+     *         is removed with its last object.
+     *
+     *  @param[in] versionId - The version id
+     */
+    void remove(const std::string& versionId);
+
+    /** @brief Change the priority of a version. Nothing is allocated.
+     *
+     *  @param[in] versionId - The version id, ignored if not in the index
+     *  @param[in] value     - The priority value
+     */
+    void set(const std::string& versionId, uint8_t value);
+
+    /** @brief The version with the lowest priority value, the one with the
+     *         highest id among equal values, as the versions used to be
+     *         scanned in id order keeping the last lowest one.
+     *
+     *  @return The entry, nullptr if the index is empty
+     */
+    const Entry* lowest() const;
+
+    /** @brief The versions that have to move for a version to take a
+     *         priority value: the one with that value moves up by one,
+     *         then the one with the value it moves to, until there is a
+     *         free value. Of the versions sharing a value the one with the
+     *         highest id moves. Values do not move past the highest
+     *         priority value.
+     *
+     *  @param[in] versionId - The version taking the value
+     *  @param[in] value     - The priority value
+     *
+     *  @return The versions to move and their new values, in order
+     */
+    std::vector<Entry> collisions(const std::string& versionId,
+                                  uint8_t value) const;
+
+  private:
+    /** @brief Versions in ascending priority order */
+    std::set<Entry> order;
+
+    /** @brief Priority value and number of objects of each version */
+    std::map<std::string, std::pair<uint8_t, size_t>> versions;
+};
+
+} // namespace updater
+} // namespace software
+} // namespace phosphor
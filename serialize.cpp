@@ -2,12 +2,22 @@
 
 #include "serialize.hpp"
 
+#include <fcntl.h>
+#include <unistd.h>
+
 #include <cereal/archives/json.hpp>
+#include <cereal/types/map.hpp>
+#include <cereal/types/string.hpp>
 #include <phosphor-logging/log.hpp>
 #include <sdbusplus/server.hpp>
 
+#include <cerrno>
+#include <cstring>
 #include <filesystem>
 #include <fstream>
+#include <sstream>
+#include <system_error>
+#include <vector>
 
 namespace phosphor
 {
@@ -19,101 +29,319 @@ namespace updater
 using namespace phosphor::logging;
 namespace fs = std::filesystem;
 
+namespace // anonymous
+{
+
 const std::string priorityName = "priority";
 const std::string purposeName = "purpose";
+const std::string verifiedName = "verified";
+const std::string stateName = "state";
 
-void storePriority(const std::string& versionId, uint8_t priority)
+/** @brief Read a value from a per-version file of the previous layout */
+template <typename T>
+bool readLegacy(const fs::path& path, const std::string& name, T& value)
 {
-    auto path = fs::path(PERSIST_DIR) / versionId;
-    if (!fs::is_directory(path))
+    std::ifstream is(path.c_str(), std::ios::in);
+    if (!is)
     {
-        if (fs::exists(path))
+        return false;
+    }
+    try
+    {
+        cereal::JSONInputArchive iarchive(is);
+        iarchive(cereal::make_nvp(name, value));
+        return true;
+    }
+    catch (const cereal::Exception& e)
+    {
+        return false;
+    }
+}
+
+/** @brief Write data to a file, replacing it atomically once the data is
+ *         on storage.
+ *  @return 0 on success, the errno of the call that failed otherwise
+ */
+int writeAtomic(const fs::path& path, const std::string& data)
+{
+    auto tmp = path;
+    tmp += ".tmp";
+
+    auto fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0)
+    {
+        return errno;
+    }
+
+    int error = 0;
+    size_t written = 0;
+    while (written < data.size())
+    {
+        auto rc = write(fd, data.data() + written, data.size() - written);
+        if (rc < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (rc <= 0)
         {
-            // Delete if it's a non-directory file
-            log<level::WARNING>("Removing non-directory file",
-                                entry("PATH=%s", path.c_str()));
-            fs::remove_all(path);
+            error = rc < 0 ? errno : ENOSPC;
+            break;
         }
-        fs::create_directories(path);
+        written += rc;
     }
-    path = path / priorityName;
 
-    std::ofstream os(path.c_str());
-    cereal::JSONOutputArchive oarchive(os);
-    oarchive(cereal::make_nvp(priorityName, priority));
+    if (!error && fsync(fd) != 0)
+    {
+        error = errno;
+    }
+    close(fd);
+
+    if (!error && rename(tmp.c_str(), path.c_str()) != 0)
+    {
+        error = errno;
+    }
+    if (error)
+    {
+        unlink(tmp.c_str());
+        return error;
+    }
+
+    // Make the rename itself durable.
+    auto dirFd = open(path.parent_path().c_str(),
+                      O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (dirFd >= 0)
+    {
+        fsync(dirFd);
+        close(dirFd);
+    }
+    return 0;
 }
 
-void storePurpose(const std::string& versionId, VersionPurpose purpose)
+} // namespace
+
+template <class Archive>
+void StateStore::State::serialize(Archive& archive)
 {
-    auto path = fs::path(PERSIST_DIR) / versionId;
-    if (!fs::is_directory(path))
+    archive(cereal::make_nvp("hasPriority", hasPriority),
+            cereal::make_nvp(priorityName, priority),
+            cereal::make_nvp("hasPurpose", hasPurpose),
+            cereal::make_nvp(purposeName, purpose),
+            cereal::make_nvp(verifiedName, verified));
+}
+
+StateStore::StateStore(const fs::path& dir) : dir(dir)
+{}
+
+StateStore& StateStore::instance()
+{
+    static StateStore store(PERSIST_DIR);
+    return store;
+}
+
+bool StateStore::save()
+{
+    std::ostringstream os;
     {
-        if (fs::exists(path))
+        cereal::JSONOutputArchive oarchive(
+            os, cereal::JSONOutputArchive::Options::NoIndent());
+        oarchive(cereal::make_nvp(stateName, states));
+    }
+
+    std::error_code ec;
+    fs::create_directories(dir, ec);
+    auto error = writeAtomic(dir / stateName, os.str());
+    if (error)
+    {
+        log<level::ERR>("Failed to write the state file",
+                        entry("ERRNO=%d", error));
+        return false;
+    }
+    dirty = false;
+    return true;
+}
+
+void StateStore::changed()
+{
+    if (batches > 0)
+    {
+        dirty = true;
+        return;
+    }
+    save();
+}
+
+void StateStore::migrate()
+{
+    // Only the files this store replaces are moved: the per-version dirs
+    // also hold files of others, such as the partlabel of obmc-flash-bmc.
+    std::vector<fs::path> migrated;
+    std::error_code ec;
+    for (auto it = fs::directory_iterator(dir, ec);
+         !ec && it != fs::directory_iterator(); it.increment(ec))
+    {
+        if (!it->is_directory(ec))
+        {
+            continue;
+        }
+
+        uint8_t priority;
+        VersionPurpose purpose;
+        std::string verified;
+        auto hasPriority =
+            readLegacy(it->path() / priorityName, priorityName, priority);
+        auto hasPurpose =
+            readLegacy(it->path() / purposeName, purposeName, purpose);
+        auto hasVerified =
+            readLegacy(it->path() / verifiedName, verifiedName, verified);
+        if (!hasPriority && !hasPurpose && !hasVerified)
+        {
+            continue;
+        }
+
+        // The per-version files were written last if both exist, after a
+        // downgrade and upgrade, so they take precedence.
+        auto& state = states[it->path().filename()];
+        if (hasPriority)
+        {
+            state.hasPriority = true;
+            state.priority = priority;
+            migrated.push_back(it->path() / priorityName);
+        }
+        if (hasPurpose)
         {
-            // Delete if it's a non-directory file
-            log<level::WARNING>("Removing non-directory file",
-                                entry("PATH=%s", path.c_str()));
-            fs::remove_all(path);
+            state.hasPurpose = true;
+            state.purpose = purpose;
+            migrated.push_back(it->path() / purposeName);
         }
-        fs::create_directories(path);
+        if (hasVerified)
+        {
+            state.verified = verified;
+            migrated.push_back(it->path() / verifiedName);
+        }
+    }
+
+    if (migrated.empty() || !save())
+    {
+        return;
     }
-    path = path / purposeName;
 
-    std::ofstream os(path.c_str());
-    cereal::JSONOutputArchive oarchive(os);
-    oarchive(cereal::make_nvp(purposeName, purpose));
+    for (const auto& path : migrated)
+    {
+        fs::remove(path, ec);
+        // Fails, leaving the dir, unless it is now empty.
+        fs::remove(path.parent_path(), ec);
+    }
 }
 
-bool restorePriority(const std::string& versionId, uint8_t& priority)
+void StateStore::load()
 {
-    auto path = fs::path(PERSIST_DIR) / versionId / priorityName;
-    if (fs::exists(path))
+    if (loaded)
+    {
+        return;
+    }
+    loaded = true;
+
+    std::ifstream is((dir / stateName).c_str());
+    if (is)
     {
-        std::ifstream is(path.c_str(), std::ios::in);
         try
         {
             cereal::JSONInputArchive iarchive(is);
-            iarchive(cereal::make_nvp(priorityName, priority));
-            return true;
+            iarchive(cereal::make_nvp(stateName, states));
         }
-        catch (cereal::Exception& e)
+        catch (const cereal::Exception& e)
         {
-            fs::remove_all(path);
+            log<level::WARNING>("Discarding the corrupt state file",
+                                entry("ERROR=%s", e.what()));
+            states.clear();
         }
     }
 
+    migrate();
+}
+
+const std::string& StateStore::readUbootEnv()
+{
+    if (ubootEnv)
+    {
+        return *ubootEnv;
+    }
+    ubootEnv.emplace();
+
     // Find the mtd device "u-boot-env" to retrieve the environment variables
     std::ifstream mtdDevices("/proc/mtd");
     std::string device, devicePath;
-
-    try
+    while (std::getline(mtdDevices, device))
     {
-        while (std::getline(mtdDevices, device))
+        if (device.find("u-boot-env") != std::string::npos)
         {
-            if (device.find("u-boot-env") != std::string::npos)
-            {
-                devicePath = "/dev/" + device.substr(0, device.find(':'));
-                break;
-            }
+            devicePath = "/dev/" + device.substr(0, device.find(':'));
+            break;
         }
+    }
+
+    if (!devicePath.empty())
+    {
+        std::ifstream input(devicePath.c_str());
+        std::getline(input, *ubootEnv);
+    }
+    return *ubootEnv;
+}
+
+void StateStore::storePriority(const std::string& versionId, uint8_t priority)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    load();
+    auto& state = states[versionId];
+    if (state.hasPriority && state.priority == priority)
+    {
+        return;
+    }
+    state.hasPriority = true;
+    state.priority = priority;
+    changed();
+}
 
-        if (!devicePath.empty())
+void StateStore::storePurpose(const std::string& versionId,
+                              VersionPurpose purpose)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    load();
+    auto& state = states[versionId];
+    if (state.hasPurpose && state.purpose == purpose)
+    {
+        return;
+    }
+    state.hasPurpose = true;
+    state.purpose = purpose;
+    changed();
+}
+
+bool StateStore::restorePriority(const std::string& versionId,
+                                 uint8_t& priority)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    load();
+    auto it = states.find(versionId);
+    if (it != states.end() && it->second.hasPriority)
+    {
+        priority = it->second.priority;
+        return true;
+    }
+
+    try
+    {
+        const auto& envVars = readUbootEnv();
+        std::string versionVar = versionId + "=";
+        auto varPosition = envVars.find(versionVar);
+
+        if (varPosition != std::string::npos)
         {
-            std::ifstream input(devicePath.c_str());
-            std::string envVars;
-            std::getline(input, envVars);
-
-            std::string versionVar = versionId + "=";
-            auto varPosition = envVars.find(versionVar);
-
-            if (varPosition != std::string::npos)
-            {
-                // Grab the environment variable for this versionId. These
-                // variables follow the format "versionId=priority\0"
-                auto var = envVars.substr(varPosition);
-                priority = std::stoi(var.substr(versionVar.length()));
-                return true;
-            }
+            // Grab the environment variable for this versionId. These
+            // variables follow the format "versionId=priority\0"
+            auto var = envVars.substr(varPosition);
+            priority = std::stoi(var.substr(versionVar.length()));
+            return true;
         }
     }
     catch (const std::exception& e)
@@ -122,29 +350,112 @@ bool restorePriority(const std::string& versionId, uint8_t& priority)
     return false;
 }
 
-bool restorePurpose(const std::string& versionId, VersionPurpose& purpose)
+bool StateStore::restorePurpose(const std::string& versionId,
+                                VersionPurpose& purpose)
 {
-    auto path = fs::path(PERSIST_DIR) / versionId / purposeName;
-    if (fs::exists(path))
+    std::lock_guard<std::mutex> lock(mutex);
+    load();
+    auto it = states.find(versionId);
+    if (it != states.end() && it->second.hasPurpose)
     {
-        std::ifstream is(path.c_str(), std::ios::in);
-        try
-        {
-            cereal::JSONInputArchive iarchive(is);
-            iarchive(cereal::make_nvp(purposeName, purpose));
-            return true;
-        }
-        catch (cereal::Exception& e)
-        {
-            fs::remove_all(path);
-        }
+        purpose = it->second.purpose;
+        return true;
     }
 
     return false;
 }
 
+void StateStore::storeVerified(const std::string& versionId,
+                               const std::string& fingerprint)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    load();
+    auto& state = states[versionId];
+    if (state.verified == fingerprint)
+    {
+        return;
+    }
+    state.verified = fingerprint;
+    changed();
+}
+
+bool StateStore::restoreVerified(const std::string& versionId,
+                                 std::string& fingerprint)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    load();
+    auto it = states.find(versionId);
+    if (it != states.end() && !it->second.verified.empty())
+    {
+        fingerprint = it->second.verified;
+        return true;
+    }
+
+    return false;
+}
+
+void StateStore::remove(const std::string& versionId)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    load();
+    if (states.erase(versionId) > 0)
+    {
+        changed();
+    }
+}
+
+StateBatch::StateBatch(StateStore& store) : store(store)
+{
+    std::lock_guard<std::mutex> lock(store.mutex);
+    store.batches++;
+}
+
+StateBatch::~StateBatch()
+{
+    std::lock_guard<std::mutex> lock(store.mutex);
+    if (--store.batches == 0 && store.dirty)
+    {
+        store.save();
+    }
+}
+
+void storePriority(const std::string& versionId, uint8_t priority)
+{
+    StateStore::instance().storePriority(versionId, priority);
+}
+
+void storePurpose(const std::string& versionId, VersionPurpose purpose)
+{
+    StateStore::instance().storePurpose(versionId, purpose);
+}
+
+bool restorePriority(const std::string& versionId, uint8_t& priority)
+{
+    return StateStore::instance().restorePriority(versionId, priority);
+}
+
+bool restorePurpose(const std::string& versionId, VersionPurpose& purpose)
+{
+    return StateStore::instance().restorePurpose(versionId, purpose);
+}
+
+void storeVerified(const std::string& versionId,
+                   const std::string& fingerprint)
+{
+    StateStore::instance().storeVerified(versionId, fingerprint);
+}
+
+bool restoreVerified(const std::string& versionId, std::string& fingerprint)
+{
+    return StateStore::instance().restoreVerified(versionId, fingerprint);
+}
+
 void removePersistDataDirectory(const std::string& versionId)
 {
+    StateStore::instance().remove(versionId);
+
+    // The version's dir holds the files of others, and values of the
+    // previous layout that could not be migrated.
     auto path = fs::path(PERSIST_DIR) / versionId;
     if (fs::exists(path))
     {
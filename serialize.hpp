@@ -4,6 +4,11 @@
 
 #include "version.hpp"
 
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <mutex>
+#include <optional>
 #include <string>
 
 namespace phosphor
@@ -16,6 +21,126 @@ namespace updater
 using VersionPurpose =
     sdbusplus::xyz::openbmc_project::Software::server::Version::VersionPurpose;
 
+/** @class StateStore
+ *  @brief The priority, purpose and verified fingerprint of every version,
+ *         kept in a single state file.
+ */
+class StateStore
+{
+  public:
+    /** @brief Constructor
+     *  @param[in] dir - Directory of the state file, where the previous
+     *                   layout kept a directory per version.
+     **/
+    explicit StateStore(const std::filesystem::path& dir);
+
+    /** @brief The store in PERSIST_DIR used by the updater */
+    static StateStore& instance();
+
+    /** @brief Store the priority of a version */
+    void storePriority(const std::string& versionId, uint8_t priority);
+
+    /** @brief Store the purpose of a version */
+    void storePurpose(const std::string& versionId, VersionPurpose purpose);
+
+    /** @brief Restore the priority of a version, from the u-boot environment
+     *         if the store has none.
+     *  @return true if restore was successful, false if not
+     **/
+    bool restorePriority(const std::string& versionId, uint8_t& priority);
+
+    /** @brief Restore the purpose of a version
+     *  @return true if restore was successful, false if not
+     **/
+    bool restorePurpose(const std::string& versionId, VersionPurpose& purpose);
+
+    /** @brief Store the fingerprint of a verified version */
+    void storeVerified(const std::string& versionId,
+                       const std::string& fingerprint);
+
+    /** @brief Restore the fingerprint of a verified version
+     *  @return true if restore was successful, false if not
+     **/
+    bool restoreVerified(const std::string& versionId,
+                         std::string& fingerprint);
+
+    /** @brief Remove everything stored for a version */
+    void remove(const std::string& versionId);
+
+  private:
+    friend class StateBatch;
+
+    /** @struct State
+     *  @brief The persistent data of a version.
+     */
+    struct State
+    {
+        bool hasPriority = false;
+        uint8_t priority = 0;
+        bool hasPurpose = false;
+        VersionPurpose purpose = VersionPurpose::Unknown;
+        std::string verified;
+
+        template <class Archive>
+        void serialize(Archive& archive);
+    };
+
+    /** @brief Read the state file on first use */
+    void load();
+
+    /** @brief Move the values of the previous layout into the store */
+    void migrate();
+
+    /** @brief Write the state file */
+    bool save();
+
+    /** @brief Write the state file now, or at the end of the current batch */
+    void changed();
+
+    /** @brief The u-boot environment, read once */
+    const std::string& readUbootEnv();
+
+    /** @brief Directory of the state file */
+    std::filesystem::path dir;
+
+    /** @brief Protects the members below */
+    std::mutex mutex;
+
+    /** @brief The persistent data of all versions, by version id */
+    std::map<std::string, State> states;
+
+    /** @brief Whether states has been read from the state file */
+    bool loaded = false;
+
+    /** @brief Number of StateBatch objects of this store in existence */
+    unsigned batches = 0;
+
+    /** @brief Whether states changed since the state file was written */
+    bool dirty = false;
+
+    /** @brief The u-boot environment, once read */
+    std::optional<std::string> ubootEnv;
+};
+
+/** @class StateBatch
+ *  @brief Defers writing the state file until the outermost StateBatch
+ *         goes out of scope, so the values stored meanwhile are written
+ *         with a single file replacement.
+ */
+class StateBatch
+{
+  public:
+    explicit StateBatch(StateStore& store = StateStore::instance());
+    ~StateBatch();
+    StateBatch(const StateBatch&) = delete;
+    StateBatch& operator=(const StateBatch&) = delete;
+    StateBatch(StateBatch&&) = delete;
+    StateBatch& operator=(StateBatch&&) = delete;
+
+  private:
+    StateStore& store;
+};
+
 /** @brief Serialization function - stores priority information to file
  *  @param[in] versionId - The version for which to store information.
  *  @param[in] priority - RedundancyPriority value for that version.
@@ -42,8 +167,25 @@ bool restorePriority(const std::string& versionId, uint8_t& priority);
  **/
 bool restorePurpose(const std::string& versionId, VersionPurpose& purpose);
 
-/** @brief Removes the serial directory for a given version.
- *  @param[in] versionId - The version for which to remove a file, if it exists.
+/** @brief Serialization function - stores the fingerprint of a version
+ *         whose image signatures were verified.
+ *  @param[in] versionId - The version for which to store information.
+ *  @param[in] fingerprint - Fingerprint of the verified image files.
+ **/
+void storeVerified(const std::string& versionId,
+                   const std::string& fingerprint);
+
+/** @brief Serialization function - restores the fingerprint of the last
+ *         verified image files of a version.
+ *  @param[in] versionId - The version for which to retrieve information.
+ *  @param[in] fingerprint - Fingerprint reference for that version.
+ *  @return true if restore was successful, false if not
+ **/
+bool restoreVerified(const std::string& versionId, std::string& fingerprint);
+
+/** @brief Removes the persisted information of a given version.
+ *  @param[in] versionId - The version for which to remove information, if it
+ *                         exists.
  **/
 void removePersistDataDirectory(const std::string& versionId);
 
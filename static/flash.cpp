@@ -5,8 +5,11 @@
 #include "activation.hpp"
 #include "activation_mcu.hpp"
 
+#include "hash_tree.hpp"
 #include "images.hpp"
 #include "item_updater.hpp"
+#include "manifest.hpp"
+#include "tar_index.hpp"
 
 #include <phosphor-logging/elog-errors.hpp>
 #include <phosphor-logging/elog.hpp>
@@ -35,6 +38,49 @@ auto constexpr BIOS_IMAGE = "image-bios";
 auto constexpr MCU_IMAGE  = "image-mcu";
 namespace fs = std::filesystem;
 using namespace phosphor::software::image;
+namespace tar = phosphor::software::manager::tar;
+using phosphor::software::manager::Manifest;
+
+/** @brief Check a copy of an image against the hash tree of its manifest.
+ *         Images without a tree are taken as they are.
+ *
+ *  @param[in] imageDir - Directory of the image
+ *  @param[in] image    - The image file name
+ *  @param[in] copy     - The copy of the image
+ *
+ *  @return true if the copy matches, false if not
+ */
+static bool verifyCopy(const fs::path& imageDir, const std::string& image,
+                       const fs::path& copy)
+{
+    try
+    {
+        auto manifest = Manifest::load(imageDir / MANIFEST_FILE_NAME);
+        auto tree = HashTree::load(manifest, imageDir, image);
+        if (!tree)
+        {
+            return true;
+        }
+
+        auto failed = tree->verify({copy, 0, fs::file_size(copy)});
+        if (!failed.empty())
+        {
+            log<level::ERR>("Copied image does not match its hash tree",
+                            entry("IMAGE=%s", image.c_str()),
+                            entry("CHUNK=%zu", failed.front()),
+                            entry("CHUNKS=%zu", failed.size()));
+            return false;
+        }
+    }
+    catch (const std::exception& e)
+    {
+        log<level::ERR>("Failed to verify copied image",
+                        entry("IMAGE=%s", image.c_str()),
+                        entry("WHAT=%s", e.what()));
+        return false;
+    }
+    return true;
+}
 
 void Activation::flashWrite()
 {
@@ -46,10 +92,25 @@ void Activation::flashWrite()
 
     for (const auto& bmcImage : parent.imageUpdateList)
     {
-        if ( fs::exists(uploadDir / versionId / bmcImage))
+        // The image is copied from the uploaded tarball if it was left there.
+        auto location = tar::locate(uploadDir / versionId, bmcImage);
+        if (location)
         {
-            fs::copy_file(uploadDir / versionId / bmcImage, toPath / bmcImage,
-                            fs::copy_options::overwrite_existing);
+            tar::copy(*location, toPath / bmcImage);
+            if (!verifyCopy(uploadDir / versionId, bmcImage,
+                            toPath / bmcImage))
+            {
+                // Do not leave a bad image to be flashed on reboot.
+                for (const auto& image : parent.imageUpdateList)
+                {
+                    fs::remove(toPath / image);
+                }
+                report<InternalFailure>();
+                Activation::unsubscribeFromSystemdSignals();
+                Activation::activation(
+                    softwareServer::Activation::Activations::Failed);
+                return;
+            }
         }
     }
 }
@@ -65,10 +126,19 @@ void HostActivation::flashWrite()
     fs::path uploadDir(IMG_UPLOAD_DIR);
     fs::path toPath(PATH_TMP);
 
-    if (fs::exists(uploadDir / versionId / BIOS_IMAGE))
+    auto location = tar::locate(uploadDir / versionId, BIOS_IMAGE);
+    if (location)
     {
-        fs::copy_file(uploadDir / versionId / BIOS_IMAGE, toPath / BIOS_IMAGE,
-                          fs::copy_options::overwrite_existing);
+        tar::copy(*location, toPath / BIOS_IMAGE);
+        if (!verifyCopy(uploadDir / versionId, BIOS_IMAGE,
+                        toPath / BIOS_IMAGE))
+        {
+            fs::remove(toPath / BIOS_IMAGE);
+            report<InternalFailure>();
+            HostActivation::activation(
+                softwareServer::Activation::Activations::Failed);
+            return;
+        }
     }
     else
     {
@@ -134,10 +204,18 @@ void McuActivation::flashWrite()
     fs::path uploadDir(IMG_UPLOAD_DIR);
     fs::path toPath(PATH_TMP);
 
-    if (fs::exists(uploadDir / versionId / MCU_IMAGE))
+    auto location = tar::locate(uploadDir / versionId, MCU_IMAGE);
+    if (location)
     {
-        fs::copy_file(uploadDir / versionId / MCU_IMAGE, toPath / MCU_IMAGE,
-                          fs::copy_options::overwrite_existing);
+        tar::copy(*location, toPath / MCU_IMAGE);
+        if (!verifyCopy(uploadDir / versionId, MCU_IMAGE, toPath / MCU_IMAGE))
+        {
+            fs::remove(toPath / MCU_IMAGE);
+            report<InternalFailure>();
+            McuActivation::activation(
+                softwareServer::Activation::Activations::Failed);
+            return;
+        }
     }
     else
     {
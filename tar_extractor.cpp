@@ -0,0 +1,794 @@
+#include "tar_extractor.hpp"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <zlib.h>
+
+#include <phosphor-logging/log.hpp>
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstring>
+#include <limits>
+#include <stdexcept>
+#include <utility>
+
+namespace phosphor
+{
+namespace software
+{
+namespace manager
+{
+namespace tar
+{
+
+using namespace phosphor::logging;
+using namespace std::string_literals;
+
+namespace // anonymous
+{
+
+constexpr size_t blockSize = 512;
+constexpr size_t bufferSize = 128 * 1024;
+
+// Consumed archive data is released in steps of this size, rather than
+// with a system call per buffer refill.
+constexpr uint64_t releaseSize = 1024 * 1024;
+
+// Upper bound for GNU long name and pax header members, which are held in
+// memory while parsing.
+constexpr uint64_t maxExtendedSize = 1024 * 1024;
+
+// Offsets of the ustar header fields.
+constexpr size_t nameOffset = 0;
+constexpr size_t nameSize = 100;
+constexpr size_t modeOffset = 100;
+constexpr size_t modeSize = 8;
+constexpr size_t sizeOffset = 124;
+constexpr size_t sizeSize = 12;
+constexpr size_t chksumOffset = 148;
+constexpr size_t chksumSize = 8;
+constexpr size_t typeOffset = 156;
+constexpr size_t magicOffset = 257;
+constexpr size_t prefixOffset = 345;
+constexpr size_t prefixSize = 155;
+
+using Block = std::array<uint8_t, blockSize>;
+
+uint64_t padding(uint64_t size)
+{
+    return (blockSize - size % blockSize) % blockSize;
+}
+
+/** @brief Parse a numeric header field, either NUL/space terminated octal
+ *         or the GNU base-256 encoding for large values.
+ */
+uint64_t parseNumber(const uint8_t* field, size_t len)
+{
+    uint64_t value = 0;
+
+    if (field[0] & 0x80)
+    {
+        if (field[0] != 0x80)
+        {
+            throw std::runtime_error("Unsupported tar numeric field");
+        }
+        for (size_t i = 1; i < len; i++)
+        {
+            if (value >> 56)
+            {
+                throw std::runtime_error("Tar numeric field overflow");
+            }
+            value = (value << 8) | field[i];
+        }
+        return value;
+    }
+
+    size_t i = 0;
+    while (i < len && (field[i] == ' ' || field[i] == '\0'))
+    {
+        i++;
+    }
+    for (; i < len && field[i] >= '0' && field[i] <= '7'; i++)
+    {
+        if (value >> 61)
+        {
+            throw std::runtime_error("Tar numeric field overflow");
+        }
+        value = (value << 3) | (field[i] - '0');
+    }
+    return value;
+}
+
+std::string parseString(const uint8_t* field, size_t len)
+{
+    auto begin = reinterpret_cast<const char*>(field);
+    return std::string(begin, std::find(begin, begin + len, '\0'));
+}
+
+bool isZeroBlock(const Block& block)
+{
+    return std::all_of(block.begin(), block.end(),
+                       [](uint8_t c) { return c == 0; });
+}
+
+bool isValidChecksum(const Block& block)
+{
+    uint64_t sum = 0;
+    for (size_t i = 0; i < blockSize; i++)
+    {
+        bool inChksum = (i >= chksumOffset) && (i < chksumOffset + chksumSize);
+        sum += inChksum ? ' ' : block[i];
+    }
+    return sum == parseNumber(&block[chksumOffset], chksumSize);
+}
+
+void writeAll(int fd, const uint8_t* buf, size_t len)
+{
+    while (len > 0)
+    {
+        auto written = write(fd, buf, len);
+        if (written < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            auto error = errno;
+            throw std::runtime_error("write failed, errno="s +
+                                     std::strerror(error));
+        }
+        buf += written;
+        len -= written;
+    }
+}
+
+/** @brief Pass the data of the current member to the observer without
+ *         writing it anywhere.
+ */
+void skipFile(Reader& reader, std::vector<uint8_t>& buf, Observer* observer)
+{
+    // Read the data even without an observer, a truncated archive must
+    // not end up with an index pointing past its end.
+    while (auto len = reader.read(buf.data(), buf.size()))
+    {
+        if (observer)
+        {
+            observer->update(buf.data(), len);
+        }
+    }
+}
+
+void writeFile(Reader& reader, const fs::path& path, mode_t mode,
+               std::vector<uint8_t>& buf, Observer* observer)
+{
+    fs::create_directories(path.parent_path());
+
+    auto fd = open(path.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW |
+                                     O_CLOEXEC,
+                   mode);
+    if (fd < 0)
+    {
+        auto error = errno;
+        throw std::runtime_error("open "s + path.string() +
+                                 " failed, errno=" + std::strerror(error));
+    }
+
+    try
+    {
+        size_t len;
+        while ((len = reader.read(buf.data(), buf.size())) > 0)
+        {
+            writeAll(fd, buf.data(), len);
+            if (observer)
+            {
+                observer->update(buf.data(), len);
+            }
+        }
+        // Apply the archived permissions regardless of the umask.
+        fchmod(fd, mode);
+    }
+    catch (...)
+    {
+        close(fd);
+        throw;
+    }
+    close(fd);
+}
+
+/** @brief Open an archive file, run func with a reader on it. */
+template <typename Func>
+auto withReader(const fs::path& tarball, int flags, Func func,
+                const Tap& tap = nullptr)
+{
+    auto fd = open(tarball.c_str(), flags | O_CLOEXEC);
+    if (fd < 0)
+    {
+        auto error = errno;
+        throw std::runtime_error("open "s + tarball.string() +
+                                 " failed, errno=" + std::strerror(error));
+    }
+
+    try
+    {
+        Reader reader(fd, tap);
+        auto result = func(reader);
+        close(fd);
+        return result;
+    }
+    catch (...)
+    {
+        close(fd);
+        throw;
+    }
+}
+
+} // namespace
+
+Reader::Reader(int fd, Tap tap,
+               std::optional<std::chrono::steady_clock::time_point> deadline) :
+    fd(fd), tap(std::move(tap)), deadline(deadline), inBuf(bufferSize)
+{
+    // Buffer enough of the stream to recognize the gzip magic bytes, which
+    // also works for descriptors that cannot seek, such as pipes.
+    while (inLen < 2)
+    {
+        auto len = readFd(inBuf.data() + inLen, inBuf.size() - inLen);
+        if (len == 0)
+        {
+            break;
+        }
+        if (this->tap)
+        {
+            this->tap(inBuf.data() + inLen, len);
+        }
+        inLen += len;
+        fileOffset += len;
+    }
+
+    if (inLen >= 2 && inBuf[0] == 0x1f && inBuf[1] == 0x8b)
+    {
+        // 15 window bits plus 16 selects gzip decoding.
+        zs = std::make_unique<z_stream>();
+        if (inflateInit2(zs.get(), 15 + 16) != Z_OK)
+        {
+            throw std::runtime_error("inflateInit2 failed");
+        }
+        gzip = true;
+    }
+}
+
+Reader::~Reader()
+{
+    if (gzip)
+    {
+        inflateEnd(zs.get());
+    }
+}
+
+size_t Reader::readFd(void* buf, size_t len)
+{
+    while (true)
+    {
+        if (deadline)
+        {
+            auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+                            *deadline - std::chrono::steady_clock::now())
+                            .count();
+            struct pollfd pfd = {fd, POLLIN, 0};
+            auto rc = left > 0
+                          ? poll(&pfd, 1,
+                                 std::min<int64_t>(
+                                     left, std::numeric_limits<int>::max()))
+                          : 0;
+            if (rc < 0 && errno == EINTR)
+            {
+                continue;
+            }
+            if (rc == 0)
+            {
+                throw std::runtime_error("read timed out");
+            }
+        }
+
+        auto got = ::read(fd, buf, len);
+        if (got < 0 &&
+            (errno == EINTR ||
+             (deadline && (errno == EAGAIN || errno == EWOULDBLOCK))))
+        {
+            continue;
+        }
+        if (got < 0)
+        {
+            auto error = errno;
+            throw std::runtime_error("read failed, errno="s +
+                                     std::strerror(error));
+        }
+        return got;
+    }
+}
+
+size_t Reader::refill()
+{
+    inPos = 0;
+    inLen = 0;
+    inLen = readFd(inBuf.data(), inBuf.size());
+    fileOffset += inLen;
+    if (tap)
+    {
+        tap(inBuf.data(), inLen);
+    }
+    release();
+    return inLen;
+}
+
+size_t Reader::fill(void* buf, size_t len)
+{
+    if (len == 0)
+    {
+        return 0;
+    }
+
+    if (!gzip)
+    {
+        if (inPos == inLen)
+        {
+            if (len >= inBuf.size())
+            {
+                // Large reads bypass the input buffer.
+                auto got = readFd(buf, len);
+                if (tap)
+                {
+                    tap(static_cast<uint8_t*>(buf), got);
+                }
+                position += got;
+                fileOffset += got;
+                release();
+                return got;
+            }
+            if (refill() == 0)
+            {
+                return 0;
+            }
+        }
+        auto n = std::min(len, inLen - inPos);
+        std::memcpy(buf, inBuf.data() + inPos, n);
+        inPos += n;
+        position += n;
+        return n;
+    }
+
+    zs->next_out = static_cast<Bytef*>(buf);
+    zs->avail_out = len;
+    while (zs->avail_out == len)
+    {
+        if (inPos == inLen)
+        {
+            if (refill() == 0)
+            {
+                if (gzipEnd)
+                {
+                    return 0;
+                }
+                throw std::runtime_error("Truncated gzip stream");
+            }
+        }
+        if (gzipEnd)
+        {
+            // Concatenated gzip members form a single stream.
+            inflateReset(zs.get());
+            gzipEnd = false;
+        }
+
+        zs->next_in = inBuf.data() + inPos;
+        zs->avail_in = inLen - inPos;
+        auto rc = inflate(zs.get(), Z_NO_FLUSH);
+        inPos = inLen - zs->avail_in;
+
+        if (rc == Z_STREAM_END)
+        {
+            gzipEnd = true;
+        }
+        else if (rc != Z_OK && rc != Z_BUF_ERROR)
+        {
+            throw std::runtime_error("inflate failed, rc="s +
+                                     std::to_string(rc));
+        }
+    }
+    position += len - zs->avail_out;
+    return len - zs->avail_out;
+}
+
+void Reader::readExact(void* buf, size_t len)
+{
+    auto out = static_cast<uint8_t*>(buf);
+    while (len > 0)
+    {
+        auto n = fill(out, len);
+        if (n == 0)
+        {
+            throw std::runtime_error("Unexpected end of tar archive");
+        }
+        out += n;
+        len -= n;
+    }
+}
+
+void Reader::discard(uint64_t len)
+{
+    if (!gzip)
+    {
+        auto n = std::min<uint64_t>(len, inLen - inPos);
+        inPos += n;
+        position += n;
+        len -= n;
+        if (len > 0 && !tap && lseek(fd, len, SEEK_CUR) != -1)
+        {
+            position += len;
+            fileOffset += len;
+            release();
+            return;
+        }
+    }
+
+    std::array<uint8_t, blockSize * 8> scratch;
+    while (len > 0)
+    {
+        auto n = std::min<uint64_t>(len, scratch.size());
+        readExact(scratch.data(), n);
+        len -= n;
+    }
+}
+
+std::string Reader::readExtendedData(uint64_t size)
+{
+    if (size > maxExtendedSize)
+    {
+        throw std::runtime_error("Tar extended header too large");
+    }
+    std::string data(size, '\0');
+    readExact(data.data(), size);
+    discard(tar::padding(size));
+    return data;
+}
+
+bool Reader::next(Entry& entry)
+{
+    discard(remaining + padding);
+    remaining = 0;
+    padding = 0;
+
+    std::string longName;
+    std::string paxPath;
+    bool hasPaxSize = false;
+    uint64_t paxSize = 0;
+
+    while (true)
+    {
+        Block block;
+        auto len = fill(block.data(), block.size());
+        if (len == 0)
+        {
+            // Tolerate archives that lack the end-of-archive blocks.
+            return false;
+        }
+        if (len < block.size())
+        {
+            readExact(block.data() + len, block.size() - len);
+        }
+
+        if (isZeroBlock(block))
+        {
+            return false;
+        }
+        if (!isValidChecksum(block))
+        {
+            throw std::runtime_error("Invalid tar header checksum");
+        }
+
+        auto type = static_cast<char>(block[typeOffset]);
+        auto size = parseNumber(&block[sizeOffset], sizeSize);
+
+        if (type == 'L')
+        {
+            // GNU long name for the next member.
+            longName = readExtendedData(size);
+            longName.erase(longName.find_last_not_of('\0') + 1);
+            continue;
+        }
+        if (type == 'x')
+        {
+            // pax extended header, records are "<len> <key>=<value>\n".
+            auto data = readExtendedData(size);
+            size_t pos = 0;
+            while (pos < data.size())
+            {
+                auto space = data.find(' ', pos);
+                if (space == std::string::npos)
+                {
+                    break;
+                }
+                auto recLen = std::stoul(data.substr(pos, space - pos));
+                if (recLen == 0 || pos + recLen > data.size())
+                {
+                    throw std::runtime_error("Malformed pax header");
+                }
+                auto record = data.substr(space + 1, pos + recLen - space - 2);
+                auto eq = record.find('=');
+                if (eq != std::string::npos)
+                {
+                    auto key = record.substr(0, eq);
+                    if (key == "path")
+                    {
+                        paxPath = record.substr(eq + 1);
+                    }
+                    else if (key == "size")
+                    {
+                        paxSize = std::stoull(record.substr(eq + 1));
+                        hasPaxSize = true;
+                    }
+                }
+                pos += recLen;
+            }
+            continue;
+        }
+        if (type == 'K' || type == 'g')
+        {
+            // GNU long link name and pax global headers are not needed.
+            discard(size + tar::padding(size));
+            continue;
+        }
+
+        if (!longName.empty())
+        {
+            entry.name = longName;
+        }
+        else if (!paxPath.empty())
+        {
+            entry.name = paxPath;
+        }
+        else
+        {
+            entry.name = parseString(&block[nameOffset], nameSize);
+            if (std::memcmp(&block[magicOffset], "ustar", 5) == 0)
+            {
+                auto prefix = parseString(&block[prefixOffset], prefixSize);
+                if (!prefix.empty())
+                {
+                    entry.name = prefix + '/' + entry.name;
+                }
+            }
+        }
+        entry.type = type;
+        entry.size = hasPaxSize ? paxSize : size;
+        entry.mode = parseNumber(&block[modeOffset], modeSize) & 0777;
+
+        // Links and directories carry no data, whatever their size field.
+        remaining = (type == '1' || type == '2' || type == '5') ? 0
+                                                                 : entry.size;
+        padding = tar::padding(remaining);
+        return true;
+    }
+}
+
+size_t Reader::read(void* buf, size_t len)
+{
+    auto n = std::min<uint64_t>(len, remaining);
+    if (n == 0)
+    {
+        return 0;
+    }
+    auto got = fill(buf, n);
+    if (got == 0)
+    {
+        throw std::runtime_error("Unexpected end of tar archive");
+    }
+    remaining -= got;
+    return got;
+}
+
+std::optional<uint64_t> Reader::offset() const
+{
+    if (gzip)
+    {
+        return std::nullopt;
+    }
+    return position;
+}
+
+void Reader::releaseConsumed()
+{
+    releasing = true;
+    release();
+}
+
+void Reader::drain()
+{
+    while (refill() > 0)
+    {
+    }
+    inPos = inLen;
+}
+
+void Reader::release()
+{
+    // Data read into the buffers is no longer needed in the file.
+    if (!releasing || fileOffset - released < releaseSize)
+    {
+        return;
+    }
+
+    if (fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, released,
+                  fileOffset - released) != 0)
+    {
+        auto error = errno;
+        log<level::INFO>("Not releasing consumed tar archive data",
+                         entry("ERRNO=%d", error));
+        releasing = false;
+        return;
+    }
+    released = fileOffset;
+}
+
+fs::path memberPath(const std::string& name)
+{
+    fs::path path(name);
+    if (path.has_root_directory())
+    {
+        throw std::runtime_error("Absolute path in tar archive: " + name);
+    }
+
+    fs::path result;
+    for (const auto& part : path)
+    {
+        if (part == "..")
+        {
+            throw std::runtime_error("Path traversal in tar archive: " + name);
+        }
+        if (part.empty() || part == ".")
+        {
+            continue;
+        }
+        result /= part;
+    }
+    return result;
+}
+
+void extract(Reader& reader, const fs::path& dir, Observer* observer,
+             Index* index)
+{
+    std::vector<uint8_t> buf(bufferSize);
+    Entry member;
+
+    while (reader.next(member))
+    {
+        auto relPath = memberPath(member.name);
+        if (relPath.empty())
+        {
+            continue;
+        }
+        auto path = dir / relPath;
+
+        switch (member.type)
+        {
+            case '0':
+            case '\0':
+            case '7':
+            {
+                auto name = relPath.string();
+                auto offset = index ? reader.offset() : std::nullopt;
+                bool indexed = offset && member.size >= indexMinSize &&
+                               name.find('\n') == std::string::npos;
+                if (observer)
+                {
+                    observer->begin(relPath, member);
+                }
+                if (indexed)
+                {
+                    // A member repeated in the archive replaces the earlier
+                    // one, whether that was written or indexed.
+                    fs::remove(path);
+                    skipFile(reader, buf, observer);
+                    (*index)[name] = {*offset, member.size};
+                }
+                else
+                {
+                    if (index)
+                    {
+                        index->erase(name);
+                    }
+                    writeFile(reader, path, member.mode, buf, observer);
+                }
+                if (observer)
+                {
+                    observer->end();
+                }
+                break;
+            }
+            case '5':
+                fs::create_directories(path);
+                break;
+            default:
+                log<level::INFO>("Skipping unsupported tar member",
+                                 entry("NAME=%s", member.name.c_str()),
+                                 entry("TYPE=%c", member.type));
+                break;
+        }
+    }
+}
+
+bool readMember(Reader& reader, const fs::path& name, std::string& data,
+                size_t maxSize)
+{
+    Entry member;
+
+    while (reader.next(member))
+    {
+        if (member.type != '0' && member.type != '\0' && member.type != '7')
+        {
+            continue;
+        }
+        if (memberPath(member.name) != name)
+        {
+            continue;
+        }
+        if (member.size > maxSize)
+        {
+            throw std::runtime_error("Tar member " + member.name +
+                                     " exceeds " + std::to_string(maxSize) +
+                                     " bytes");
+        }
+
+        data.resize(member.size);
+        size_t pos = 0;
+        while (pos < data.size())
+        {
+            auto len = reader.read(data.data() + pos, data.size() - pos);
+            if (len == 0)
+            {
+                throw std::runtime_error("Truncated tar member " +
+                                         member.name);
+            }
+            pos += len;
+        }
+        return true;
+    }
+    return false;
+}
+
+void extract(const fs::path& tarball, const fs::path& dir,
+             Observer* observer, Index* index, bool consume, const Tap& tap)
+{
+    withReader(
+        tarball, consume ? O_RDWR : O_RDONLY,
+        [&](Reader& reader) {
+            // Members kept in the index are read from the tarball later on.
+            if (consume && !(index && reader.offset()))
+            {
+                reader.releaseConsumed();
+            }
+            extract(reader, dir, observer, index);
+            if (tap)
+            {
+                reader.drain();
+            }
+            return true;
+        },
+        tap);
+}
+
+bool readMember(const fs::path& tarball, const fs::path& name,
+                std::string& data, size_t maxSize)
+{
+    return withReader(tarball, O_RDONLY, [&](Reader& reader) {
+        return readMember(reader, name, data, maxSize);
+    });
+}
+
+} // namespace tar
+} // namespace manager
+} // namespace software
+} // namespace phosphor
@@ -0,0 +1,293 @@
+#pragma once
+
+#include "tar_index.hpp"
+
+#include <sys/types.h>
+
+#include <chrono>
+#include <cstdint>
+#include <filesystem>
+#include <functional>
+#include <memory>
+#include <optional>
+#include <string>
+#include <vector>
+
+struct z_stream_s;
+
+namespace phosphor
+{
+namespace software
+{
+namespace manager
+{
+namespace tar
+{
+
+namespace fs = std::filesystem;
+
+/** @struct Entry
+ *  @brief Header information of a tar archive member.
+ */
+struct Entry
+{
+    /** @brief Member path as stored in the archive */
+    std::string name;
+
+    /** @brief Member type flag, e.g. '0' for a regular file */
+    char type;
+
+    /** @brief Size of the member data in bytes */
+    uint64_t size;
+
+    /** @brief Permission bits of the member */
+    mode_t mode;
+};
+
+/** @brief Receives the raw archive data as it is read, e.g. to check a
+ *         signature over the whole archive.
+ */
+using Tap = std::function<void(const uint8_t* data, size_t len)>;
+
+/** @class Reader
+ *  @brief Streaming reader for ustar, GNU and pax tar archives.
+ *  @details Pulls archive members sequentially from a file descriptor,
+ *           transparently inflating gzip compressed archives. The file
+ *           descriptor is not owned by the reader. All failures are
+ *           reported by throwing std::runtime_error.
+ */
+class Reader
+{
+  public:
+    Reader() = delete;
+    Reader(const Reader&) = delete;
+    Reader& operator=(const Reader&) = delete;
+    Reader(Reader&&) = delete;
+    Reader& operator=(Reader&&) = delete;
+
+    /** @brief Constructs Reader
+     *
+     *  @param[in] fd       - File descriptor positioned at the archive start
+     *  @param[in] tap      - Optional receiver of all data read from fd, in
+     *                        order. Data is then read rather than seeked
+     *                        over.
+     *  @param[in] deadline - Optional time by which all of the archive has
+     *                        to be read. fd is then polled, and may be non
+     *                        blocking.
+     */
+    explicit Reader(int fd, Tap tap = nullptr,
+                    std::optional<std::chrono::steady_clock::time_point>
+                        deadline = std::nullopt);
+
+    ~Reader();
+
+    /** @brief Advance to the next archive member.
+     *
+     *  @details Any unread data of the current member is skipped. Extended
+     *           header members (GNU long names, pax headers) are consumed
+     *           and applied to the member that follows them.
+     *
+     *  @param[out] entry - Header of the next member
+     *
+     *  @return false at the end of the archive
+     */
+    bool next(Entry& entry);
+
+    /** @brief Read data of the current member.
+     *
+     *  @param[out] buf - Destination buffer
+     *  @param[in]  len - Size of the destination buffer
+     *
+     *  @return Number of bytes read, 0 once the member data is exhausted
+     */
+    size_t read(void* buf, size_t len);
+
+    /** @brief Offset of the unread data of the current member.
+     *
+     *  @return The offset from the start of the archive file, nullopt for
+     *          gzip compressed archives
+     */
+    std::optional<uint64_t> offset() const;
+
+    /** @brief Release the storage of the archive file data read so far,
+     *         and keep doing so while reading.
+     *
+     *  @details Consumed ranges are punched out of the file with
+     *           fallocate(FALLOC_FL_PUNCH_HOLE), which keeps the combined
+     *           size of an archive and its extracted files close to the
+     *           size of the files alone. The archive is unusable afterwards.
+     *           The file descriptor has to be open for writing. Nothing is
+     *           released if the file system does not support it.
+     */
+    void releaseConsumed();
+
+    /** @brief Read the rest of the file past the end of the archive, so
+     *         that the tap has seen all of it.
+     */
+    void drain();
+
+  private:
+    /** @brief Read up to len bytes of the (inflated) archive stream.
+     *
+     *  @return Number of bytes read, 0 at the end of the stream
+     */
+    size_t fill(void* buf, size_t len);
+
+    /** @brief Read exactly len bytes of the archive stream. */
+    void readExact(void* buf, size_t len);
+
+    /** @brief Drop len bytes of the archive stream. */
+    void discard(uint64_t len);
+
+    /** @brief Read from the file descriptor, waiting for data until the
+     *         deadline if there is one.
+     *
+     *  @return Number of bytes read, 0 at end of file
+     */
+    size_t readFd(void* buf, size_t len);
+
+    /** @brief Refill the input buffer from the file descriptor.
+     *
+     *  @return Number of bytes now buffered, 0 at end of file
+     */
+    size_t refill();
+
+    /** @brief Read the data of an extended header member into a string. */
+    std::string readExtendedData(uint64_t size);
+
+    /** @brief Punch out the file data read so far, if enabled. */
+    void release();
+
+    /** @brief Archive file descriptor */
+    int fd;
+
+    /** @brief Receiver of the data read from fd */
+    Tap tap;
+
+    /** @brief Time by which the archive has to be read, if any */
+    std::optional<std::chrono::steady_clock::time_point> deadline;
+
+    /** @brief Input buffer holding raw bytes read from the descriptor */
+    std::vector<uint8_t> inBuf;
+
+    /** @brief Read position in the input buffer */
+    size_t inPos = 0;
+
+    /** @brief Number of valid bytes in the input buffer */
+    size_t inLen = 0;
+
+    /** @brief Whether the archive is gzip compressed */
+    bool gzip = false;
+
+    /** @brief Whether the current gzip member has been fully inflated */
+    bool gzipEnd = false;
+
+    /** @brief zlib inflate state, used for gzip compressed archives */
+    std::unique_ptr<z_stream_s> zs;
+
+    /** @brief Unread data bytes of the current member */
+    uint64_t remaining = 0;
+
+    /** @brief Padding bytes following the current member data */
+    uint64_t padding = 0;
+
+    /** @brief Number of bytes of the (inflated) archive stream consumed */
+    uint64_t position = 0;
+
+    /** @brief File offset up to which data has been read or skipped */
+    uint64_t fileOffset = 0;
+
+    /** @brief File offset up to which the storage has been released */
+    uint64_t released = 0;
+
+    /** @brief Whether consumed file data is released */
+    bool releasing = false;
+};
+
+/** @class Observer
+ *  @brief Receives the data of regular file members while they are
+ *         extracted, e.g. to hash them on the fly.
+ *  @details Exceptions thrown by an observer abort the extraction.
+ */
+class Observer
+{
+  public:
+    /* Destructor */
+    virtual ~Observer() = default;
+
+    /** @brief Called before the data of a member is written.
+     *
+     *  @param[in] path   - Member path relative to the extraction directory
+     *  @param[in] member - Member header
+     */
+    virtual void begin(const fs::path& path, const Entry& member) = 0;
+
+    /** @brief Called for each chunk of member data written to disk. */
+    virtual void update(const uint8_t* data, size_t len) = 0;
+
+    /** @brief Called once all data of the member has been written. */
+    virtual void end() = 0;
+};
+
+/** @brief Check that an archive member path stays inside the extraction
+ *         directory.
+ *
+ *  @param[in] name - Member path as stored in the archive
+ *
+ *  @return The normalized relative path, empty for the archive root.
+ *          Throws std::runtime_error for absolute paths and paths that
+ *          contain a ".." component.
+ */
+fs::path memberPath(const std::string& name);
+
+/** @brief Extract all regular files and directories of an archive.
+ *
+ *  @details Links, device nodes and other special members are skipped.
+ *           If index is given and the archive is not compressed, members
+ *           of at least indexMinSize bytes are not written. Their data
+ *           is still read and passed to the observer, and their location
+ *           in the archive is recorded in index instead.
+ *
+ *  @param[in] reader   - Archive reader
+ *  @param[in] dir      - Existing directory to extract into
+ *  @param[in] observer - Optional observer of the extracted data
+ *  @param[out] index   - Optional index of the members not written
+ */
+void extract(Reader& reader, const fs::path& dir, Observer* observer = nullptr,
+             Index* index = nullptr);
+
+/** @brief Extract the archive file tarball into the directory dir.
+ *
+ *  @details With consume set, the tarball storage is released while it is
+ *           extracted, see Reader::releaseConsumed(). The tarball is left
+ *           intact if members are kept in index. With tap set, the whole
+ *           file is passed to it, see Reader::drain().
+ */
+void extract(const fs::path& tarball, const fs::path& dir,
+             Observer* observer = nullptr, Index* index = nullptr,
+             bool consume = false, const Tap& tap = nullptr);
+
+/** @brief Read the data of a single regular file member into memory.
+ *
+ *  @details The archive is scanned up to the first member with the given
+ *           path; nothing is written to disk. Throws std::runtime_error if
+ *           the member is larger than maxSize.
+ *
+ *  @param[in]  reader  - Archive reader
+ *  @param[in]  name    - Normalized member path, see memberPath()
+ *  @param[out] data    - Member data
+ *  @param[in]  maxSize - Largest member size accepted
+ *
+ *  @return false if the archive has no such member
+ */
+bool readMember(Reader& reader, const fs::path& name, std::string& data,
+                size_t maxSize);
+
+/** @brief Read a single member of the archive file tarball into memory. */
+bool readMember(const fs::path& tarball, const fs::path& name,
+                std::string& data, size_t maxSize);
+
+} // namespace tar
+} // namespace manager
+} // namespace software
+} // namespace phosphor
@@ -0,0 +1,170 @@
+#include "config.h"
+
+#include "tar_index.hpp"
+
+#include <fcntl.h>
+#include <sys/sendfile.h>
+#include <unistd.h>
+
+#include <phosphor-logging/log.hpp>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <fstream>
+#include <limits>
+#include <sstream>
+#include <stdexcept>
+
+namespace phosphor
+{
+namespace software
+{
+namespace manager
+{
+namespace tar
+{
+
+using namespace phosphor::logging;
+using namespace std::string_literals;
+
+bool storeIndex(const fs::path& dir, const Index& index)
+{
+    // One "<offset> <size> <name>" line per member, the name goes last so
+    // it may contain spaces.
+    std::ofstream os(dir / INDEX_FILE_NAME, std::ios::trunc);
+    for (const auto& [name, member] : index)
+    {
+        os << member.offset << ' ' << member.size << ' ' << name << '\n';
+    }
+    os.close();
+
+    if (!os)
+    {
+        log<level::ERR>("Failed to store tarball index",
+                        entry("PATH=%s", dir.c_str()));
+        return false;
+    }
+    return true;
+}
+
+Index loadIndex(const fs::path& dir)
+{
+    Index index;
+    std::ifstream is(dir / INDEX_FILE_NAME);
+    std::string line;
+
+    while (std::getline(is, line))
+    {
+        std::istringstream fields(line);
+        Member member;
+        if (!(fields >> member.offset >> member.size) || fields.get() != ' ')
+        {
+            continue;
+        }
+
+        std::string name;
+        std::getline(fields, name);
+        if (!name.empty())
+        {
+            index.emplace(std::move(name), member);
+        }
+    }
+
+    return index;
+}
+
+std::optional<Location> locate(const fs::path& dir, const std::string& name)
+{
+    std::error_code ec;
+    auto path = dir / name;
+    if (fs::is_regular_file(path, ec))
+    {
+        auto size = fs::file_size(path, ec);
+        if (!ec)
+        {
+            return Location{path, 0, size};
+        }
+    }
+
+    auto index = loadIndex(dir);
+    auto it = index.find(name);
+    if (it == index.end())
+    {
+        return std::nullopt;
+    }
+
+    // Do not hand out ranges past the end of a tarball changed since.
+    auto tarball = dir / TARBALL_FILE_NAME;
+    auto size = fs::file_size(tarball, ec);
+    if (ec || it->second.offset > size || it->second.size > size ||
+        it->second.offset + it->second.size > size)
+    {
+        log<level::ERR>("Indexed image file is not in the tarball",
+                        entry("PATH=%s", path.c_str()));
+        return std::nullopt;
+    }
+
+    return Location{std::move(tarball), it->second.offset, it->second.size};
+}
+
+void copy(const Location& from, const fs::path& to)
+{
+    if (from.offset > static_cast<uint64_t>(std::numeric_limits<off_t>::max()))
+    {
+        throw std::runtime_error("Offset out of range in "s +
+                                 from.file.string());
+    }
+
+    auto in = open(from.file.c_str(), O_RDONLY | O_CLOEXEC);
+    if (in < 0)
+    {
+        auto error = errno;
+        throw std::runtime_error("open "s + from.file.string() +
+                                 " failed, errno=" + std::strerror(error));
+    }
+
+    auto out = open(to.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (out < 0)
+    {
+        auto error = errno;
+        close(in);
+        throw std::runtime_error("open "s + to.string() +
+                                 " failed, errno=" + std::strerror(error));
+    }
+
+    // Copy in the kernel, the data is not staged in user space.
+    off_t offset = from.offset;
+    auto remaining = from.size;
+    while (remaining > 0)
+    {
+        auto len = std::min<uint64_t>(remaining, 0x7ffff000);
+        auto copied = sendfile(out, in, &offset, len);
+        if (copied < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (copied <= 0)
+        {
+            auto error = copied < 0 ? errno : EIO;
+            close(in);
+            close(out);
+            throw std::runtime_error("copy to "s + to.string() +
+                                     " failed, errno=" + std::strerror(error));
+        }
+        remaining -= copied;
+    }
+
+    close(in);
+    if (close(out) < 0)
+    {
+        auto error = errno;
+        throw std::runtime_error("close "s + to.string() +
+                                 " failed, errno=" + std::strerror(error));
+    }
+}
+
+} // namespace tar
+} // namespace manager
+} // namespace software
+} // namespace phosphor
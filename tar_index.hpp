@@ -0,0 +1,95 @@
+#pragma once
+
+#include <cstdint>
+#include <filesystem>
+#include <map>
+#include <optional>
+#include <string>
+
+namespace phosphor
+{
+namespace software
+{
+namespace manager
+{
+namespace tar
+{
+
+namespace fs = std::filesystem;
+
+/** @brief Smallest member kept in the tarball rather than extracted */
+constexpr uint64_t indexMinSize = 1024 * 1024;
+
+/** @struct Member
+ *  @brief Location of the data of a member in an uncompressed tarball.
+ */
+struct Member
+{
+    /** @brief Offset of the member data from the start of the tarball */
+    uint64_t offset;
+
+    /** @brief Size of the member data in bytes */
+    uint64_t size;
+};
+
+/** @brief Members left in the tarball, keyed by member path */
+using Index = std::map<std::string, Member>;
+
+/** @struct Location
+ *  @brief Where the data of an image file is stored, either an extracted
+ *         file or a range of the tarball kept in the image directory.
+ */
+struct Location
+{
+    /** @brief File holding the data */
+    fs::path file;
+
+    /** @brief Offset of the data in the file */
+    uint64_t offset;
+
+    /** @brief Size of the data in bytes */
+    uint64_t size;
+};
+
+/** @brief Store the index of an image directory.
+ *
+ *  @details The tarball the offsets refer to is expected to be moved into
+ *           the directory as TARBALL_FILE_NAME.
+ *
+ *  @param[in] dir   - The image directory
+ *  @param[in] index - The members left in the tarball
+ *
+ *  @return true if the index was stored
+ */
+bool storeIndex(const fs::path& dir, const Index& index);
+
+/** @brief Load the index of an image directory.
+ *
+ *  @return The index, empty if the directory has none
+ */
+Index loadIndex(const fs::path& dir);
+
+/** @brief Find the data of a file of an image directory.
+ *
+ *  @details An extracted file takes precedence over an indexed member.
+ *
+ *  @param[in] dir  - The image directory
+ *  @param[in] name - The file name, e.g. image-bmc
+ *
+ *  @return The location, or nullopt if the image has no such file
+ */
+std::optional<Location> locate(const fs::path& dir, const std::string& name);
+
+/** @brief Copy the data of a file of an image directory to a new file.
+ *
+ *  @details Throws std::runtime_error on failure.
+ *
+ *  @param[in] from - The location of the data
+ *  @param[in] to   - The destination file, replaced if it exists
+ */
+void copy(const Location& from, const fs::path& to);
+
+} // namespace tar
+} // namespace manager
+} // namespace software
+} // namespace phosphor
@@ -1,17 +1,34 @@
+#include "config.h"
+
+#include "hasher.hpp"
 #include "image_verify.hpp"
+#include "key_cache.hpp"
+#include "manifest.hpp"
+#include "priority_index.hpp"
+#include "serialize.hpp"
+#include "tar_extractor.hpp"
+#include "tar_index.hpp"
 #include "utils.hpp"
 #include "version.hpp"
 
+#include <fcntl.h>
 #include <openssl/sha.h>
 #include <stdlib.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
+#include <atomic>
+#include <chrono>
 #include <filesystem>
 #include <fstream>
 #include <iostream>
 #include <sstream>
 #include <string>
+#include <thread>
 #include <vector>
 
+#include <cereal/archives/json.hpp>
+
 #include <gtest/gtest.h>
 
 using namespace phosphor::software::manager;
@@ -125,6 +142,137 @@ TEST_F(VersionTest, TestGetId)
     EXPECT_EQ(Version::getId(version), hexId);
 }
 
+/** @brief Make sure the functional versions follow their release files */
+TEST_F(VersionTest, TestFunctionalVersions)
+{
+    auto bmcRelease = _directory + "/os-release";
+    auto hostRelease = _directory + "/bios-release";
+    auto mcuRelease = _directory + "/mcu-release";
+    auto writeRelease = [](const std::string& path, const std::string& id) {
+        std::ofstream file(path + ".tmp");
+        file << "VERSION_ID=\"" << id << "\"\n";
+        file.close();
+        fs::rename(path + ".tmp", path);
+    };
+    writeRelease(bmcRelease, "bmc-1");
+    writeRelease(hostRelease, "host-1");
+    writeRelease(mcuRelease, "mcu-1");
+
+    FunctionalVersions versions({bmcRelease, hostRelease, mcuRelease});
+    EXPECT_TRUE(versions.contains("bmc-1"));
+    EXPECT_TRUE(versions.contains("host-1"));
+    EXPECT_TRUE(versions.contains("mcu-1"));
+    EXPECT_FALSE(versions.contains("bmc-2"));
+
+    // Replaced and rewritten release files are read again.
+    writeRelease(bmcRelease, "bmc-2");
+    {
+        std::ofstream file(mcuRelease, std::ios::trunc);
+        file << "VERSION_ID=mcu-2\n";
+    }
+    EXPECT_TRUE(versions.contains("bmc-2"));
+    EXPECT_FALSE(versions.contains("bmc-1"));
+    EXPECT_TRUE(versions.contains("mcu-2"));
+    EXPECT_FALSE(versions.contains("mcu-1"));
+
+    // A refresh reads the release files again.
+    versions.refresh();
+    EXPECT_TRUE(versions.contains("host-1"));
+    EXPECT_FALSE(versions.contains("host-2"));
+}
+
+/** @brief Make sure the per-version files of the previous layout move into
+ *         the state file, leaving the files of others in place
+ */
+TEST_F(VersionTest, TestStateMigration)
+{
+    using namespace phosphor::software::updater;
+    auto writeLegacy = [](const fs::path& path, const std::string& name,
+                          const auto& value) {
+        std::ofstream os(path);
+        cereal::JSONOutputArchive oarchive(os);
+        oarchive(cereal::make_nvp(name, value));
+    };
+
+    // A version of the mmc layout, with the partlabel of obmc-flash-bmc.
+    auto mmcDir = fs::path(_directory) / "mmc";
+    fs::create_directories(mmcDir);
+    writeLegacy(mmcDir / "priority", "priority", uint8_t(1));
+    writeLegacy(mmcDir / "purpose", "purpose", VersionPurpose::BMC);
+    std::ofstream(mmcDir / "partlabel") << "a";
+
+    auto otherDir = fs::path(_directory) / "other";
+    fs::create_directories(otherDir);
+    writeLegacy(otherDir / "verified", "verified", std::string("abc"));
+
+    auto labelOnlyDir = fs::path(_directory) / "label";
+    fs::create_directories(labelOnlyDir);
+    std::ofstream(labelOnlyDir / "partlabel") << "b";
+
+    {
+        StateStore store(_directory);
+        uint8_t priority = 0;
+        VersionPurpose purpose = VersionPurpose::Unknown;
+        EXPECT_TRUE(store.restorePriority("mmc", priority));
+        EXPECT_EQ(priority, 1);
+        EXPECT_TRUE(store.restorePurpose("mmc", purpose));
+        EXPECT_EQ(purpose, VersionPurpose::BMC);
+        EXPECT_FALSE(store.restorePurpose("label", purpose));
+    }
+
+    EXPECT_TRUE(fs::exists(mmcDir / "partlabel"));
+    EXPECT_FALSE(fs::exists(mmcDir / "priority"));
+    EXPECT_FALSE(fs::exists(mmcDir / "purpose"));
+    EXPECT_FALSE(fs::exists(otherDir));
+    EXPECT_TRUE(fs::exists(labelOnlyDir / "partlabel"));
+
+    // The values are read back from the state file.
+    StateStore store(_directory);
+    std::string fingerprint;
+    uint8_t priority = 0;
+    EXPECT_TRUE(store.restoreVerified("other", fingerprint));
+    EXPECT_EQ(fingerprint, "abc");
+    EXPECT_TRUE(store.restorePriority("mmc", priority));
+    EXPECT_EQ(priority, 1);
+}
+
+/** @brief Make sure the manifest is parsed like Version::getValue does */
+TEST(ManifestTest, TestGet)
+{
+    Manifest manifest("purpose=xyz.openbmc_project.Software.Version."
+                      "VersionPurpose.BMC\r\n"
+                      "version=2.3-rc1\r\n"
+                      "no separator\n"
+                      "KeyType=\n"
+                      "version=shadowed\n"
+                      "HashType=RSA-SHA256");
+
+    EXPECT_FALSE(manifest.empty());
+    EXPECT_EQ(manifest.get("version"), "2.3-rc1");
+    EXPECT_EQ(manifest.get("HashType"), "RSA-SHA256");
+    EXPECT_EQ(manifest.get("purpose"),
+              "xyz.openbmc_project.Software.Version.VersionPurpose.BMC");
+    EXPECT_TRUE(manifest.get("KeyType").empty());
+    EXPECT_TRUE(manifest.get("MachineName").empty());
+    EXPECT_TRUE(manifest.get("no separator").empty());
+
+    // Copies must not refer to the contents of the original
+    Manifest copy;
+    {
+        Manifest original("MachineName=tiogapass");
+        copy = original;
+    }
+    EXPECT_EQ(copy.get("MachineName"), "tiogapass");
+}
+
+/** @brief Make sure a missing manifest file gives an empty manifest */
+TEST(ManifestTest, TestLoadMissing)
+{
+    auto manifest = Manifest::load("/nonexistent/MANIFEST");
+    EXPECT_TRUE(manifest.empty());
+    EXPECT_TRUE(manifest.get("version").empty());
+}
+
 class SignatureTest : public testing::Test
 {
     static constexpr auto opensslCmd = "openssl dgst -sha256 -sign ";
@@ -239,6 +387,27 @@ TEST_F(SignatureTest, TestCorruptSignatureFile)
     EXPECT_FALSE(signature->verify());
 }
 
+/** @brief Test failure scenario with an image changed after signing*/
+TEST_F(SignatureTest, TestCorruptLastImage)
+{
+    // Images are verified in parallel, the failure of the last one must
+    // still fail verification.
+    std::string ubootFile = extractPath.string() + "/" + "image-u-boot";
+    command("dd if=/dev/zero of=" + ubootFile + " bs=1M count=3 2>/dev/null");
+    EXPECT_FALSE(signature->verify());
+}
+
+/** @brief Test for success scenario with an image hashed in several chunks*/
+TEST_F(SignatureTest, TestLargeImage)
+{
+    std::string rofsFile = extractPath.string() + "/" + "image-rofs";
+    std::string pkeyFile = extractPath.string() + "/" + "private.pem";
+    command("head -c 3670017 /dev/urandom > " + rofsFile);
+    command("openssl dgst -sha256 -sign " + pkeyFile + " -out " + rofsFile +
+            ".sig " + rofsFile);
+    EXPECT_TRUE(signature->verify());
+}
+
 /** @brief Test failure scenario with no public key in the image*/
 TEST_F(SignatureTest, TestNoPublicKeyInImage)
 {
@@ -265,6 +434,341 @@ TEST_F(SignatureTest, TestNoConfigFileInSystem)
     EXPECT_FALSE(signature->verify());
 }
 
+/** @brief Test verification of the digests computed during extraction*/
+TEST_F(SignatureTest, TestDigestVerify)
+{
+    // Extract a tarball of the image, hashing the images on the fly
+    auto tarball = extractPath.parent_path() / "image.tar";
+    command("tar -cf " + tarball.string() + " -C " + extractPath.string() +
+            " MANIFEST MANIFEST.sig publickey publickey.sig image-kernel " +
+            "image-kernel.sig image-rofs image-rofs.sig image-rwfs " +
+            "image-rwfs.sig image-u-boot image-u-boot.sig");
+    auto digestPath = extractPath.parent_path() / "digest";
+    fs::create_directories(digestPath);
+
+    DigestCollector collector(
+        {"image-kernel", "image-rofs", "image-rwfs", "image-u-boot"});
+    tar::extract(tarball, digestPath, &collector);
+    EXPECT_EQ(collector.digests().size(), 4u);
+    auto recordDir = extractPath.parent_path() / "digests";
+    EXPECT_TRUE(
+        storeDigests(recordDir, "1234abcd", digestPath, collector.digests()));
+    auto digests = restoreDigests(recordDir, "1234abcd", digestPath);
+    EXPECT_EQ(digests.size(), 4u);
+
+    Signature digestSignature(digestPath, signedConfPath, digests);
+    EXPECT_TRUE(digestSignature.verify());
+}
+
+/** @brief Test failure scenario with a stored digest not matching the image*/
+TEST_F(SignatureTest, TestCorruptDigest)
+{
+    // Store a bogus digest for image-kernel and ensure that verify fails
+    Digests digests;
+    digests["image-kernel"] = {"RSA-SHA256",
+                               fs::file_size(extractPath / "image-kernel"),
+                               std::string(32, '\0')};
+    auto recordDir = extractPath.parent_path() / "digests";
+    EXPECT_TRUE(storeDigests(recordDir, "1234abcd", extractPath, digests));
+    digests = restoreDigests(recordDir, "1234abcd", extractPath);
+    EXPECT_EQ(digests.size(), 1u);
+
+    Signature digestSignature(extractPath, signedConfPath, digests);
+    EXPECT_FALSE(digestSignature.verify());
+}
+
+/** @brief Test that a digest of a modified image is discarded*/
+TEST_F(SignatureTest, TestStaleDigest)
+{
+    Digests digests;
+    digests["image-kernel"] = {"RSA-SHA256",
+                               fs::file_size(extractPath / "image-kernel"),
+                               std::string(32, '\0')};
+    auto recordDir = extractPath.parent_path() / "digests";
+    auto kernelFile = extractPath / "image-kernel";
+    EXPECT_TRUE(storeDigests(recordDir, "1234abcd", extractPath, digests));
+    EXPECT_EQ(restoreDigests(recordDir, "1234abcd", extractPath).size(), 1u);
+
+    // The record is ignored if others could have written it
+    fs::permissions(recordDir / "1234abcd", fs::perms::others_write,
+                    fs::perm_options::add);
+    EXPECT_TRUE(restoreDigests(recordDir, "1234abcd", extractPath).empty());
+    EXPECT_TRUE(storeDigests(recordDir, "1234abcd", extractPath, digests));
+
+    // Changing the image invalidates its digest, even with the size and
+    // modification time of the image restored
+    struct stat st;
+    ASSERT_EQ(stat(kernelFile.c_str(), &st), 0);
+    command("printf X | dd of=" + kernelFile.string() +
+            " conv=notrunc status=none");
+    struct timespec times[2] = {st.st_atim, st.st_mtim};
+    ASSERT_EQ(utimensat(AT_FDCWD, kernelFile.c_str(), times, 0), 0);
+    EXPECT_EQ(fs::file_size(kernelFile), static_cast<uintmax_t>(st.st_size));
+    EXPECT_TRUE(restoreDigests(recordDir, "1234abcd", extractPath).empty());
+
+    removeDigests(recordDir, "1234abcd");
+    EXPECT_FALSE(fs::exists(recordDir / "1234abcd"));
+}
+
+/** @brief Make sure a key file is parsed once, and again once it changes */
+TEST_F(SignatureTest, TestKeyCache)
+{
+    auto& cache = KeyCache::instance();
+    auto pubkeyFile = extractPath / "publickey";
+
+    auto key = cache.publicKey(pubkeyFile);
+    ASSERT_NE(key, nullptr);
+    EXPECT_EQ(cache.publicKey(pubkeyFile), key);
+
+    // Replace the key with a new one
+    command("openssl genrsa -out " + extractPath.string() + "/other.pem 2048");
+    command("openssl rsa -in " + extractPath.string() + "/other.pem " +
+            "-pubout -out " + pubkeyFile.string());
+    auto other = cache.publicKey(pubkeyFile);
+    ASSERT_NE(other, nullptr);
+    EXPECT_NE(other, key);
+
+    EXPECT_EQ(cache.publicKey(extractPath / "missing"), nullptr);
+    EXPECT_EQ(cache.publicKey(extractPath / "MANIFEST"), nullptr);
+
+    EXPECT_NE(cache.digest("SHA256"), nullptr);
+    EXPECT_EQ(cache.digest("SHA256"), cache.digest("SHA256"));
+    EXPECT_EQ(cache.digest("unknown"), nullptr);
+}
+
+/** @brief Test that the keyring follows changes of the configuration dir*/
+TEST_F(SignatureTest, TestKeyring)
+{
+    auto& cache = KeyCache::instance();
+    auto keyring = cache.keyring(signedConfPath);
+    ASSERT_EQ(keyring->size(), 1u);
+    EXPECT_EQ(keyring->at("OpenBMC").hashFunc, "RSA-SHA256");
+    EXPECT_EQ(keyring->at("OpenBMC").publicKey,
+              signedConfOpenBMCPath / "publickey");
+    EXPECT_EQ(cache.keyring(signedConfPath), keyring);
+
+    // A key type sorted ahead of the declared one, with another key.
+    auto otherPath = signedConfPath / "AAA";
+    command("mkdir " + otherPath.string());
+    command("openssl genrsa -out " + otherPath.string() + "/private.pem 2048");
+    command("openssl rsa -in " + otherPath.string() + "/private.pem " +
+            "-outform PEM -pubout -out " + otherPath.string() + "/publickey");
+    command("echo \"HashType=RSA-SHA512\" > " + otherPath.string() +
+            "/hashfunc");
+
+    keyring = cache.keyring(signedConfPath);
+    ASSERT_EQ(keyring->size(), 2u);
+    EXPECT_EQ(keyring->at("AAA").hashFunc, "RSA-SHA512");
+    EXPECT_TRUE(signature->verify());
+
+    command("echo \"HashType=RSA-SHA384\" > " + otherPath.string() +
+            "/hashfunc");
+    EXPECT_EQ(cache.keyring(signedConfPath)->at("AAA").hashFunc,
+              "RSA-SHA384");
+}
+
+/** @brief Test that the fingerprint follows changes of images and keys*/
+TEST_F(SignatureTest, TestFingerprint)
+{
+    auto value = fingerprint(extractPath, signedConfPath, {});
+    EXPECT_EQ(value.size(), 64u);
+    EXPECT_EQ(fingerprint(extractPath, signedConfPath, {}), value);
+
+    // The record of a verification at ingest is kept out of the image dir,
+    // and ignored if others could have written it.
+    auto recordDir = extractPath.parent_path() / "verified";
+    EXPECT_TRUE(restoreIngestVerified(recordDir, "1234abcd").empty());
+    EXPECT_TRUE(storeIngestVerified(recordDir, "1234abcd", value));
+    EXPECT_EQ(restoreIngestVerified(recordDir, "1234abcd"), value);
+    EXPECT_EQ(fingerprint(extractPath, signedConfPath, {}), value);
+    fs::permissions(recordDir / "1234abcd", fs::perms::others_write,
+                    fs::perm_options::add);
+    EXPECT_TRUE(restoreIngestVerified(recordDir, "1234abcd").empty());
+    EXPECT_TRUE(storeIngestVerified(recordDir, "1234abcd", value));
+    fs::permissions(recordDir, fs::perms::group_write, fs::perm_options::add);
+    EXPECT_TRUE(restoreIngestVerified(recordDir, "1234abcd").empty());
+    removeIngestVerified(recordDir, "1234abcd");
+    EXPECT_FALSE(fs::exists(recordDir / "1234abcd"));
+
+    std::string rofsFile = extractPath.string() + "/" + "image-rofs";
+    command("echo \"changed\" >> " + rofsFile);
+    auto changed = fingerprint(extractPath, signedConfPath, {});
+    EXPECT_NE(changed, value);
+
+    std::string hashFile = signedConfOpenBMCPath.string() + "/hashfunc";
+    command("echo \"HashType=RSA-SHA512\" > " + hashFile);
+    EXPECT_NE(fingerprint(extractPath, signedConfPath, {}), changed);
+
+    EXPECT_TRUE(fingerprint("/nonexistent", signedConfPath, {}).empty());
+}
+
+/** @brief Test verification of an image against the hash tree in the
+ *         manifest, in place of its signature file*/
+TEST_F(SignatureTest, TestHashTree)
+{
+    auto dir = extractPath.string() + "/";
+    auto rofsFile = dir + "image-rofs";
+    auto treeFile = rofsFile + HASHTREE_FILE_EXT;
+    auto manifestFile = dir + "MANIFEST";
+
+    // Three chunks of 4096 bytes, the last one short.
+    command("head -c 10000 /dev/urandom > " + rofsFile);
+    command("rm " + rofsFile + ".sig");
+    for (int i = 0; i < 3; i++)
+    {
+        command("{ printf '\\000'; dd if=" + rofsFile +
+                " bs=4096 count=1 status=none skip=" + std::to_string(i) +
+                "; } | openssl dgst -sha256 -binary >> " + treeFile);
+    }
+    command("{ printf '\\001'; head -c 64 " + treeFile +
+            "; } | openssl dgst -sha256 -binary > " + dir + "node");
+    command("{ printf '\\001'; cat " + dir + "node; tail -c 32 " + treeFile +
+            "; } | openssl dgst -sha256 -binary | od -An -tx1 -v | "
+            "tr -d ' \\n' > " + dir + "root");
+    command("{ echo HashTreeType=SHA256; echo HashTreeChunkSize=4096; "
+            "printf HashTreeRoot-image-rofs=; cat " + dir +
+            "root; echo; } >> " + manifestFile);
+    command("openssl dgst -sha256 -sign " + dir + "private.pem -out " +
+            manifestFile + ".sig " + manifestFile);
+
+    signature = std::make_unique<Signature>(extractPath, signedConfPath);
+    EXPECT_TRUE(signature->verify());
+
+    auto tree = HashTree::load(Manifest::load(manifestFile), extractPath,
+                               "image-rofs");
+    ASSERT_TRUE(tree);
+    EXPECT_EQ(tree->chunks(), 3u);
+    EXPECT_FALSE(HashTree::load(Manifest::load(manifestFile), extractPath,
+                                "image-kernel"));
+
+    // Only the chunk that was changed is reported.
+    auto copy = dir + "copy";
+    command("cp " + rofsFile + " " + copy);
+    command("dd if=/dev/zero of=" + copy +
+            " bs=16 seek=300 count=1 conv=notrunc status=none");
+    EXPECT_EQ(tree->verify({copy, 0, fs::file_size(copy)}),
+              std::vector<size_t>{1});
+
+    command("cp " + copy + " " + rofsFile);
+    EXPECT_FALSE(signature->verify());
+
+    // A tree that does not match its root is rejected.
+    command("dd if=/dev/zero of=" + treeFile +
+            " bs=32 seek=1 count=1 conv=notrunc status=none");
+    EXPECT_THROW(HashTree::load(Manifest::load(manifestFile), extractPath,
+                                "image-rofs"),
+                 std::runtime_error);
+}
+
+/** @brief Test that the kernel and OpenSSL hashers compute the same digests,
+ *         the kernel one falling back to OpenSSL where there is no AF_ALG*/
+TEST_F(SignatureTest, TestKernelHash)
+{
+    auto rofsFile = extractPath.string() + "/" + "image-rofs";
+    command("head -c 3000001 /dev/urandom > " + rofsFile);
+    command("tail -c +1001 " + rofsFile + " | openssl dgst -sha512 -binary > " +
+            rofsFile + ".sha512");
+
+    std::ifstream is(rofsFile + ".sha512", std::ios::binary);
+    std::string expected(std::istreambuf_iterator<char>(is), {});
+    ASSERT_EQ(expected.size(), 64u);
+
+    // Hash the file past its first 1000 bytes, as if it were in a tarball.
+    tar::Location location{rofsFile, 1000, fs::file_size(rofsFile) - 1000};
+    for (auto backend : {HashBackend::openssl, HashBackend::kernel})
+    {
+        auto hasher = Hasher::create(EVP_sha512(), backend);
+        ASSERT_TRUE(hasher->update(location));
+        EXPECT_EQ(hasher->final(), expected);
+    }
+
+    // A cancelled hasher stops.
+    std::atomic<bool> cancel = true;
+    EXPECT_FALSE(Hasher::create(EVP_sha256(), HashBackend::kernel)
+                     ->update(location, &cancel));
+
+    command("openssl dgst -sha256 -sign " + extractPath.string() +
+            "/private.pem -out " + rofsFile + ".sig " + rofsFile);
+    signature = std::make_unique<Signature>(extractPath, signedConfPath,
+                                            HashBackend::kernel);
+    EXPECT_TRUE(signature->verify());
+
+    command("dd if=/dev/zero of=" + rofsFile +
+            " bs=16 seek=1000 count=1 conv=notrunc status=none");
+    EXPECT_FALSE(signature->verify());
+}
+
+/** @brief Make sure a moved file descriptor stays open, as the kernel
+ *         hasher moves its operation socket*/
+TEST(CustomFdTest, TestMove)
+{
+    CustomFd fd(open("/dev/null", O_RDONLY | O_CLOEXEC));
+    ASSERT_GE(fd(), 0);
+
+    auto moved = std::make_unique<CustomFd>(std::move(fd));
+    EXPECT_EQ(fd(), -1);
+    EXPECT_NE(fcntl((*moved)(), F_GETFD), -1);
+
+    CustomFd other(open("/dev/null", O_RDONLY | O_CLOEXEC));
+    auto previous = other();
+    other = std::move(*moved);
+    EXPECT_EQ(fcntl(previous, F_GETFD), -1);
+    moved.reset();
+    EXPECT_NE(fcntl(other(), F_GETFD), -1);
+}
+
+/** @brief Test the check of a detached signature over a whole tarball while
+ *         the tarball is extracted*/
+TEST_F(SignatureTest, TestTarballSignature)
+{
+    auto dir = extractPath.parent_path().string() + "/";
+    auto tarball = dir + "image.tar";
+    auto pkeyFile = extractPath.string() + "/private.pem";
+    command("tar -cf " + tarball + " -C " + extractPath.string() +
+            " MANIFEST image-rofs");
+    command("gzip -c " + tarball + " > " + tarball + ".gz");
+    for (auto file : {tarball, tarball + ".gz"})
+    {
+        command("openssl dgst -sha256 -sign " + pkeyFile + " -out " + file +
+                ".sig " + file);
+    }
+    auto readSignature = [](const std::string& file) {
+        std::ifstream is(file + ".sig", std::ios::binary);
+        return std::string(std::istreambuf_iterator<char>(is), {});
+    };
+    fs::create_directory(dir + "out");
+
+    // The tarball is hashed up to its end, past the end of the archive.
+    TarballVerifier verifier(signedConfPath, readSignature(tarball));
+    tar::extract(tarball, dir + "out", nullptr, nullptr, false,
+                 [&verifier](const uint8_t* data, size_t len) {
+                     verifier.update(data, len);
+                 });
+    EXPECT_TRUE(verifier.verify("OpenBMC"));
+
+    // A stream, signed with a system key of another key type.
+    auto fd = open((tarball + ".gz").c_str(), O_RDONLY);
+    ASSERT_GE(fd, 0);
+    TarballVerifier streamVerifier(signedConfPath,
+                                   readSignature(tarball + ".gz"));
+    tar::Reader reader(fd, [&streamVerifier](const uint8_t* data,
+                                             size_t len) {
+        streamVerifier.update(data, len);
+    });
+    tar::extract(reader, dir + "out");
+    reader.drain();
+    close(fd);
+    EXPECT_TRUE(streamVerifier.verify("Other"));
+
+    // The signature of another tarball does not match.
+    TarballVerifier otherVerifier(signedConfPath, readSignature(tarball));
+    tar::extract(tarball + ".gz", dir + "out", nullptr, nullptr, false,
+                 [&otherVerifier](const uint8_t* data, size_t len) {
+                     otherVerifier.update(data, len);
+                 });
+    EXPECT_FALSE(otherVerifier.verify("OpenBMC"));
+}
+
 class FileTest : public testing::Test
 {
   protected:
@@ -332,4 +836,270 @@ TEST_F(FileTest, TestMergeFiles)
     std::string ssRetFile = readFile(fs::path(retFile));
     std::string ssDstFile = readFile(fs::path(dstFile));
     ASSERT_EQ(ssRetFile, ssDstFile);
-}
\ No newline at end of file
+}
+
+class TarTest : public testing::Test
+{
+  protected:
+    void command(const std::string& cmd)
+    {
+        auto val = std::system(cmd.c_str());
+        if (val)
+        {
+            std::cout << "COMMAND Error: " << val << std::endl;
+        }
+    }
+
+    virtual void SetUp()
+    {
+        tmpDir = fs::temp_directory_path() / "testTarXXXXXX";
+        if (!mkdtemp(tmpDir.data()))
+        {
+            throw "Failed to create tmp dir";
+        }
+
+        srcDir = tmpDir + "/src";
+        extractDir = tmpDir + "/extract";
+        command("mkdir -p " + srcDir + "/sub " + extractDir);
+        command("echo \"version=test-version\" > " + srcDir + "/MANIFEST");
+        command("head -c 300000 /dev/urandom > " + srcDir + "/image-rofs");
+        command("echo \"sub file\" > " + srcDir + "/sub/file");
+    }
+
+    virtual void TearDown()
+    {
+        fs::remove_all(tmpDir);
+    }
+
+    std::string tmpDir;
+    std::string srcDir;
+    std::string extractDir;
+};
+
+/** @brief Make sure a plain tarball is extracted unchanged */
+TEST_F(TarTest, TestExtract)
+{
+    auto tarball = tmpDir + "/image.tar";
+    command("tar -cf " + tarball + " -C " + srcDir + " .");
+
+    tar::extract(tarball, extractDir);
+
+    EXPECT_EQ(std::system(("diff -r " + srcDir + " " + extractDir).c_str()),
+              0);
+}
+
+/** @brief Make sure a gzip compressed tarball is extracted unchanged */
+TEST_F(TarTest, TestExtractGzip)
+{
+    auto tarball = tmpDir + "/image.tar.gz";
+    command("tar -czf " + tarball + " -C " + srcDir +
+            " MANIFEST image-rofs sub");
+
+    tar::extract(tarball, extractDir);
+
+    EXPECT_EQ(std::system(("diff -r " + srcDir + " " + extractDir).c_str()),
+              0);
+}
+
+/** @brief Make sure members escaping the extraction dir are rejected */
+TEST_F(TarTest, TestPathTraversal)
+{
+    auto tarball = tmpDir + "/image.tar";
+    command("tar -cf " + tarball + " --transform 's,^,../,' -C " + srcDir +
+            " MANIFEST");
+
+    EXPECT_THROW(tar::extract(tarball, extractDir), std::runtime_error);
+    EXPECT_FALSE(fs::exists(tmpDir + "/MANIFEST"));
+
+    EXPECT_THROW(tar::memberPath("/etc/passwd"), std::runtime_error);
+    EXPECT_THROW(tar::memberPath("a/../../b"), std::runtime_error);
+    EXPECT_EQ(tar::memberPath("./a//b"), fs::path("a/b"));
+    EXPECT_TRUE(tar::memberPath("./").empty());
+}
+
+/** @brief Make sure a truncated tarball is reported as an error */
+TEST_F(TarTest, TestTruncated)
+{
+    auto tarball = tmpDir + "/image.tar";
+    command("tar -cf " + tmpDir + "/full.tar -C " + srcDir + " .");
+    command("head -c 2000 " + tmpDir + "/full.tar > " + tarball);
+
+    EXPECT_THROW(tar::extract(tarball, extractDir), std::runtime_error);
+}
+
+/** @brief Make sure a single member is read without extracting anything */
+TEST_F(TarTest, TestReadMember)
+{
+    auto tarball = tmpDir + "/image.tar";
+    command("tar -cf " + tarball + " -C " + srcDir + " image-rofs MANIFEST");
+
+    std::string data;
+    EXPECT_TRUE(tar::readMember(tarball, "MANIFEST", data, 1024));
+    EXPECT_EQ(data, "version=test-version\n");
+    EXPECT_FALSE(tar::readMember(tarball, "missing", data, 1024));
+    EXPECT_THROW(tar::readMember(tarball, "image-rofs", data, 1024),
+                 std::runtime_error);
+    EXPECT_TRUE(fs::is_empty(extractDir));
+}
+
+/** @brief Make sure large members of a plain tarball are indexed rather
+ *         than extracted, and are read back from the tarball
+ */
+TEST_F(TarTest, TestIndex)
+{
+    auto tarball = tmpDir + "/image.tar";
+    command("head -c 2000000 /dev/urandom > " + srcDir + "/image-bmc");
+    command("tar -cf " + tarball + " -C " + srcDir +
+            " MANIFEST image-bmc image-rofs");
+
+    tar::Index index;
+    tar::extract(tarball, extractDir, nullptr, &index);
+
+    ASSERT_EQ(index.size(), 1);
+    EXPECT_EQ(index.count("image-bmc"), 1);
+    EXPECT_FALSE(fs::exists(extractDir + "/image-bmc"));
+    EXPECT_TRUE(fs::exists(extractDir + "/image-rofs"));
+
+    EXPECT_TRUE(tar::storeIndex(extractDir, index));
+    fs::rename(tarball, fs::path(extractDir) / TARBALL_FILE_NAME);
+    EXPECT_EQ(tar::loadIndex(extractDir).size(), 1);
+
+    auto image = tar::locate(extractDir, "image-bmc");
+    ASSERT_TRUE(image);
+    EXPECT_EQ(image->file, fs::path(extractDir) / TARBALL_FILE_NAME);
+    EXPECT_EQ(image->size, 2000000);
+
+    auto copied = tmpDir + "/image-bmc";
+    tar::copy(*image, copied);
+    EXPECT_EQ(std::system(("cmp " + srcDir + "/image-bmc " + copied).c_str()),
+              0);
+
+    auto manifest = tar::locate(extractDir, "MANIFEST");
+    ASSERT_TRUE(manifest);
+    EXPECT_EQ(manifest->file, fs::path(extractDir) / "MANIFEST");
+    EXPECT_EQ(manifest->offset, 0);
+    EXPECT_FALSE(tar::locate(extractDir, "image-kernel"));
+
+    // A compressed tarball cannot be read in place.
+    index.clear();
+    command("tar -czf " + tarball + ".gz -C " + srcDir + " image-bmc");
+    tar::extract(tarball + ".gz", extractDir, nullptr, &index);
+    EXPECT_TRUE(index.empty());
+    EXPECT_TRUE(fs::exists(extractDir + "/image-bmc"));
+}
+
+/** @brief Make sure the storage of a consumed tarball is released while it
+ *         is extracted
+ */
+TEST_F(TarTest, TestConsume)
+{
+    auto tarball = tmpDir + "/image.tar";
+    command("head -c 4000000 /dev/urandom > " + srcDir + "/image-bmc");
+    command("tar -cf " + tarball + " -C " + srcDir + " .");
+    auto size = fs::file_size(tarball);
+
+    tar::extract(tarball, extractDir, nullptr, nullptr, true);
+
+    EXPECT_EQ(std::system(("diff -r " + srcDir + " " + extractDir).c_str()),
+              0);
+
+    // The size is kept, the data is gone.
+    struct stat st;
+    ASSERT_EQ(stat(tarball.c_str(), &st), 0);
+    EXPECT_EQ(static_cast<uint64_t>(st.st_size), size);
+    EXPECT_LT(static_cast<uint64_t>(st.st_blocks) * 512, size / 2);
+}
+
+/** @brief Make sure a stream is read with a deadline, whether blocking or
+ *         not, and a stalled one fails once the deadline passes
+ */
+TEST_F(TarTest, TestStreamDeadline)
+{
+    auto tarball = tmpDir + "/image.tar";
+    command("tar -cf " + tarball + " -C " + srcDir + " .");
+    auto deadline = std::chrono::steady_clock::now() + std::chrono::seconds(5);
+
+    std::ifstream is(tarball, std::ios::binary);
+    std::string data(std::istreambuf_iterator<char>(is), {});
+
+    // The writer sends the tarball in pieces to a non blocking stream.
+    int pipeFds[2];
+    ASSERT_EQ(pipe2(pipeFds, O_NONBLOCK), 0);
+    std::thread writer([&data, fd = pipeFds[1]]() {
+        size_t pos = 0;
+        while (pos < data.size())
+        {
+            auto rc = write(fd, data.data() + pos,
+                            std::min<size_t>(data.size() - pos, 10000));
+            if (rc > 0)
+            {
+                pos += rc;
+            }
+            std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        }
+        close(fd);
+    });
+    {
+        tar::Reader reader(pipeFds[0], nullptr, deadline);
+        tar::extract(reader, extractDir);
+    }
+    writer.join();
+    close(pipeFds[0]);
+    EXPECT_EQ(std::system(("diff -r " + srcDir + " " + extractDir).c_str()),
+              0);
+
+    // The writer never sends anything.
+    ASSERT_EQ(pipe(pipeFds), 0);
+    auto start = std::chrono::steady_clock::now();
+    EXPECT_THROW(tar::Reader(pipeFds[0], nullptr,
+                             start + std::chrono::milliseconds(100)),
+                 std::runtime_error);
+    EXPECT_LT(std::chrono::steady_clock::now() - start,
+              std::chrono::seconds(5));
+    close(pipeFds[0]);
+    close(pipeFds[1]);
+}
+
+/** @brief Make sure the priority index orders versions and finds the ones
+ *         to move like freePriority did
+ */
+TEST(PriorityIndexTest, TestCollisions)
+{
+    using phosphor::software::updater::PriorityIndex;
+    using Entries = std::vector<PriorityIndex::Entry>;
+
+    PriorityIndex index;
+    EXPECT_EQ(index.lowest(), nullptr);
+
+    index.add("a", 0);
+    index.add("b", 1);
+    index.add("c", 2);
+    index.add("d", 4);
+    EXPECT_EQ(*index.lowest(), PriorityIndex::Entry(0, "a"));
+
+    // "d" taking 1 moves "b" and "c", the move stops at the free 3.
+    index.set("d", 1);
+    EXPECT_EQ(index.collisions("d", 1), (Entries{{2, "b"}, {3, "c"}}));
+    EXPECT_EQ(index.collisions("c", 3), Entries{});
+
+    // Of the versions sharing a value only the last one moves.
+    EXPECT_EQ(index.collisions("a", 1), (Entries{{2, "d"}, {3, "c"}}));
+
+    // Of the versions sharing the lowest value the last one wins.
+    index.set("a", 5);
+    EXPECT_EQ(*index.lowest(), PriorityIndex::Entry(1, "d"));
+
+    // Values do not move past the highest one.
+    index.set("a", 255);
+    EXPECT_EQ(index.collisions("b", 255), Entries{});
+
+    // A replaced RedundancyPriority is created before the old one goes.
+    index.add("b", 7);
+    index.remove("b");
+    EXPECT_EQ(*index.lowest(), PriorityIndex::Entry(1, "d"));
+    index.remove("b");
+    index.remove("d");
+    EXPECT_EQ(*index.lowest(), PriorityIndex::Entry(2, "c"));
+    index.set("c", 255);
+    EXPECT_EQ(*index.lowest(), PriorityIndex::Entry(255, "c"));
+}
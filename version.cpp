@@ -2,13 +2,18 @@
 
 #include "version.hpp"
 
+#include "manifest.hpp"
 #include "xyz/openbmc_project/Common/error.hpp"
 
 #include <openssl/sha.h>
+#include <sys/inotify.h>
+#include <unistd.h>
 
 #include <phosphor-logging/elog-errors.hpp>
 #include <phosphor-logging/log.hpp>
 
+#include <array>
+#include <cerrno>
 #include <fstream>
 #include <iostream>
 #include <sstream>
@@ -26,52 +31,165 @@ using namespace phosphor::logging;
 using Argument = xyz::openbmc_project::Common::InvalidArgument;
 using namespace sdbusplus::xyz::openbmc_project::Common::Error;
 
-std::string Version::getValue(const std::string& manifestFilePath,
-                              std::string key)
+namespace // anonymous
 {
-    key = key + "=";
-    auto keySize = key.length();
 
-    if (manifestFilePath.empty())
+// Changes to a release file, followed if it is a symlink as os-release
+// usually is.
+constexpr uint32_t fileMask =
+    IN_MODIFY | IN_CLOSE_WRITE | IN_ATTRIB | IN_DELETE_SELF | IN_MOVE_SELF;
+
+// Release files created, replaced or removed in their dir.
+constexpr uint32_t dirMask = IN_CREATE | IN_DELETE | IN_MOVED_FROM |
+                             IN_MOVED_TO | IN_CLOSE_WRITE | IN_MODIFY;
+
+} // namespace
+
+FunctionalVersions::FunctionalVersions(
+    const std::vector<fs::path>& releaseFiles)
+{
+    for (const auto& path : releaseFiles)
     {
-        log<level::ERR>("Error MANIFESTFilePath is empty");
-        elog<InvalidArgument>(
-            Argument::ARGUMENT_NAME("manifestFilePath"),
-            Argument::ARGUMENT_VALUE(manifestFilePath.c_str()));
+        releases.push_back({path, std::nullopt});
     }
+}
 
-    std::string value{};
-    std::ifstream efile;
-    std::string line;
-    efile.exceptions(std::ifstream::failbit | std::ifstream::badbit |
-                     std::ifstream::eofbit);
+FunctionalVersions::~FunctionalVersions()
+{
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+}
 
-    // Too many GCC bugs (53984, 66145) to do this the right way...
-    try
+FunctionalVersions& FunctionalVersions::instance()
+{
+    static FunctionalVersions versions(
+        {OS_RELEASE_FILE, BIOS_FW_FILE, MCU_FW_FILE});
+    return versions;
+}
+
+bool FunctionalVersions::changed()
+{
+    // Large enough for any event, whatever the name length.
+    alignas(inotify_event) std::array<char, 4096> buf;
+    auto result = false;
+    while (true)
     {
-        efile.open(manifestFilePath);
-        while (getline(efile, line))
+        auto len = read(fd, buf.data(), buf.size());
+        if (len < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (len <= 0)
+        {
+            // Nothing left to read, or an error that calls for a new watch.
+            return result || !(len < 0 && errno == EAGAIN);
+        }
+
+        for (auto p = buf.data(); p < buf.data() + len;)
         {
-            if (!line.empty() && line.back() == '\r')
+            auto event = reinterpret_cast<const inotify_event*>(p);
+            p += sizeof(inotify_event) + event->len;
+
+            // Events of the files themselves have no name, the dirs report
+            // the changes of every file in them.
+            if (event->len == 0 || (event->mask & IN_Q_OVERFLOW))
             {
-                // If the manifest has CRLF line terminators, e.g. is created on
-                // Windows, the line will contain \r at the end, remove it.
-                line.pop_back();
+                result = true;
+                continue;
             }
-            if (line.compare(0, keySize, key) == 0)
+            for (const auto& release : releases)
             {
-                value = line.substr(keySize);
-                break;
+                if (release.path.filename() == event->name)
+                {
+                    result = true;
+                }
             }
         }
-        efile.close();
     }
-    catch (const std::exception& e)
+}
+
+void FunctionalVersions::watch()
+{
+    for (auto& release : releases)
+    {
+        release.version.reset();
+    }
+
+    // Watch before reading, so changes made while reading are not missed.
+    // A release file that does not exist yet is caught by its dir watch.
+    if (fd >= 0)
+    {
+        close(fd);
+    }
+    fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    for (const auto& release : releases)
+    {
+        if (fd >= 0 && inotify_add_watch(fd, release.path.parent_path().c_str(),
+                                         dirMask) < 0)
+        {
+            close(fd);
+            fd = -1;
+        }
+        if (fd >= 0)
+        {
+            inotify_add_watch(fd, release.path.c_str(), fileMask);
+        }
+    }
+}
+
+bool FunctionalVersions::contains(const std::string& version)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (fd < 0 || changed())
+    {
+        watch();
+    }
+
+    for (auto& release : releases)
+    {
+        // Read in order and only as needed, a release file without a
+        // version fails the same way as before it was cached.
+        if (!release.version)
+        {
+            release.version = Version::getBMCVersion(release.path);
+        }
+        if (*release.version == version)
+        {
+            return true;
+        }
+    }
+    return false;
+}
+
+void FunctionalVersions::refresh()
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    for (auto& release : releases)
+    {
+        release.version.reset();
+    }
+}
+
+std::string Version::getValue(const std::string& manifestFilePath,
+                              std::string key)
+{
+    if (manifestFilePath.empty())
+    {
+        log<level::ERR>("Error MANIFESTFilePath is empty");
+        elog<InvalidArgument>(
+            Argument::ARGUMENT_NAME("manifestFilePath"),
+            Argument::ARGUMENT_VALUE(manifestFilePath.c_str()));
+    }
+
+    auto manifest = Manifest::load(manifestFilePath);
+    if (manifest.empty())
     {
         log<level::ERR>("Error in reading MANIFEST file");
     }
 
-    return value;
+    return std::string(manifest.get(key));
 }
 
 std::string Version::getId(const std::string& version)
@@ -175,14 +293,7 @@ std::string Version::getBMCVersion(const std::string& releaseFilePath)
 
 bool Version::isFunctional()
 {
-    if(versionStr == getBMCVersion(OS_RELEASE_FILE))
-        return true;
-    else if(versionStr == getBMCVersion(BIOS_FW_FILE))
-        return true;
-    else if(versionStr == getBMCVersion(MCU_FW_FILE))
-        return true;
-    else
-        return false;
+    return FunctionalVersions::instance().contains(versionStr);
 }
 
 void Delete::delete_()
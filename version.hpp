@@ -6,8 +6,12 @@
 
 #include <sdbusplus/bus.hpp>
 
+#include <filesystem>
 #include <functional>
+#include <mutex>
+#include <optional>
 #include <string>
+#include <vector>
 
 namespace phosphor
 {
@@ -16,6 +20,8 @@ namespace software
 namespace manager
 {
 
+namespace fs = std::filesystem;
+
 typedef std::function<void(std::string)> eraseFunc;
 
 using VersionInherit = sdbusplus::server::object::object<
@@ -27,6 +33,80 @@ using DeleteInherit = sdbusplus::server::object::object<
 class Version;
 class Delete;
 
+/** @class FunctionalVersions
+ *  @brief The versions of the running BMC, host and MCU firmware.
+ *  @details The versions are read from their release files once, and again
+ *           only once inotify reports a change to a release file or its
+ *           dir, or on refresh(). Safe to use from any thread.
+ */
+class FunctionalVersions
+{
+  public:
+    FunctionalVersions(const FunctionalVersions&) = delete;
+    FunctionalVersions& operator=(const FunctionalVersions&) = delete;
+    FunctionalVersions(FunctionalVersions&&) = delete;
+    FunctionalVersions& operator=(FunctionalVersions&&) = delete;
+
+    /** @brief Constructs FunctionalVersions
+     *
+     *  @param[in] releaseFiles - The release files, BMC first, then host
+     *                            and MCU
+     */
+    explicit FunctionalVersions(const std::vector<fs::path>& releaseFiles);
+
+    ~FunctionalVersions();
+
+    /** @brief The versions of OS_RELEASE_FILE, BIOS_FW_FILE and MCU_FW_FILE,
+     *         shared by all Version objects.
+     */
+    static FunctionalVersions& instance();
+
+    /** @brief Check whether a version is one of the running versions.
+     *
+     *  @param[in] version - The version string
+     *
+     *  @return true if the version is running
+     *
+     *  @throw InternalFailure if a release file has to be read to tell and
+     *         it has no version, as Version::getBMCVersion()
+     */
+    bool contains(const std::string& version);
+
+    /** @brief Read the release files again on the next call, as one may
+     *         have been rewritten since.
+     */
+    void refresh();
+
+  private:
+    /** @struct Release
+     *  @brief A release file and its version, unset until it is read.
+     */
+    struct Release
+    {
+        fs::path path;
+        std::optional<std::string> version;
+    };
+
+    /** @brief Whether inotify reported a change to a release file since the
+     *         last call.
+     */
+    bool changed();
+
+    /** @brief Forget the versions read and watch the release files again */
+    void watch();
+
+    /** @brief Protects releases and fd */
+    std::mutex mutex;
+
+    /** @brief The release files, in the order they are compared */
+    std::vector<Release> releases;
+
+    /** @brief The inotify instance watching the release files, -1 if there
+     *         is none and they are read on every call.
+     */
+    int fd = -1;
+};
+
 /** @class Delete
  *  @brief OpenBMC Delete implementation.
  *  @details A concrete implementation for xyz.openbmc_project.Object.Delete
@@ -127,7 +207,8 @@ class Version : public VersionInherit
      */
     static std::string getBMCVersion(const std::string& releaseFilePath);
 
-    /* @brief Check if this version matches the currently running version
+    /* @brief Check if this version matches the currently running version,
+     *        see FunctionalVersions.
      *
      * @return - Returns true if this version matches the currently running
      *           version.
@@ -97,7 +97,14 @@ int Watch::callback(sd_event_source* /* s */, int fd, uint32_t revents,
     while (offset < bytes)
     {
         auto event = reinterpret_cast<inotify_event*>(&buffer[offset]);
-        if ((event->mask & IN_CLOSE_WRITE) && !(event->mask & IN_ISDIR))
+        auto isImage = (event->mask & IN_CLOSE_WRITE) &&
+                       !(event->mask & IN_ISDIR);
+#ifdef WANT_SIGNATURE_VERIFY
+        // A detached tarball signature is picked up with its tarball.
+        isImage = isImage &&
+                  fs::path(event->name).extension() != SIGNATURE_FILE_EXT;
+#endif
+        if (isImage)
         {
             auto tarballPath = std::string{IMG_UPLOAD_DIR} + '/' + event->name;
             auto rc = static_cast<Watch*>(userdata)->imageCallback(tarballPath);
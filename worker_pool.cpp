@@ -0,0 +1,152 @@
+#include "worker_pool.hpp"
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include <phosphor-logging/log.hpp>
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+namespace utils
+{
+
+using namespace phosphor::logging;
+using namespace std::string_literals;
+
+WorkerPool::WorkerPool(size_t size)
+{
+    size = std::max<size_t>(size, 1);
+    for (size_t i = 0; i < size; i++)
+    {
+        threads.emplace_back(&WorkerPool::run, this);
+    }
+}
+
+WorkerPool::~WorkerPool()
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        stopping = true;
+        queue.clear();
+    }
+    cv.notify_all();
+
+    for (auto& thread : threads)
+    {
+        thread.join();
+    }
+}
+
+void WorkerPool::post(std::function<void()> work)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        queue.push_back(std::move(work));
+    }
+    cv.notify_one();
+}
+
+void WorkerPool::run()
+{
+    while (true)
+    {
+        std::function<void()> work;
+        {
+            std::unique_lock<std::mutex> lock(mutex);
+            cv.wait(lock, [this] { return stopping || !queue.empty(); });
+            if (stopping)
+            {
+                return;
+            }
+            work = std::move(queue.front());
+            queue.pop_front();
+        }
+
+        try
+        {
+            work();
+        }
+        catch (const std::exception& e)
+        {
+            log<level::ERR>("Worker failed", entry("ERROR=%s", e.what()));
+        }
+    }
+}
+
+EventDispatcher::EventDispatcher(sd_event* loop)
+{
+    fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (-1 == fd)
+    {
+        auto error = errno;
+        throw std::runtime_error("eventfd failed, errno="s +
+                                 std::strerror(error));
+    }
+
+    auto rc = sd_event_add_io(loop, &source, fd, EPOLLIN, callback, this);
+    if (0 > rc)
+    {
+        close(fd);
+        throw std::runtime_error("failed to add to event loop, rc="s +
+                                 std::strerror(-rc));
+    }
+}
+
+EventDispatcher::~EventDispatcher()
+{
+    sd_event_source_unref(source);
+    close(fd);
+}
+
+void EventDispatcher::post(std::function<void()> work)
+{
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        queue.push_back(std::move(work));
+    }
+
+    uint64_t value = 1;
+    if (write(fd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+    {
+        auto error = errno;
+        throw std::runtime_error("failed to signal event loop, errno="s +
+                                 std::strerror(error));
+    }
+}
+
+int EventDispatcher::callback(sd_event_source* /* s */, int fd,
+                              uint32_t revents, void* userdata)
+{
+    if (!(revents & EPOLLIN))
+    {
+        return 0;
+    }
+
+    uint64_t value;
+    if (read(fd, &value, sizeof(value)) < 0 && errno != EAGAIN)
+    {
+        auto error = errno;
+        throw std::runtime_error("failed to read eventfd, errno="s +
+                                 std::strerror(error));
+    }
+
+    auto dispatcher = static_cast<EventDispatcher*>(userdata);
+    std::deque<std::function<void()>> work;
+    {
+        std::lock_guard<std::mutex> lock(dispatcher->mutex);
+        work.swap(dispatcher->queue);
+    }
+
+    for (auto& item : work)
+    {
+        item();
+    }
+
+    return 0;
+}
+
+} // namespace utils
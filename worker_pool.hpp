@@ -0,0 +1,117 @@
+#pragma once
+
+#include <systemd/sd-event.h>
+
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+namespace utils
+{
+
+/** @class WorkerPool
+ *  @brief Runs queued work on a fixed number of threads.
+ *  @details Work that is still queued when the pool is destroyed is
+ *           discarded, the destructor waits for running work to finish.
+ */
+class WorkerPool
+{
+  public:
+    WorkerPool() = delete;
+    WorkerPool(const WorkerPool&) = delete;
+    WorkerPool& operator=(const WorkerPool&) = delete;
+    WorkerPool(WorkerPool&&) = delete;
+    WorkerPool& operator=(WorkerPool&&) = delete;
+
+    /** @brief Constructs WorkerPool
+     *
+     *  @param[in] size - Number of worker threads, at least one is started
+     */
+    explicit WorkerPool(size_t size);
+
+    ~WorkerPool();
+
+    /** @brief Queue work to be run on one of the worker threads.
+     *
+     *  @param[in] work - The work to run
+     */
+    void post(std::function<void()> work);
+
+  private:
+    /** @brief Worker thread main loop */
+    void run();
+
+    /** @brief Protects queue and stopping */
+    std::mutex mutex;
+
+    /** @brief Signaled when work is queued or the pool is stopping */
+    std::condition_variable cv;
+
+    /** @brief Work waiting for a worker thread */
+    std::deque<std::function<void()>> queue;
+
+    /** @brief Set when the pool is destroyed */
+    bool stopping = false;
+
+    /** @brief The worker threads */
+    std::vector<std::thread> threads;
+};
+
+/** @class EventDispatcher
+ *  @brief Runs work posted from any thread on the sd-event loop thread.
+ *  @details An eventfd wakes up the event loop whenever work is posted.
+ *           Work that has not run when the dispatcher is destroyed is
+ *           discarded.
+ */
+class EventDispatcher
+{
+  public:
+    EventDispatcher() = delete;
+    EventDispatcher(const EventDispatcher&) = delete;
+    EventDispatcher& operator=(const EventDispatcher&) = delete;
+    EventDispatcher(EventDispatcher&&) = delete;
+    EventDispatcher& operator=(EventDispatcher&&) = delete;
+
+    /** @brief Constructs EventDispatcher
+     *
+     *  @param[in] loop - sd-event object running the posted work
+     */
+    explicit EventDispatcher(sd_event* loop);
+
+    ~EventDispatcher();
+
+    /** @brief Queue work to be run on the event loop thread.
+     *
+     *  @param[in] work - The work to run
+     */
+    void post(std::function<void()> work);
+
+  private:
+    /** @brief sd-event callback, runs all queued work
+     *
+     *  @param[in] s - event source
+     *  @param[in] fd - eventfd
+     *  @param[in] revents - events that matched for fd
+     *  @param[in] userdata - pointer to EventDispatcher object
+     *  @returns 0 on success
+     */
+    static int callback(sd_event_source* s, int fd, uint32_t revents,
+                        void* userdata);
+
+    /** @brief eventfd used to wake up the event loop */
+    int fd = -1;
+
+    /** @brief sd-event source of fd */
+    sd_event_source* source = nullptr;
+
+    /** @brief Protects queue */
+    std::mutex mutex;
+
+    /** @brief Work waiting for the event loop */
+    std::deque<std::function<void()>> queue;
+};
+
+} // namespace utils